@@ -18,17 +18,35 @@
 */
 
 /** Include standard C headers */
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
-#include <sys/time.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 
 #include "lv2/lv2plug.in/ns/ext/atom/atom.h"
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
 #include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/log/log.h"
+#include "lv2/lv2plug.in/ns/ext/state/state.h"
 #include "lv2/lv2plug.in/ns/ext/time/time.h"
 #include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
 #include "lv2/lv2plug.in/ns/lv2core/lv2.h"
 #include <lv2/lv2plug.in/ns/ext/midi/midi.h>
 
@@ -47,6 +65,38 @@ typedef struct {
 	LV2_URID time_beatsPerMinute;
 	LV2_URID time_beatsPerBar;
 	LV2_URID time_speed;
+	LV2_URID alo_Load;
+	LV2_URID alo_loops;
+	LV2_URID alo_clicks;
+	LV2_URID alo_events;
+	LV2_URID alo_histogram;
+	LV2_URID alo_memory;
+	LV2_URID alo_Export;
+	LV2_URID alo_loop;
+	LV2_URID alo_progress;
+	LV2_URID alo_path;
+	LV2_URID alo_Overview;
+	LV2_URID alo_phase;
+	LV2_URID alo_states;
+	LV2_URID alo_Peaks;
+	LV2_URID alo_first;
+	LV2_URID alo_peaks;
+	LV2_URID log_Trace;
+	LV2_URID alo_rate;		// state: sample rate the loops were saved at
+	LV2_URID alo_bpm;
+	LV2_URID alo_bpb;
+	LV2_URID alo_speed;
+	LV2_URID alo_loopBeats;
+	LV2_URID alo_loopSamples;
+	LV2_URID alo_loopStart;
+	LV2_URID alo_maxFrames;
+	LV2_URID alo_midiControl;
+	LV2_URID alo_patterns;		// state: loop on/off patterns for programs
+	LV2_URID alo_loopState;		// state: one element per loop from here on
+	LV2_URID alo_buttonState;
+	LV2_URID alo_phraseStart;
+	LV2_URID alo_storage;
+	LV2_URID alo_scale;
 } AloURIs;
 
 typedef enum {
@@ -70,6 +120,26 @@ typedef enum {
 	ALO_MIX = 17,
 	ALO_RESET_MODE = 18,
 	ALO_ENABLED = 19,
+	ALO_MAX_LOOP = 20,
+	ALO_ONSET_MODE = 21,
+	ALO_STORAGE = 22,
+	ALO_LOAD_METER = 23,
+	ALO_LOAD = 24,
+	ALO_LOAD_PEAK = 25,
+	ALO_NOTIFY = 26,
+	ALO_TRACE = 27,
+	ALO_CLICK_OUT = 28,
+	ALO_CLICK_ROUTE = 29,
+	ALO_FREEWHEEL = 30,
+	ALO_EXPORT = 31,
+	ALO_MIDI_CHANNEL = 32,
+	ALO_METERS = 33,
+	ALO_INPUT_PEAK = 34,
+	ALO_INPUT_RMS = 35,
+	ALO_OUTPUT_PEAK = 36,
+	ALO_OUTPUT_RMS = 37,
+	ALO_CAPTURE = 38,
+	ALO_LOOP1_PEAK = 39,	// then rms, and the same for each loop after it
 } PortIndex;
 
 typedef enum {
@@ -80,24 +150,101 @@ typedef enum {
 } State;
 
 typedef enum {
-    STATE_OFF,      // No click
-    STATE_ATTACK,  // Envelope rising
-    STATE_DECAY,   // Envelope lowering
-    STATE_SILENT  // Silent
-} ClickState;
-
-static const size_t LOOP_SIZE = 2880000;
-static const int NUM_LOOPS = 6;
+	ONSET_PEAK,	// any sample over the threshold starts a phrase
+	ONSET_ENVELOPE	// the smoothed level has to rise through the threshold
+} OnsetMode;
+
+typedef enum {
+	STORAGE_FLOAT,	// loops are kept as 32 bit floats
+	STORAGE_PCM16,	// loops are kept as 16 bit samples, scaled per loop
+	STORAGE_DISK	// loops are streamed to and from a file
+} Storage;
+
+/** Bytes in a buffer of all the channels */
+static inline size_t
+buffer_size(uint32_t frames, int channels, Storage storage)
+{
+	return (size_t)frames * channels * (storage == STORAGE_PCM16 ? sizeof(int16_t) : sizeof(float));
+}
+
+typedef enum {
+	SECTION_LOOPS,	// run_loops()
+	SECTION_CLICKS,	// run_clicks()
+	SECTION_EVENTS,	// run_events()
+	NUM_SECTIONS
+} Section;
+
+#define PORT_LOOPS 6	// loop switches in the PortIndex layout
 static const bool LOG_ENABLED = false;
 
 #define DEFAULT_BEATS_PER_BAR 4
 #define DEFAULT_NUM_BARS 4
 #define DEFAULT_BPM 120
 #define DEFAULT_INSTANT_LOOPS 0
+#define DEFAULT_MAX_LOOP 60	// seconds
+#define DOUBLE_TAP 1.0		// seconds between presses to reset a loop
 
 #define HIGH_BEAT_FREQ 880
 #define LOW_BEAT_FREQ 440
+#define CLICK_MIN_BPM 10	// slower than this, a bar of click is too long to render
+
+#define STRETCH_WINDOW 0.04	// seconds of loop overlapped at a time when stretching
+#define STRETCH_SEEK 0.01	// how far either way to look for the best match
+
+#define ONSET_CHUNK 16		// samples checked per step when scanning for onsets
+#define ONSET_MAX 16		// envelope onsets remembered per block
+#define ONSET_ATTACK 0.005	// envelope follower attack, in seconds
+#define ONSET_RELEASE 0.05	// envelope follower release, in seconds
+#define ONSET_HYSTERESIS 0.5f	// gate closes again 6dB below the threshold
+
+#define PCM16_MAX 32767.0f
+#define PCM16_FLOOR 1e-6f	// smallest full scale for a 16 bit loop
+
+#define LOAD_REPORT 0.5		// seconds between load reports
+#define LOAD_BINS 11		// block load histogram in 10% steps, plus overruns
+#define LEVEL_FLOOR -60.0f	// dB, the quietest level the meters show
+#define LEVEL_FALL 20.0f	// dB a second that peaks fall back by
+#define LEVEL_WINDOW 0.3	// seconds rms levels are averaged over
+
+#define TRACE_SIZE 1024		// trace records buffered, a power of two
+
+#define STREAM_WINDOW 65536	// frames of RAM for each streamed loop, a power of two
+#define STREAM_OPS 1024		// recording operations queued for the worker
+#define STREAM_CHUNK 4096	// frames the worker reads or writes at a time
 
+#define EXPORT_DIR "/tmp"	// where exported loops go, unless ALO_EXPORT_DIR says
+#define EXPORT_CHUNK 4096	// frames the worker writes at a time
+#define EXPORT_REPORTS 8	// progress reports per exported loop
+
+#define OVERVIEW_LEAVES 16384	// finest peaks kept of the ring, a power of two
+#define OVERVIEW_POINTS 128	// peaks across each loop, for drawing it
+#define OVERVIEW_REPORT 0.04	// seconds between overview reports
+#define OVERVIEW_BUDGET 64	// most peaks sent in one report
+
+#define MIDI_CC_MIX 20		// controller for the mix, 0..127 to 0..100
+#define MIDI_CC_CLICK 21	// controller for the click volume, 0..127 to 0..10
+#define MIDI_CC_RESET 22	// controller that wipes all the loops (64 and up)
+#define MIDI_CC_STORE 23	// held at 64 and up, program changes store patterns
+#define MIDI_CC_CAPTURE 24	// held at 64 and up, arming an empty loop captures
+#define MIDI_CC_LOOPS 102	// controllers for loop 1 onwards, on at 64 and up
+#define MIDI_PATTERNS 128	// loop on/off patterns, one per program
+#define PATTERN_SET 0x80000000u	// marks a pattern that has been stored
+
+// The number of loops is a template parameter, so loops over the loops in
+// run() can be unrolled into straight line code for each variant.
+#if defined(__clang__)
+#define UNROLL_LOOPS _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define UNROLL_LOOPS _Pragma("GCC unroll 16")
+#else
+#define UNROLL_LOOPS
+#endif
+#define LOG_FILE "/root/alo.log"
+
+/**
+   Write a line to the log file.  This opens and closes the file every time, so
+   it isn't for use in run(): the audio thread uses trace() instead.
+*/
 void log(const char *message, ...)
 {
 	if (!LOG_ENABLED) {
@@ -105,7 +252,7 @@ void log(const char *message, ...)
 	}
 
 	FILE* f;
-	f = fopen("/root/alo.log", "a+");
+	f = fopen(LOG_FILE, "a+");
 
 	char buffer[2048];
 	va_list argumentList;
@@ -117,6 +264,100 @@ void log(const char *message, ...)
 	fclose(f);
 }
 
+///
+/// Flush denormals to zero (and treat denormal inputs as zero) for the
+/// duration of run(), so fading loops and clicks don't hit the slow path.
+/// Returns the previous floating point mode, to hand to restore_fp_mode().
+///
+static inline uint32_t
+enable_ftz(void)
+{
+#if defined(__SSE__)
+	const uint32_t mode = _mm_getcsr();
+	_mm_setcsr(mode | 0x8040); // FTZ | DAZ
+	return mode;
+#elif defined(__aarch64__)
+	uint64_t fpcr;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr | (1 << 24)));
+	return (uint32_t)fpcr;
+#elif defined(__arm__) && defined(__ARM_FP)
+	uint32_t fpscr;
+	__asm__ __volatile__("vmrs %0, fpscr" : "=r"(fpscr));
+	__asm__ __volatile__("vmsr fpscr, %0" : : "r"(fpscr | (1 << 24)));
+	return fpscr;
+#else
+	return 0;
+#endif
+}
+
+static inline void
+restore_fp_mode(uint32_t mode)
+{
+#if defined(__SSE__)
+	_mm_setcsr(mode);
+#elif defined(__aarch64__)
+	__asm__ __volatile__("msr fpcr, %0" : : "r"((uint64_t)mode));
+#elif defined(__arm__) && defined(__ARM_FP)
+	__asm__ __volatile__("vmsr fpscr, %0" : : "r"(mode));
+#else
+	(void)mode;
+#endif
+}
+
+///
+/// Read a cheap, monotonic cycle counter for the load meter.
+///
+static inline uint64_t
+read_counter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+///
+/// Counter ticks per second.  The x86 TSC rate has to be measured against the
+/// clock, which takes a millisecond, so that is done once per process.
+///
+static double
+counter_rate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static double cached = 0.0;
+	double rate;
+	__atomic_load(&cached, &rate, __ATOMIC_RELAXED);
+	if (rate == 0.0) {
+		struct timespec start, now;
+		double elapsed;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		const uint64_t ticks = read_counter();
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (now.tv_sec - start.tv_sec)
+				+ (now.tv_nsec - start.tv_nsec) * 1e-9;
+		} while (elapsed < 0.001);
+		rate = (read_counter() - ticks) / elapsed;
+		__atomic_store(&cached, &rate, __ATOMIC_RELAXED);
+	}
+	return rate;
+#elif defined(__aarch64__)
+	uint64_t freq;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+	return (double)freq;
+#else
+	return 1e9;
+#endif
+}
+
 ///
 /// Convert an input parameter expressed as db into a linear float value
 ///
@@ -127,23 +368,594 @@ static float dbToFloat(float db)
     return powf(10.0f, db * 0.05f);
 }
 
+/**
+   Loop memory shared by every instance in the process.  Sample buffers are
+   leased from the pool in whole chunks, up to a budget set in megabytes by
+   ALO_POOL_MB when the first instance is created, so a board of several
+   instances only has to fit the loops actually recorded.  Without a budget
+   a buffer is mapped when leased and unmapped when returned.  With one, a
+   buffer that would go over it is refused, and returned leases are kept for
+   the next buffer the same size, until the budget needs the room or the last
+   instance goes.  Buffers are only leased and returned outside run().
+
+   Each lease is locked into memory, or failing that (RLIMIT_MEMLOCK is often
+   small) at least faulted in, so run() never takes a page fault writing to
+   a new stretch of a loop.  ALO_HUGEPAGES=transparent asks for transparent
+   huge pages, and ALO_HUGEPAGES=explicit for pages from the hugetlbfs pool,
+   falling back to ordinary pages if there are none free.
+*/
+#define POOL_CHUNK (1 << 20)
+#define POOL_HUGE_PAGE (2 << 20)	// explicit huge page size, as on x86-64 and aarch64
+
+typedef struct PoolLease {
+	struct PoolLease* next;	// in the pool's free list
+	size_t            chunks; // counted against the budget, or 0 if not
+	size_t            length; // bytes mapped, or 0 if from calloc()
+	bool              locked;
+	char              pad[64 - sizeof(void*) - 2 * sizeof(size_t) - sizeof(bool)];
+} PoolLease;	// just ahead of the buffer it was leased for
+
+typedef enum {
+	HUGE_PAGES_NONE,
+	HUGE_PAGES_TRANSPARENT,
+	HUGE_PAGES_EXPLICIT
+} HugePages;
+
+static struct {
+	pthread_mutex_t lock;
+	int             users;	// instances holding the pool
+	size_t          budget;	// in chunks, or 0 for no limit
+	HugePages       huge;
+	bool            lock_warned;
+	size_t          leased;	// chunks in buffers handed out...
+	size_t          locked;	// ...and how many of those are locked
+	size_t          cached;	// chunks in the free list
+	PoolLease*      free_list;
+} pool = { PTHREAD_MUTEX_INITIALIZER, 0, 0, HUGE_PAGES_NONE, false, 0, 0, 0, NULL };
+
+static void
+pool_acquire(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (pool.users++ == 0) {
+		const char* const mb = getenv("ALO_POOL_MB");
+		const char* const huge = getenv("ALO_HUGEPAGES");
+		pool.budget = mb ? (size_t)strtoul(mb, NULL, 10) * ((1 << 20) / POOL_CHUNK) : 0;
+		pool.huge = !huge ? HUGE_PAGES_NONE
+			: !strcmp(huge, "transparent") ? HUGE_PAGES_TRANSPARENT
+			: !strcmp(huge, "explicit") ? HUGE_PAGES_EXPLICIT : HUGE_PAGES_NONE;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/** Unmap a lease, or free it if it didn't come from map_lease() */
+static void
+unmap_lease(PoolLease* lease)
+{
+	if (lease->length) {
+		munmap(lease, lease->length);
+	} else {
+		free(lease);
+	}
+}
+
+static void
+pool_release(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (--pool.users == 0) {
+		while (pool.free_list) {
+			PoolLease* const lease = pool.free_list;
+			pool.free_list = lease->next;
+			unmap_lease(lease);
+		}
+		pool.cached = 0;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+   Map a new lease of the given number of chunks, lock it if we may, and
+   fault it all in either way.
+*/
+static PoolLease*
+map_lease(size_t chunks)
+{
+	size_t length = chunks * POOL_CHUNK;
+	void* map = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (pool.huge == HUGE_PAGES_EXPLICIT) {
+		const size_t huge = (length + POOL_HUGE_PAGE - 1) / POOL_HUGE_PAGE * POOL_HUGE_PAGE;
+		map = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (map != MAP_FAILED) {
+			length = huge;
+		}
+	}
+#endif
+	if (map == MAP_FAILED) {
+		map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (pool.huge == HUGE_PAGES_TRANSPARENT) {
+			madvise(map, length, MADV_HUGEPAGE);
+		}
+#endif
+	}
+
+	PoolLease* const lease = (PoolLease*)map;
+	lease->locked = mlock(map, length) == 0;
+	if (!lease->locked) {
+		const long page = sysconf(_SC_PAGESIZE);
+		for (size_t k = 0; k < length; k += page > 0 ? page : 4096) {
+			((volatile char*)map)[k] = 0;
+		}
+		if (!__atomic_exchange_n(&pool.lock_warned, true, __ATOMIC_RELAXED)) {
+			log("Loop buffers could not be locked into memory; "
+			    "raise RLIMIT_MEMLOCK to lock them");
+		}
+	}
+	lease->length = length;
+	lease->chunks = chunks;
+	return lease;
+}
+
+/**
+   Lease a zeroed buffer of bytes from the pool, or NULL if it would go over
+   the budget.  Buffers that aren't loops (a bar of click, say) pass false for
+   counted, and are never refused; they are faulted in but not locked.
+*/
+static void*
+pool_alloc(size_t bytes, bool counted)
+{
+	const size_t chunks = counted
+		? (bytes + sizeof(PoolLease) + POOL_CHUNK - 1) / POOL_CHUNK : 0;
+	PoolLease* lease = NULL;
+
+	if (!counted) {
+		lease = (PoolLease*)calloc(1, sizeof(PoolLease) + bytes);
+		if (lease) {
+			memset(lease + 1, 0, bytes);	// fault it in here, not in run()
+		}
+		return lease ? lease + 1 : NULL;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.budget) {
+		for (PoolLease** l = &pool.free_list; *l; l = &(*l)->next) {
+			if ((*l)->chunks == chunks) {
+				lease = *l;
+				*l = lease->next;
+				pool.cached -= chunks;
+				break;
+			}
+		}
+		while (!lease && pool.free_list
+		       && pool.leased + pool.cached + chunks > pool.budget) {
+			PoolLease* const old = pool.free_list;
+			pool.free_list = old->next;
+			pool.cached -= old->chunks;
+			unmap_lease(old);
+		}
+		if (!lease && pool.leased + chunks > pool.budget) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+	}
+	__atomic_add_fetch(&pool.leased, chunks, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool.lock);
+
+	if (lease) {
+		memset(lease + 1, 0, bytes);
+	} else if (!(lease = map_lease(chunks))) {
+		__atomic_sub_fetch(&pool.leased, chunks, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (lease->locked) {
+		__atomic_add_fetch(&pool.locked, chunks, __ATOMIC_RELAXED);
+	}
+	return lease + 1;
+}
+
+/** Give a buffer from pool_alloc() back */
+static void
+pool_free(void* buffer)
+{
+	if (!buffer) {
+		return;
+	}
+	PoolLease* const lease = (PoolLease*)buffer - 1;
+	if (!lease->chunks) {
+		free(lease);
+		return;
+	}
+	pthread_mutex_lock(&pool.lock);
+	__atomic_sub_fetch(&pool.leased, lease->chunks, __ATOMIC_RELAXED);
+	if (lease->locked) {
+		__atomic_sub_fetch(&pool.locked, lease->chunks, __ATOMIC_RELAXED);
+	}
+	if (pool.budget) {
+		lease->next = pool.free_list;
+		pool.free_list = lease;
+		pool.cached += lease->chunks;
+		pthread_mutex_unlock(&pool.lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	unmap_lease(lease);
+}
+
+/** Whether a buffer from pool_alloc() is locked into memory */
+static inline bool
+pool_locked(const void* buffer)
+{
+	return ((const PoolLease*)buffer - 1)->locked;
+}
+
+/**
+   Messages passed between run() and the worker thread.  Buffers are
+   allocated lazily: run() schedules WORK_ALLOCATE when it first needs one,
+   the worker leases the buffer from the pool and hands it back in a
+   response, and run() schedules WORK_FREE to return buffers on reset.
+*/
+typedef enum {
+	WORK_ALLOCATE,
+	WORK_FREE,
+	WORK_UNMAP,	// dispose of a loop restored from a file
+	WORK_TRACE,	// write out the trace ring
+	WORK_STREAM_OPEN,	// set up disk storage
+	WORK_STREAM,	// write what was recorded, and read ahead for playback
+	WORK_STREAM_CLOSE,
+	WORK_CLICK,	// render a bar of click (frames long, with loop beats)
+	WORK_STRETCH,	// stretch a loop to a new tempo (a StretchWork)
+	WORK_EXPORT	// write a loop to a WAV file (an ExportWork)
+} WorkType;
+
+#define SPARE_LOOP -2	// the loop number of the buffer kept ready for captures
+
+typedef struct {
+	WorkType type;
+	int      loop;    // loop number, -1 for the recording buffer or SPARE_LOOP
+	uint32_t frames;  // buffer capacity in frames per channel
+	Storage  storage; // sample format of the buffer
+	void*    buffer;  // buffer to free, or the newly allocated buffer
+} AloWork;
+
+/**
+   Stretching a loop needs more than fits in an AloWork.  The request has the
+   loop's buffer, and frames and storage for the new one; the response has the
+   new buffer in its place, or NULL.
+*/
+typedef struct {
+	AloWork  work;
+	uint32_t job;	  // which request for this loop it is
+	uint32_t start;	  // loop_start, in both buffers
+	uint32_t from;	  // old loop length
+	uint32_t to;	  // new loop length
+	uint32_t old_frames; // frames per channel in the loop's buffer
+	float    scale;	  // for 16 bit loops, kept for the new buffer
+} StretchWork;
+
+/**
+   Exporting a loop sends the worker the loop's buffer (or the disk storage,
+   for a loop on disk) and where the loop is in it.  The worker answers a few
+   times as it goes, with how far it has got, and once more at the end.
+*/
+typedef struct {
+	AloWork  work;
+	uint32_t job;	   // which request for this loop it is
+	uint32_t start;	   // first frame of the loop in the buffer
+	uint32_t length;   // loop length in frames
+	float    scale;	   // for 16 bit loops
+	float    progress; // response: fraction written, 1 when done, -1 if it failed
+} ExportWork;
+
+/**
+   A committed loop is a view onto the recording ring.  The ring already holds
+   the last pass of input, at the mix level it was recorded at, so committing
+   a loop copies nothing: samples are
+   frozen into the loop's own buffer one at a time, just before the ring
+   overwrites them, which costs a single copy pass after the commit.
+*/
+typedef struct {
+	float*   data;     // frozen samples, indexed like recording[]
+	int16_t* pcm;      // or, with compact storage, 16 bit samples...
+	float    scale;    // ...and the value of one step
+	float    peak;     // loudest input since the phrase started, at the mix level
+	uint32_t frames;   // capacity of data or pcm, in frames per channel
+	uint32_t offset;   // first frame of the loop (loop_start at commit)
+	uint32_t length;   // loop length in frames (loop_samples at commit)
+	uint32_t unfrozen; // frames still held only in the ring
+	bool     mapped;   // data or pcm is a saved loop file, mapped read only
+} LoopView;
+
+/**
+   Onset detection is shared by all the loops waiting for a phrase to start, so
+   it looks at the input once per block however many loops are armed.
+*/
+typedef struct {
+	OnsetMode mode;
+	bool      active;	// some loop is waiting for a phrase to start
+	float     attack;	// envelope follower coefficients
+	float     release;
+	float     envelope;
+	bool      gate;		// envelope is over the threshold
+	uint32_t  onsets[ONSET_MAX]; // block offsets where the gate opened
+	uint32_t  n_onsets;
+	uint32_t  from;		// peak mode: the last search started here...
+	uint32_t  found;	// ...and found this
+} OnsetDetector;
+
+/**
+   Min/max peaks of the recording ring, kept as a binary tree over leaves of
+   (1 << shift) frames: node 1 covers the whole ring, node k covers what its
+   children 2k and 2k + 1 do, and the leaves are nodes OVERVIEW_LEAVES on.
+   Recording updates a leaf and its parents, so the peaks of any stretch of
+   the ring are a few nodes away however long it is.  Peaks are in 127ths of
+   full scale.
+*/
+typedef struct {
+	uint32_t shift;
+	int8_t   lo[2 * OVERVIEW_LEAVES];
+	int8_t   hi[2 * OVERVIEW_LEAVES];
+} PeakTree;
+
+/**
+   What GUIs are shown of a loop: OVERVIEW_POINTS min/max peaks across it, and
+   which of them haven't been sent yet.
+*/
+typedef struct {
+	int8_t   lo[OVERVIEW_POINTS];
+	int8_t   hi[OVERVIEW_POINTS];
+	bool     dirty[OVERVIEW_POINTS];	// not sent since they changed
+} LoopOverview;
+
+/**
+   Things worth knowing about when chasing a state machine bug.  run() records
+   them in a ring with trace(), and the worker writes them out.
+*/
+typedef enum {
+	TRACE_RESET,		// value: loop length in frames
+	TRACE_SPEED,		// value: transport speed
+	TRACE_TEMPO,		// value: beats per minute
+	TRACE_BEAT,		// value: position in the bar
+	TRACE_BUTTON_ON,
+	TRACE_BUTTON_OFF,
+	TRACE_LOOP_RESET,	// double tap wiped the loop
+	TRACE_PHRASE_START,
+	TRACE_COMMIT_DEFERRED,	// loop buffer hasn't arrived
+	TRACE_LOOP_ON,
+	TRACE_LOOP_OFF,
+	TRACE_ABANDON,		// button released before the phrase was recorded
+	TRACE_BEAT_LOOP_ON,
+	TRACE_BEAT_LOOP_OFF,
+	TRACE_RECORDING_READY,
+	TRACE_LOOP_READY,
+	TRACE_ALLOCATION_FAILED,
+	TRACE_SCHEDULE_FAILED,
+	TRACE_STREAM_UNDERRUN,	// value: frames of a streamed loop not played
+	TRACE_STREAM_OVERRUN,	// value: frames recorded but not written
+	TRACE_STRETCHED,	// value: new loop length in frames
+	TRACE_UNLOCKED,		// buffer arrived, but couldn't be locked in memory
+	TRACE_CAPTURE,		// the last pass was taken as the loop
+	NUM_TRACE_EVENTS
+} TraceEvent;
+
+static const char* const trace_names[NUM_TRACE_EVENTS] = {
+	"reset", "speed", "tempo", "beat", "button on", "button off",
+	"loop reset", "phrase start", "commit deferred", "loop on", "loop off",
+	"abandon phrase", "beat loop on", "beat loop off", "recording ready",
+	"loop ready", "allocation failed", "schedule failed", "stream underrun",
+	"stream overrun", "loops stretched", "buffer not locked", "capture"
+};
+
+typedef struct {
+	uint64_t frame;		// frames since instantiation
+	uint32_t loop_index;
+	uint16_t event;		// TraceEvent
+	int16_t  loop;		// loop number, or -1
+	float    value;
+} TraceRecord;
+
+/**
+   Single producer, single consumer ring of trace records.  run() is the only
+   writer of head and the worker the only writer of tail, so neither side ever
+   waits for the other; when the ring is full, records are counted and dropped.
+*/
+typedef struct {
+	TraceRecord records[TRACE_SIZE];
+	uint32_t head;		// next record run() will write
+	uint32_t tail;		// next record the worker will read
+	uint32_t dropped;	// written by run()...
+	uint32_t reported;	// ...and the worker's note of how many it has told
+	bool     on;
+	bool     pending;	// a drain has been scheduled
+	FILE*    file;		// where records go without the log feature
+} TraceRing;
+
+/**
+   Disk storage.  The recording ring and the loops live in one (deleted)
+   file, each in its own region, and all the reading and writing is done by
+   the worker.  run() hands recorded frames and what it does with them to the
+   worker through a queue of operations, and plays each loop from a window
+   that the worker keeps filled ahead of it.  Neither side waits for the
+   other: if the worker falls behind, recorded frames are dropped and loops
+   play silence until it catches up.
+*/
+typedef enum {
+	STREAM_DATA,	// frames were recorded at index
+	STREAM_COMMIT,	// loop was set at index: the last pass of the ring is the loop
+	STREAM_FORGET,	// loop was wiped
+	STREAM_WIPE	// all the loops were wiped
+} StreamOpType;
+
+typedef struct {
+	uint16_t type;		// StreamOpType
+	int16_t  loop;
+	uint32_t index;		// loop_index of the first frame, or where the loop was set
+	uint32_t count;		// data: frames waiting in the recording queue
+	uint32_t start;		// commit: loop_start...
+	uint32_t length;	// ...and loop_samples
+	float    gain;		// data: the mix level the frames were recorded at
+	bool     overdub;	// data: the overdub loop is playing over these frames
+} StreamOp;
+
+/**
+   Frames of one loop in the order they will be played, read ahead by the
+   worker.  run() asks for the window to start somewhere else by bumping
+   wanted, and the worker answers by bumping served; in between, run() doesn't
+   touch the frames.
+*/
+typedef struct {
+	float*   frames;	// STREAM_WINDOW frames per channel, one channel after another
+	uint32_t wanted;	// seeks asked for by run()...
+	uint32_t seek;		// ...starting at this loop_index,
+	uint32_t seek_start;	// in a loop starting here
+	uint32_t seek_length;	// and this long,
+	uint32_t seek_input;	// where the ring had got to in the input queue
+	bool     reseek;	// run(): the phrase has moved
+	uint32_t read;		// frames run() has had since the seek
+	uint32_t served;	// worker: seeks carried out
+	uint32_t start;		// where the current one starts
+	uint32_t loop_start;
+	uint32_t length;
+	uint32_t input;		// and where the ring was
+	uint32_t written;	// frames read ahead since the seek
+} StreamWindow;
+
+/** What the worker knows about a loop it is writing */
+typedef struct {
+	bool     committed;
+	uint32_t at;		// loop_index where the loop was set
+	uint32_t start;
+	uint32_t length;
+	uint32_t frozen;	// frames copied from the ring to the loop so far
+} StreamLoop;
+
+template <int N, int C>
+struct Streams {
+	int       fd;		// region 0 is the ring, region i + 1 loop i
+	uint32_t  frames;	// frames in each region
+	float*    input;	// recorded frames, STREAM_WINDOW per channel
+	uint32_t  input_head;	// run() only
+	uint32_t  input_tail;	// worker, as it writes them out
+	StreamOp  ops[STREAM_OPS];
+	uint32_t  ops_head;	// written by run()...
+	uint32_t  ops_tail;	// ...and read by the worker
+	StreamLoop   loops[N];
+	StreamWindow windows[N];
+};
+
+/**
+   DSP load, as a fraction of the block deadline, gathered while the load meter
+   is switched on and reported every LOAD_REPORT seconds.
+*/
+typedef struct {
+	double   tick_rate;	// cycle counter ticks per second
+	bool     on;
+	float    min[NUM_SECTIONS];
+	float    max[NUM_SECTIONS];
+	float    sum[NUM_SECTIONS];
+	float    total;		// sum of whole block loads...
+	float    peak;		// ...and the worst of them
+	uint32_t histogram[LOAD_BINS];
+	uint32_t blocks;
+	uint32_t frames;	// frames since the last report
+} LoadMeter;
+
+/**
+   The level of a signal: run_loops() adds in the peak and energy of each
+   stretch of it as it goes by, and report_levels() turns them into what the
+   meter shows at the end of each cycle.
+*/
+typedef struct {
+	float peak;	// this cycle so far...
+	float energy;	// ...and its sum of squares, over all channels
+	float held;	// the peak shown, falling back at LEVEL_FALL
+	float power;	// mean square, averaged over LEVEL_WINDOW
+} LevelMeter;
+
+/**
+   What a MIDI message does, looked up by channel, kind and note, controller
+   or program number in a table built whenever the MIDI ports change (see
+   build_midi_map()), so midi_event() needn't work it out for every message.
+*/
+typedef enum {
+	MIDI_NONE,
+	MIDI_LOOP,	// press (note on, controller at 64 and up) or release loop arg
+	MIDI_MIX,
+	MIDI_CLICK,
+	MIDI_RESET,
+	MIDI_STORE,	// program changes store patterns rather than recall them
+	MIDI_CAPTURE,	// arming an empty loop captures the last pass into it
+	MIDI_PATTERN	// recall (or store) pattern arg
+} MidiAction;
+
+typedef enum {
+	MIDI_KIND_NOTE,
+	MIDI_KIND_CONTROLLER,
+	MIDI_KIND_PROGRAM,
+	MIDI_KINDS
+} MidiKind;
+
+typedef struct {
+	uint8_t action;	// a MidiAction
+	uint8_t arg;
+} MidiBinding;
+
+typedef MidiBinding MidiMap[16][MIDI_KINDS][128];
+
+/**
+   A control that MIDI can set as well as its port.  MIDI holds it until the
+   port is moved, so whichever was changed last wins.
+*/
+typedef struct {
+	float value;	// set by MIDI, or negative if the port has it
+	float port;	// the port when MIDI set it
+} MidiOverride;
+
+/**
+   The value of a control that MIDI can override.
+*/
+static inline float
+override_value(const MidiOverride* midi, const float* port)
+{
+	return midi->value >= 0.0f && *port == midi->port ? midi->value : *port;
+}
+
+static inline void
+set_override(MidiOverride* midi, const float* port, float value)
+{
+	midi->value = value;
+	midi->port = *port;
+}
+
 /**
    Every plugin defines a private structure for the plugin instance.  All data
    associated with a plugin instance is stored here, and is available to
-   every instance method.
+   every instance method.  N is the number of loops and C the number of
+   channels; every buffer holds its C channels one after the other (planar),
+   each as many frames long as the buffer's capacity.
 */
-typedef struct {
+template <int N, int C>
+struct Alo {
 
 	LV2_URID_Map* map;   // URID map feature
+	LV2_Worker_Schedule* schedule;	// Worker feature, NULL if unsupported
+	LV2_Log_Log* logger;	// Log feature, NULL if unsupported
+	pthread_mutex_t saving;	// keeps the worker from freeing what save() reads
 	AloURIs	    uris;    // Cache of mapped URIDs
+	LV2_Atom_Forge forge; // for writing to the notify port
 
 	// Port buffers
 	struct {
-		const float* input_l;
-		const float* input_r;
-		float* output_l;
-		float* output_r;
-		float* loops[NUM_LOOPS];
+		const float* input[C];
+		float* output[C];
+		float* loops[N];
 		float* bars;
 		float* threshold;
 		float* midi_base;	// start note for midi control of loops
@@ -152,8 +964,29 @@ typedef struct {
 		float* mix;
 		float* reset_mode;
 		int*   enabled;
+		float* max_loop;	// maximum loop length in seconds
+		float* onset_mode;	// how phrase starts are detected
+		float* storage;		// sample format for loops
+		float* load_meter;	// switches load measurement on
+		float* load;		// mean DSP load, in % of the deadline
+		float* load_peak;	// worst block, in % of the deadline
+		float* trace;		// switches tracing on
+		float* click_out;	// the click on its own, if connected
+		float* click_route;	// 1 sends the click to click_out
+		float* freewheel;	// the host is rendering offline, if connected
+		float* export_loop;	// loop to write to a file, N + 1 for all of them
+		float* midi_channel;	// channel MIDI is taken from, or 0 for all of them
+		float* meters;		// switches the level meters on
+		float* input_peak;	// levels in dB, for setting the threshold and mix
+		float* input_rms;
+		float* output_peak;
+		float* output_rms;
+		float* capture;		// arming an empty loop takes the last pass
+		float* loop_peak[N];
+		float* loop_rms[N];
 		LV2_Atom_Sequence* control;
 		LV2_Atom_Sequence* midiin;	// midi input
+		LV2_Atom_Sequence* notify;	// reports to the host or GUI
 	} ports;
 
 	// Variables to keep track of the tempo information sent by the host
@@ -162,40 +995,101 @@ typedef struct {
 	float  bpb;		// Beats per bar
 	float  speed;		// Transport speed (usually 0=stop, 1=play)
 	float threshold;	// minimum level to trigger loop start
+	OnsetDetector onset;	// finds phrase starts for all loops
+	LoadMeter meter;	// where run() spends its time
+	bool metering;		// the level meters are on this cycle
+	LevelMeter input_level;
+	LevelMeter output_level;
+	LevelMeter loop_level[N]; // what each loop adds to the outputs
+	TraceRing trace;	// what run() has been doing
+	bool bypassed;		// lv2:enabled is 0: the loops were wiped, and are held off
 	uint32_t loop_beats;	// loop length in beats
 	uint32_t loop_samples;	// loop length in samples
 	uint32_t current_bb;	// which beat of the bar we are on (1, 2, 3, 0)
 	uint32_t current_lb;	// which beat of the loop we are on (1, 2, ...)
-	float current_position;
 
 	uint32_t pb_loops;	// number of loops in instant mode
 
-	State state[NUM_LOOPS];	   // we're recording, playing or not playing
+	State state[N];	   // we're recording, playing or not playing
 
-	bool button_state[NUM_LOOPS];
-	bool midi_control;
-	uint32_t  button_time[NUM_LOOPS]; // last time button was pressed
+	bool button_state[N];
+	bool switch_state[N];	// the loop switches, as they were last cycle
+	bool midi_control;	// MIDI has driven the loops (kept in state for old versions)
+	uint64_t frames;	// frames processed since instantiation
+	uint64_t button_time[N]; // frame when button was last pressed
 
-	float* loops[NUM_LOOPS]; // pointers to memory for playing loops
-	uint32_t phrase_start[NUM_LOOPS]; // index into recording/loop
+	LoopView loops[N]; // views onto recorded loops
+	uint32_t phrase_start[N]; // index into recording/loop
 	float* recording;    // pointer to memory for recording - for all loops
+	uint32_t recording_frames; // capacity of recording, in frames per channel
+	uint32_t max_frames; // longest loop we allow, in frames
+	Storage storage;     // sample format for new loop buffers
+	bool loop_pending[N]; // allocation requested from the worker
+	bool recording_pending;
+	bool loop_refused[N]; // the pool had no room, so don't ask until re-armed
+	bool recording_refused;
+	void* spare;	     // a loop buffer kept ready for captures (see capture())
+	uint32_t spare_frames;
+	Storage spare_storage;
+	bool spare_pending;
+	bool spare_refused;
+	bool capture_wanted[N]; // loop i is to take the last pass (once off index 0)
+	Streams<N, C>* streams; // disk storage, when it's in use
+	bool streams_pending; // disk storage requested from the worker
+	bool streams_refused; // the worker couldn't open it, so don't ask until reset
+	bool stream_job;     // the worker has disk work queued
 	uint32_t loop_start; // non-zero for free-running loops
 	uint32_t loop_index; // index into loop for current play point
 
-	ClickState clickstate;
+	// A tempo change being taken up by stretching the loops (see retempo())
+	uint32_t stretch_length; // new loop_samples, or 0 if there isn't one
+	bool stretch_wanted[N]; // loop i is to be stretched...
+	bool stretch_sent[N];	// ...has been sent to the worker...
+	void* stretched[N];	// ...and this is what came back
+	uint32_t stretch_job[N]; // the latest request for loop i
 
-	uint32_t elapsed_len;  // Frames since the start of the last click
-	uint32_t wave_offset;  // Current play offset in the wave
-
-	// Click beats
+	// Click beats, and a bar of them rendered by the worker for the tempo
 	float*   high_beat;
 	float*   low_beat;
 	uint32_t beat_len;
-	uint32_t high_beat_offset;
-	uint32_t low_beat_offset;
+	uint32_t bar_frames;	// frames in a bar at the current tempo
+	uint32_t bar_beats;
+	float*   click_bar;	// a bar of click...
+	uint32_t click_frames;	// ...this long,
+	uint32_t click_beats;	// with this many beats
+	uint32_t click_phase;	// frames into the bar
+	bool     click_pending;	// a bar has been asked for
+
+	// Loops being written to WAV files by the worker (see request_exports())
+	float    export_value;	// the export port, as it was last cycle
+	bool     export_wanted[N]; // loop i is to be exported...
+	bool     export_pinned[N]; // ...is being read by the worker...
+	uint32_t export_job[N];	// ...for this request,
+	float    export_progress[N]; // which has got this far (-1 if it failed)
+	bool     export_report[N]; // progress to send on the notify port
+	char     export_path[N][256]; // the file, written by the worker when done
+
+	// MIDI dispatch (see midi_event())
+	MidiMap  midi_map;
+	float    map_base;	// the MIDI ports the map was built for
+	float    map_channel;
+	bool     midi_store;	// MIDI_CC_STORE is held down
+	uint32_t patterns[MIDI_PATTERNS]; // loops on for each program, | PATTERN_SET
+	MidiOverride midi_mix;
+	MidiOverride midi_click;
+	MidiOverride midi_capture;
+
+	// Waveforms for GUIs (see update_overview())
+	PeakTree peak_tree;	// the ring as it is recorded, at the mix level
+	LoopOverview overview[N];
+	uint32_t overview_start; // the loop the recording loops were drawn for
+	uint32_t overview_length;
+	uint32_t overview_index; // loop_index as it was at the last report
+	uint32_t overview_frames; // since the last report
+	uint32_t overview_next;	// loop to send peaks for first next time
 	float inmix;
 	float loopmix;
-} Alo;
+};
 
 void
 sine_pulse(float* target, double frequency, double sample_rate, uint32_t num_samples)
@@ -217,51 +1111,360 @@ sine_pulse(float* target, double frequency, double sample_rate, uint32_t num_sam
 }
 
 /**
-   The `instantiate()` function is called by the host to create a new plugin
-   instance.  The host passes the plugin descriptor, sample rate, and bundle
-   path for plugins that need to load additional resources (e.g. waveforms).
-   The features parameter contains host-provided features defined in LV2
-   extensions, but this simple plugin does not use any.
+   Render a bar of click, the high pulse on the first beat and the low one on
+   the rest, each starting on the frame its beat falls on.  A pulse that runs
+   past the end of the bar wraps round to the start.
+*/
+static float*
+render_click(const float* high, const float* low, uint32_t pulse_len,
+	     uint32_t frames, uint32_t beats)
+{
+	float* const bar = frames ? (float*)pool_alloc(frames * sizeof(float), false) : NULL;
+	if (!bar) {
+		return NULL;
+	}
+	for (uint32_t b = 0; b < beats; b++) {
+		const float* const pulse = b ? low : high;
+		const uint32_t at = (uint32_t)((uint64_t)frames * b / beats);
+		for (uint32_t k = 0; k < pulse_len; k++) {
+			bar[(at + k) % frames] += pulse[k];
+		}
+	}
+	return bar;
+}
 
-   This function is in the ``instantiation'' threading class, so no other
-   methods on this instance will be called concurrently with it.
+/**
+   Work out how long a bar is at the current tempo.  Called whenever bpm or
+   bpb are set, so run() doesn't have to.
 */
-static LV2_Handle
-instantiate(const LV2_Descriptor*     descriptor,
-	    double		      rate,
-	    const char*		      bundle_path,
-	    const LV2_Feature* const* features)
+template <int N, int C>
+static void
+set_bar(Alo<N, C>* self)
 {
-	log("Instantiate");
+	self->bar_beats = self->bpb >= 1.0f ? (uint32_t)floorf(self->bpb) : 1;
+	self->bar_frames = self->bpm >= CLICK_MIN_BPM
+		? (uint32_t)lrint(self->bar_beats * 60.0 * self->rate / self->bpm) : 0;
+}
 
-	Alo* self = (Alo*)calloc(1, sizeof(Alo));
-	self->rate = rate;
-	self->bpb = DEFAULT_BEATS_PER_BAR;
-	self->loop_beats = DEFAULT_BEATS_PER_BAR * DEFAULT_NUM_BARS;
-	self->bpm = DEFAULT_BPM;
-	self->loop_samples = self->loop_beats * self->rate  * 60.0f / self->bpm;
-	self->current_bb = 0;
-	self->current_lb = 0;
-	self->current_position = 0.0f;
-	self->pb_loops = DEFAULT_INSTANT_LOOPS;
-	
-	self->midi_control = false;
+/**
+   Empty the peak tree, with leaves small enough for a ring of frames.
+*/
+static void
+set_peak_tree(PeakTree* tree, uint32_t frames)
+{
+	tree->shift = 0;
+	while (((uint64_t)OVERVIEW_LEAVES << tree->shift) < frames) {
+		tree->shift++;
+	}
+	memset(tree->lo, 0, sizeof(tree->lo));
+	memset(tree->hi, 0, sizeof(tree->hi));
+}
 
-	self->recording = (float *)calloc(LOOP_SIZE * 2, sizeof(float));
+static inline int8_t
+to_peak(float x)
+{
+	return (int8_t)lrintf(fminf(fmaxf(x, -1.0f), 1.0f) * 127.0f);
+}
 
-	for (int i = 0; i < NUM_LOOPS; i++) {
-		self->loops[i] = (float *)calloc(LOOP_SIZE * 2, sizeof(float));
-		self->phrase_start[i] = 0;
-		self->state[i] = STATE_RECORDING;
-	}
-	self->loop_start = 0;
-	self->loop_index = 0;
-	self->threshold = 0.0;
+static inline int8_t
+min_peak(int8_t a, int8_t b)
+{
+	return a < b ? a : b;
+}
 
-	LV2_URID_Map* map = NULL;
-	for (int i = 0; features[i]; ++i) {
-		if (!strcmp(features[i]->URI, LV2_URID_URI "#map")) {
+static inline int8_t
+max_peak(int8_t a, int8_t b)
+{
+	return a > b ? a : b;
+}
+
+/**
+   Put the peaks of input frames [0, n), recorded at ring frame index with
+   this gain, into the tree.  A leaf starts afresh when recording reaches its first frame, or
+   wraps round to restart in it, and takes in the rest of the pass after.
+   Every frame is looked at, 4 at a time so they can go in one vector, so a
+   peak is never missed, whatever the block length.
+*/
+template <int C>
+static void
+peak_tree_record(PeakTree* tree, uint32_t index, const float* const* in, float gain,
+		 uint32_t n, uint32_t restart)
+{
+	for (uint32_t k = 0; k < n;) {
+		const uint32_t frame = index + k;
+		const uint32_t leaf = frame >> tree->shift;
+		if (leaf >= OVERVIEW_LEAVES) {
+			return;
+		}
+		const uint64_t leaf_end = (uint64_t)(leaf + 1) << tree->shift;
+		const uint32_t len = leaf_end - frame < n - k ? (uint32_t)(leaf_end - frame) : n - k;
+		float lo4[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		float hi4[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int c = 0; c < C; c++) {
+			const float* const x = in[c] + k;
+			uint32_t j = 0;
+			for (; j + 4 <= len; j += 4) {
+				for (int q = 0; q < 4; q++) {
+					lo4[q] = fminf(lo4[q], x[j + q]);
+					hi4[q] = fmaxf(hi4[q], x[j + q]);
+				}
+			}
+			for (; j < len; j++) {
+				lo4[0] = fminf(lo4[0], x[j]);
+				hi4[0] = fmaxf(hi4[0], x[j]);
+			}
+		}
+		const float lo = gain * fminf(fminf(lo4[0], lo4[1]), fminf(lo4[2], lo4[3]));
+		const float hi = gain * fmaxf(fmaxf(hi4[0], hi4[1]), fmaxf(hi4[2], hi4[3]));
+
+		uint32_t node = OVERVIEW_LEAVES + leaf;
+		const bool fresh = frame == leaf << tree->shift || frame == restart;
+		tree->lo[node] = fresh ? to_peak(lo) : min_peak(tree->lo[node], to_peak(lo));
+		tree->hi[node] = fresh ? to_peak(hi) : max_peak(tree->hi[node], to_peak(hi));
+		for (node >>= 1; node; node >>= 1) {
+			const int8_t node_lo = min_peak(tree->lo[2 * node], tree->lo[2 * node + 1]);
+			const int8_t node_hi = max_peak(tree->hi[2 * node], tree->hi[2 * node + 1]);
+			if (node_lo == tree->lo[node] && node_hi == tree->hi[node]) {
+				break;	// so are the ones above
+			}
+			tree->lo[node] = node_lo;
+			tree->hi[node] = node_hi;
+		}
+		k += len;
+	}
+}
+
+/**
+   The peaks of ring frames [from, to), from the fewest nodes that cover them.
+*/
+static void
+peak_tree_range(const PeakTree* tree, uint32_t from, uint32_t to, int8_t* lo, int8_t* hi)
+{
+	uint32_t a = from >> tree->shift;
+	uint32_t b = to > from ? ((to - 1) >> tree->shift) + 1 : a + 1;
+	a = a < OVERVIEW_LEAVES ? a : OVERVIEW_LEAVES;
+	b = b < OVERVIEW_LEAVES ? b : OVERVIEW_LEAVES;
+	*lo = 0;
+	*hi = 0;
+	for (a += OVERVIEW_LEAVES, b += OVERVIEW_LEAVES; a < b; a >>= 1, b >>= 1) {
+		if (a & 1) {
+			*lo = min_peak(*lo, tree->lo[a]);
+			*hi = max_peak(*hi, tree->hi[a]);
+			a++;
+		}
+		if (b & 1) {
+			b--;
+			*lo = min_peak(*lo, tree->lo[b]);
+			*hi = max_peak(*hi, tree->hi[b]);
+		}
+	}
+}
+
+static inline void
+mark_dirty(LoopOverview* overview, uint32_t from, uint32_t to)
+{
+	for (uint32_t p = from; p < to; p++) {
+		overview->dirty[p] = true;
+	}
+}
+
+/** Blank a wiped loop's waveform */
+static void
+clear_overview(LoopOverview* overview)
+{
+	memset(overview->lo, 0, sizeof(overview->lo));
+	memset(overview->hi, 0, sizeof(overview->hi));
+	mark_dirty(overview, 0, OVERVIEW_POINTS);
+}
+
+/** The ring frames point p of the current loop covers */
+template <int N, int C>
+static inline void
+overview_point(const Alo<N, C>* self, uint32_t p, uint32_t* from, uint32_t* to)
+{
+	const uint64_t length = self->loop_samples;
+	*from = self->loop_start + (uint32_t)(length * p / OVERVIEW_POINTS);
+	*to = self->loop_start + (uint32_t)(length * (p + 1) / OVERVIEW_POINTS);
+}
+
+/**
+   Draw loop i from the ring as it is now: when its phrase starts, and when it
+   is committed.  The peak tree makes this a few nodes
+   per point, so run() can afford it.
+*/
+template <int N, int C>
+static void
+overview_from_ring(Alo<N, C>* self, int i)
+{
+	LoopOverview* const overview = &self->overview[i];
+	for (uint32_t p = 0; p < OVERVIEW_POINTS; p++) {
+		uint32_t from, to;
+		overview_point(self, p, &from, &to);
+		peak_tree_range(&self->peak_tree, from, to, &overview->lo[p], &overview->hi[p]);
+	}
+	mark_dirty(overview, 0, OVERVIEW_POINTS);
+}
+
+/**
+   Draw loop i from its own buffer, for loops restored from a file, which
+   were never in the ring.  This reads the whole loop, so it isn't for run().
+*/
+template <int N, int C>
+static void
+overview_from_view(Alo<N, C>* self, int i)
+{
+	const LoopView* const view = &self->loops[i];
+	LoopOverview* const overview = &self->overview[i];
+	for (uint32_t p = 0; p < OVERVIEW_POINTS; p++) {
+		const uint32_t from = view->offset + (uint32_t)((uint64_t)view->length * p / OVERVIEW_POINTS);
+		const uint32_t to = view->offset + (uint32_t)((uint64_t)view->length * (p + 1) / OVERVIEW_POINTS);
+		float lo = 0.0f, hi = 0.0f;
+		for (int c = 0; c < C; c++) {
+			const size_t at = (size_t)c * view->frames;
+			for (uint32_t k = from; k < to && k < view->frames; k++) {
+				const float x = view->pcm ? view->pcm[at + k] * view->scale : view->data[at + k];
+				lo = fminf(lo, x);
+				hi = fmaxf(hi, x);
+			}
+		}
+		overview->lo[p] = to_peak(lo);
+		overview->hi[p] = to_peak(hi);
+	}
+	mark_dirty(overview, 0, OVERVIEW_POINTS);
+}
+
+/** Redraw the points over ring frames [from, to), for the loops in follow */
+template <int N, int C>
+static void
+redraw_points(Alo<N, C>* self, const bool* follow, uint32_t from, uint32_t to)
+{
+	const uint64_t length = self->loop_samples;
+	if (!length || to <= from || from < self->loop_start) {
+		return;
+	}
+	const uint32_t first = (uint32_t)((from - self->loop_start) * OVERVIEW_POINTS / length);
+	uint32_t last = (uint32_t)((to - 1 - self->loop_start) * OVERVIEW_POINTS / length);
+	last = last < OVERVIEW_POINTS ? last : OVERVIEW_POINTS - 1;
+	for (uint32_t p = first; p <= last; p++) {
+		uint32_t point_from, point_to;
+		int8_t lo, hi;
+		overview_point(self, p, &point_from, &point_to);
+		peak_tree_range(&self->peak_tree, point_from, point_to, &lo, &hi);
+		for (uint32_t i = 0; i < N; i++) {
+			if (follow[i]) {
+				self->overview[i].lo[p] = lo;
+				self->overview[i].hi[p] = hi;
+				mark_dirty(&self->overview[i], p, p + 1);
+			}
+		}
+	}
+}
+
+/**
+   Redraw what has been recorded since last time, for the loops that show the
+   ring as it records: loops recording their phrase, and the overdub loop
+   (which is drawn at the mix level too, though it keeps the input as played).
+   run_loops() only keeps the peak tree up to date, and this is left until a
+   report is due, when it is a point or two per loop.
+*/
+template <int N, int C>
+static void
+update_overview(Alo<N, C>* self)
+{
+	const uint32_t from = self->overview_index;
+	const uint32_t to = self->loop_index;
+	self->overview_index = to;
+
+	bool follow[N];
+	bool any = false;
+	for (uint32_t i = 0; i < N; i++) {
+		follow[i] = (self->state[i] == STATE_RECORDING && self->phrase_start[i]
+			     && self->button_state[i])
+			|| (i == N - 1 && self->recording && self->state[i] == STATE_LOOP_ON);
+		any = any || follow[i];
+	}
+	if (!any) {
+		return;
+	}
+	if (self->overview_start != self->loop_start
+	    || self->overview_length != self->loop_samples) {
+		// free running loops have just been given their length
+		self->overview_start = self->loop_start;
+		self->overview_length = self->loop_samples;
+		for (uint32_t i = 0; i < N; i++) {
+			if (follow[i]) {
+				overview_from_ring(self, i);
+			}
+		}
+	} else if (from <= to) {
+		redraw_points(self, follow, from, to);
+	} else {
+		// wrapped round to the loop start
+		redraw_points(self, follow, from, self->loop_start + self->loop_samples);
+		redraw_points(self, follow, self->loop_start, to);
+	}
+}
+
+/**
+   The `instantiate()` function is called by the host to create a new plugin
+   instance.  The host passes the plugin descriptor, sample rate, and bundle
+   path for plugins that need to load additional resources (e.g. waveforms).
+   The features parameter contains host-provided features defined in LV2
+   extensions.  We need urid:map, and use work:schedule (if available) to
+   allocate loop buffers on demand rather than here.
+
+   This function is in the ``instantiation'' threading class, so no other
+   methods on this instance will be called concurrently with it.
+*/
+template <int N, int C>
+static LV2_Handle
+instantiate(const LV2_Descriptor*     descriptor,
+	    double		      rate,
+	    const char*		      bundle_path,
+	    const LV2_Feature* const* features)
+{
+	log("Instantiate");
+
+	Alo<N, C>* self = (Alo<N, C>*)calloc(1, sizeof(Alo<N, C>));
+	self->rate = rate;
+	self->bpb = DEFAULT_BEATS_PER_BAR;
+	self->loop_beats = DEFAULT_BEATS_PER_BAR * DEFAULT_NUM_BARS;
+	self->bpm = DEFAULT_BPM;
+	self->loop_samples = self->loop_beats * self->rate  * 60.0f / self->bpm;
+	self->current_bb = 0;
+	self->current_lb = 0;
+	self->pb_loops = DEFAULT_INSTANT_LOOPS;
+	
+	self->midi_control = false;
+	self->map_base = -1.0f;	// no map yet
+	self->midi_mix.value = -1.0f;
+	self->midi_click.value = -1.0f;
+	self->midi_capture.value = -1.0f;
+	self->max_frames = (uint32_t)(DEFAULT_MAX_LOOP * rate);
+	set_peak_tree(&self->peak_tree, 2 * self->max_frames);
+
+	for (int i = 0; i < N; i++) {
+		self->phrase_start[i] = 0;
+		self->state[i] = STATE_RECORDING;
+		self->button_time[i] = UINT64_MAX; // never pressed
+	}
+	self->frames = 0;
+	self->loop_start = 0;
+	self->loop_index = 0;
+	self->threshold = 0.0;
+	self->onset.attack = 1.0f - expf(-1.0f / (ONSET_ATTACK * rate));
+	self->onset.release = 1.0f - expf(-1.0f / (ONSET_RELEASE * rate));
+	self->meter.tick_rate = counter_rate();
+	self->meter.on = true; // so the first run() clears the load ports
+
+	LV2_URID_Map* map = NULL;
+	for (int i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_URID_URI "#map")) {
 			map = (LV2_URID_Map*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+			self->schedule = (LV2_Worker_Schedule*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_LOG__log)) {
+			self->logger = (LV2_Log_Log*)features[i]->data;
 		}
 	}
 	if (!map) {
@@ -269,6 +1472,20 @@ instantiate(const LV2_Descriptor*     descriptor,
 		free(self);
 		return NULL;
 	}
+	pthread_mutex_init(&self->saving, NULL);
+	pool_acquire();
+
+	if (!self->schedule) {
+		// Without a worker we can't allocate later, so do it all up front
+		// a free running loop can end up to 2 * max_frames into the ring
+		const uint32_t frames = 2 * self->max_frames;
+		self->recording = (float *)pool_alloc(buffer_size(frames, C, STORAGE_FLOAT), true);
+		self->recording_frames = self->recording ? frames : 0;
+		for (int i = 0; i < N; i++) {
+			self->loops[i].data = (float *)pool_alloc(buffer_size(frames, C, STORAGE_FLOAT), true);
+			self->loops[i].frames = self->loops[i].data ? frames : 0;
+		}
+	}
 
 	// Map URIS
 	AloURIs* const uris = &self->uris;
@@ -285,6 +1502,39 @@ instantiate(const LV2_Descriptor*     descriptor,
 	uris->time_speed	  = map->map(map->handle, LV2_TIME__speed);
 	uris->time_beatsPerBar = map->map(map->handle, LV2_TIME__beatsPerBar);
 	uris->midi_MidiEvent   = map->map (map->handle, LV2_MIDI__MidiEvent);
+	uris->alo_Load         = map->map(map->handle, ALO_URI "#Load");
+	uris->alo_loops        = map->map(map->handle, ALO_URI "#loops");
+	uris->alo_clicks       = map->map(map->handle, ALO_URI "#clicks");
+	uris->alo_events       = map->map(map->handle, ALO_URI "#events");
+	uris->alo_histogram    = map->map(map->handle, ALO_URI "#histogram");
+	uris->alo_memory       = map->map(map->handle, ALO_URI "#memory");
+	uris->alo_Export       = map->map(map->handle, ALO_URI "#Export");
+	uris->alo_loop         = map->map(map->handle, ALO_URI "#loop");
+	uris->alo_progress     = map->map(map->handle, ALO_URI "#progress");
+	uris->alo_path         = map->map(map->handle, ALO_URI "#path");
+	uris->alo_Overview     = map->map(map->handle, ALO_URI "#Overview");
+	uris->alo_phase        = map->map(map->handle, ALO_URI "#phase");
+	uris->alo_states       = map->map(map->handle, ALO_URI "#states");
+	uris->alo_Peaks        = map->map(map->handle, ALO_URI "#Peaks");
+	uris->alo_first        = map->map(map->handle, ALO_URI "#first");
+	uris->alo_peaks        = map->map(map->handle, ALO_URI "#peaks");
+	uris->log_Trace        = map->map(map->handle, LV2_LOG__Trace);
+	uris->alo_rate         = map->map(map->handle, ALO_URI "#rate");
+	uris->alo_bpm          = map->map(map->handle, ALO_URI "#bpm");
+	uris->alo_bpb          = map->map(map->handle, ALO_URI "#bpb");
+	uris->alo_speed        = map->map(map->handle, ALO_URI "#speed");
+	uris->alo_loopBeats    = map->map(map->handle, ALO_URI "#loopBeats");
+	uris->alo_loopSamples  = map->map(map->handle, ALO_URI "#loopSamples");
+	uris->alo_loopStart    = map->map(map->handle, ALO_URI "#loopStart");
+	uris->alo_maxFrames    = map->map(map->handle, ALO_URI "#maxFrames");
+	uris->alo_midiControl  = map->map(map->handle, ALO_URI "#midiControl");
+	uris->alo_patterns     = map->map(map->handle, ALO_URI "#patterns");
+	uris->alo_loopState    = map->map(map->handle, ALO_URI "#loopState");
+	uris->alo_buttonState  = map->map(map->handle, ALO_URI "#buttonState");
+	uris->alo_phraseStart  = map->map(map->handle, ALO_URI "#phraseStart");
+	uris->alo_storage      = map->map(map->handle, ALO_URI "#storage");
+	uris->alo_scale        = map->map(map->handle, ALO_URI "#scale");
+	lv2_atom_forge_init(&self->forge, map);
 
 	// Generate pulses for the metronome
 	self->beat_len = (uint32_t)(0.02f * self->rate);
@@ -292,8 +1542,13 @@ instantiate(const LV2_Descriptor*     descriptor,
 	self->low_beat = (float*)malloc(self->beat_len * sizeof(float));
 	sine_pulse(self->high_beat, HIGH_BEAT_FREQ, self->rate, self->beat_len);
 	sine_pulse(self->low_beat, LOW_BEAT_FREQ, self->rate, self->beat_len);
-	self->high_beat_offset = self->beat_len;
-	self->low_beat_offset = self->beat_len;
+	set_bar(self);
+	self->click_bar = render_click(self->high_beat, self->low_beat, self->beat_len,
+				       self->bar_frames, self->bar_beats);
+	if (self->click_bar) {
+		self->click_frames = self->bar_frames;
+		self->click_beats = self->bar_beats;
+	}
 
 	log("Instantiate end");
 	return (LV2_Handle)self;
@@ -304,34 +1559,54 @@ instantiate(const LV2_Descriptor*     descriptor,
    port to a buffer.  The plugin must store the data location, but data may not
    be accessed except in run().
 
+   Each variant has C inputs then C outputs, N loop switches after those, and
+   the rest of its ports follow on from the switches, so only the six loop
+   stereo variant's port numbers are the same as PortIndex.
+
    This method is in the ``audio'' threading class, and is called in the same
    context as run().
 */
+template <int N, int C>
 static void
 connect_port(LV2_Handle instance,
 	     uint32_t	port,
 	     void*	data)
 {
 	log("Connect");
-	Alo* self = (Alo*)instance;
+	Alo<N, C>* self = (Alo<N, C>*)instance;
 
-	switch ((PortIndex)port) {
-	case ALO_INPUT_L:
-		self->ports.input_l = (const float*)data;
-		log("Connect ALO_INPUT %d", port);
-		break;
-	case ALO_OUTPUT_L:
-		self->ports.output_l = (float*)data;
-		log("Connect ALO_OUTPUT %d", port);
-		break;
-	case ALO_INPUT_R:
-		self->ports.input_r = (const float*)data;
+	if (port < ALO_INPUT_L + C) {
+		self->ports.input[port - ALO_INPUT_L] = (const float*)data;
 		log("Connect ALO_INPUT %d", port);
-		break;
-	case ALO_OUTPUT_R:
-		self->ports.output_r = (float*)data;
+		return;
+	}
+	if (port < ALO_INPUT_L + 2 * C) {
+		self->ports.output[port - ALO_INPUT_L - C] = (float*)data;
 		log("Connect ALO_OUTPUT %d", port);
-		break;
+		return;
+	}
+	// the rest are numbered as in the stereo variants from here
+	port = port - 2 * C + ALO_LOOP1;
+	if (port >= ALO_LOOP1 && port < ALO_LOOP1 + N) {
+		self->ports.loops[port - ALO_LOOP1] = (float*)data;
+		log("Connect ALO_LOOP %d", port - ALO_LOOP1);
+		return;
+	}
+	if (port >= ALO_LOOP1 + N) {
+		port = port - N + PORT_LOOPS;
+	}
+	if (port >= ALO_LOOP1_PEAK && port < ALO_LOOP1_PEAK + 2 * N) {
+		const uint32_t i = (port - ALO_LOOP1_PEAK) / 2;
+		if ((port - ALO_LOOP1_PEAK) % 2 == 0) {
+			self->ports.loop_peak[i] = (float*)data;
+		} else {
+			self->ports.loop_rms[i] = (float*)data;
+		}
+		log("Connect ALO_LOOP_LEVEL %d", i);
+		return;
+	}
+
+	switch ((PortIndex)port) {
 	case ALO_BARS:
 		self->ports.bars = (float*)data;
 		log("Connect ALO_BEATS %d %d", port);
@@ -372,463 +1647,3667 @@ connect_port(LV2_Handle instance,
 		self->ports.enabled = (int*)data;
 		log("Connect ALO_ENABLED %d", port);
 		break;
+	case ALO_MAX_LOOP:
+		self->ports.max_loop = (float*)data;
+		log("Connect ALO_MAX_LOOP %d", port);
+		break;
+	case ALO_ONSET_MODE:
+		self->ports.onset_mode = (float*)data;
+		log("Connect ALO_ONSET_MODE %d", port);
+		break;
+	case ALO_STORAGE:
+		self->ports.storage = (float*)data;
+		log("Connect ALO_STORAGE %d", port);
+		break;
+	case ALO_LOAD_METER:
+		self->ports.load_meter = (float*)data;
+		log("Connect ALO_LOAD_METER %d", port);
+		break;
+	case ALO_LOAD:
+		self->ports.load = (float*)data;
+		log("Connect ALO_LOAD %d", port);
+		break;
+	case ALO_LOAD_PEAK:
+		self->ports.load_peak = (float*)data;
+		log("Connect ALO_LOAD_PEAK %d", port);
+		break;
+	case ALO_NOTIFY:
+		self->ports.notify = (LV2_Atom_Sequence*)data;
+		log("Connect ALO_NOTIFY %d", port);
+		break;
+	case ALO_CLICK_OUT:
+		self->ports.click_out = (float*)data;
+		log("Connect ALO_CLICK_OUT %d", port);
+		break;
+	case ALO_CLICK_ROUTE:
+		self->ports.click_route = (float*)data;
+		log("Connect ALO_CLICK_ROUTE %d", port);
+		break;
+	case ALO_TRACE:
+		self->ports.trace = (float*)data;
+		log("Connect ALO_TRACE %d", port);
+		break;
+	case ALO_FREEWHEEL:
+		self->ports.freewheel = (float*)data;
+		log("Connect ALO_FREEWHEEL %d", port);
+		break;
+	case ALO_EXPORT:
+		self->ports.export_loop = (float*)data;
+		log("Connect ALO_EXPORT %d", port);
+		break;
+	case ALO_MIDI_CHANNEL:
+		self->ports.midi_channel = (float*)data;
+		log("Connect ALO_MIDI_CHANNEL %d", port);
+		break;
+	case ALO_METERS:
+		self->ports.meters = (float*)data;
+		log("Connect ALO_METERS %d", port);
+		break;
+	case ALO_INPUT_PEAK:
+		self->ports.input_peak = (float*)data;
+		log("Connect ALO_INPUT_PEAK %d", port);
+		break;
+	case ALO_INPUT_RMS:
+		self->ports.input_rms = (float*)data;
+		log("Connect ALO_INPUT_RMS %d", port);
+		break;
+	case ALO_OUTPUT_PEAK:
+		self->ports.output_peak = (float*)data;
+		log("Connect ALO_OUTPUT_PEAK %d", port);
+		break;
+	case ALO_OUTPUT_RMS:
+		self->ports.output_rms = (float*)data;
+		log("Connect ALO_OUTPUT_RMS %d", port);
+		break;
+	case ALO_CAPTURE:
+		self->ports.capture = (float*)data;
+		log("Connect ALO_CAPTURE %d", port);
+		break;
 	default:
-		int loop = port - 4;
-		self->ports.loops[loop] = (float*)data;
-		log("Connect ALO_LOOP %d", loop);
+		log("Connect unknown port %d", port);
 	}
 	log("Connect end");
 }
 
+/**
+   Add a record to the trace ring.  This is safe to call from run(): it never
+   blocks, and if the worker has fallen behind the record is dropped.
+*/
+template <int N, int C>
+static void
+trace_at(Alo<N, C>* self, TraceEvent event, int loop, uint32_t index,
+	 uint64_t frame, float value)
+{
+	TraceRing* const ring = &self->trace;
+	if (!ring->on) {
+		return;
+	}
+
+	const uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	TraceRecord* const record = &ring->records[head & (TRACE_SIZE - 1)];
+	record->frame = frame;
+	record->loop_index = index;
+	record->event = (uint16_t)event;
+	record->loop = (int16_t)loop;
+	record->value = value;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+template <int N, int C>
+static inline void
+trace(Alo<N, C>* self, TraceEvent event, int loop, float value)
+{
+	trace_at(self, event, loop, self->loop_index, self->frames, value);
+}
+
+/**
+   Write out everything in the trace ring, to the host's log if it has one or
+   to LOG_FILE.  Called by the worker, never by run().
+*/
+template <int N, int C>
 static void
-reset(Alo* self)
+drain_trace(Alo<N, C>* self)
 {
-	log("Reset");
-	self->pb_loops = (uint32_t)floorf(*(self->ports.pb_loops));
-	self->loop_beats = (uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars));
-	self->loop_samples = self->loop_beats * self->rate  * 60.0f / self->bpm;
+	TraceRing* const ring = &self->trace;
+	const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint32_t tail = ring->tail;
 
-	if (self->loop_samples > LOOP_SIZE || self->speed == 0) {
-		self->loop_samples = LOOP_SIZE;
+	if (!self->logger && !ring->file) {
+		ring->file = fopen(LOG_FILE, "a");
 	}
-	self->loop_index = 0;
-	self->loop_start = 0;
-	log("Loop beats: %d", self->loop_beats);
-	log("BPM: %G", self->bpm);
-	log("Loop_samples: %d", self->loop_samples);
-	for (int i = 0; i < NUM_LOOPS; i++) {
-		self->button_state[i] = (*self->ports.loops[i]) > 0.0f ? true : false;
-		self->state[i] = STATE_RECORDING;
-		self->phrase_start[i] = 0;
-		log("STATE: RECORDING (reset) [%d]", i);
+
+	for (; tail != head; tail++) {
+		const TraceRecord* const r = &ring->records[tail & (TRACE_SIZE - 1)];
+		const char* const name = r->event < NUM_TRACE_EVENTS ? trace_names[r->event] : "?";
+		if (self->logger) {
+			self->logger->printf(self->logger->handle, self->uris.log_Trace,
+					     "alo: %llu %s loop %d index %u value %g\n",
+					     (unsigned long long)r->frame, name, r->loop,
+					     r->loop_index, r->value);
+		} else if (ring->file) {
+			fprintf(ring->file, "%llu %s loop %d index %u value %g\n",
+				(unsigned long long)r->frame, name, r->loop,
+				r->loop_index, r->value);
+		}
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	const uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	if (dropped != ring->reported) {
+		if (self->logger) {
+			self->logger->printf(self->logger->handle, self->uris.log_Trace,
+					     "alo: %u trace records dropped\n",
+					     dropped - ring->reported);
+		} else if (ring->file) {
+			fprintf(ring->file, "%u trace records dropped\n",
+				dropped - ring->reported);
+		}
+		ring->reported = dropped;
+	}
+	if (ring->file) {
+		fflush(ring->file);
 	}
-	log("Reset end");
 }
 
 /**
-   The `activate()` method is called by the host to initialise and prepare the
-   plugin instance for running.	 The plugin must reset all internal state
-   except for buffer locations set by `connect_port()`.	 Since this plugin has
-   no other internal state, this method does nothing.
+   Have the worker write out anything run() has traced.  Called at the end of
+   run().
+*/
+template <int N, int C>
+static void
+schedule_trace(Alo<N, C>* self)
+{
+	TraceRing* const ring = &self->trace;
 
-   This method is in the ``instantiation'' threading class, so no other
-   methods on this instance will be called concurrently with it.
+	if (!self->schedule || ring->pending
+	    || ring->head == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)) {
+		return;
+	}
+	AloWork work = { WORK_TRACE, -1, 0, STORAGE_FLOAT, NULL };
+	if (self->schedule->schedule_work(self->schedule->handle,
+					  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+		ring->pending = true;
+	}
+}
+
+static inline bool
+has_buffer(const LoopView* view)
+{
+	return view->data || view->pcm;
+}
+
+/**
+   Hand a buffer to the worker to be freed.  Called from run(), so the free()
+   itself must not happen here.
 */
+template <int N, int C>
 static void
-activate(LV2_Handle instance)
+release_buffer(Alo<N, C>* self, int loop, void* buffer)
 {
-	log("Activate");
+	AloWork work = { WORK_FREE, loop, 0, STORAGE_FLOAT, buffer };
+	if (self->schedule->schedule_work(self->schedule->handle,
+					  sizeof(work), &work) != LV2_WORKER_SUCCESS) {
+		trace(self, TRACE_SCHEDULE_FAILED, loop, 0.0f);
+	}
 }
 
 /**
-   Update the current (midi) position based on a host message.	This is called
-   by run() when a time:Position is received.
+   Hand loop i's buffer to the worker, to be freed or, if it was restored from
+   a file, unmapped.  Called from run().
 */
+template <int N, int C>
 static void
-update_position(Alo* self, const LV2_Atom_Object* obj)
+release_view(Alo<N, C>* self, int i)
 {
-	AloURIs* const uris = &self->uris;
+	LoopView* const view = &self->loops[i];
+	void* const buffer = view->data ? (void*)view->data : (void*)view->pcm;
 
-	// Received new transport position/speed
-	LV2_Atom *beat = NULL, *bpm = NULL, *bpb = NULL, *speed = NULL;
-	lv2_atom_object_get(obj,
-			    uris->time_barBeat, &beat,
-			    uris->time_beatsPerMinute, &bpm,
-			    uris->time_speed, &speed,
-			    uris->time_beatsPerBar, &bpb,
-			    NULL);
+	if (view->mapped) {
+		const Storage storage = view->data ? STORAGE_FLOAT : STORAGE_PCM16;
+		AloWork work = { WORK_UNMAP, i, view->frames, storage, buffer };
+		if (self->schedule->schedule_work(self->schedule->handle,
+						  sizeof(work), &work) != LV2_WORKER_SUCCESS) {
+			trace(self, TRACE_SCHEDULE_FAILED, i, 0.0f);
+		}
+	} else {
+		release_buffer(self, i, buffer);
+	}
+	view->data = NULL;
+	view->pcm = NULL;
+	view->frames = 0;
+	view->mapped = false;
+}
+
+/**
+   Free loop i's buffer here and now, for when run() can't be running.
+*/
+template <int N, int C>
+static void
+free_view(Alo<N, C>* self, int i)
+{
+	LoopView* const view = &self->loops[i];
+
+	if (view->mapped) {
+		const Storage storage = view->data ? STORAGE_FLOAT : STORAGE_PCM16;
+		munmap(view->data ? (void*)view->data : (void*)view->pcm,
+		       buffer_size(view->frames, C, storage));
+	} else {
+		pool_free(view->data);
+		pool_free(view->pcm);
+	}
+	view->data = NULL;
+	view->pcm = NULL;
+	view->frames = 0;
+	view->mapped = false;
+}
+
+/**
+   Queue an operation for the worker.  Returns false if the queue is full.
+*/
+template <int N, int C>
+static bool
+stream_push(Streams<N, C>* s, const StreamOp* op)
+{
+	const uint32_t head = s->ops_head;
+	if (head - __atomic_load_n(&s->ops_tail, __ATOMIC_ACQUIRE) == STREAM_OPS) {
+		return false;
+	}
+	s->ops[head % STREAM_OPS] = *op;
+	__atomic_store_n(&s->ops_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+   Hand disk storage back to the worker to be closed.  Anything it still has
+   queued for it is done first.
+*/
+template <int N, int C>
+static void
+release_streams(Alo<N, C>* self)
+{
+	AloWork work = { WORK_STREAM_CLOSE, -1, 0, STORAGE_DISK, self->streams };
+	if (self->schedule->schedule_work(self->schedule->handle,
+					  sizeof(work), &work) != LV2_WORKER_SUCCESS) {
+		trace(self, TRACE_SCHEDULE_FAILED, -1, 0.0f);
+	}
+	self->streams = NULL;
+}
+
+/**
+   Have the worker write out what has been recorded and read ahead for the
+   loops.  Called at the end of run().
+*/
+template <int N, int C>
+static void
+schedule_streams(Alo<N, C>* self)
+{
+	if (!self->streams || self->stream_job) {
+		return;
+	}
+	AloWork work = { WORK_STREAM, -1, 0, STORAGE_DISK, self->streams };
+	if (self->schedule->schedule_work(self->schedule->handle,
+					  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+		self->stream_job = true;
+	}
+}
+
+/**
+   Ask the worker to start loop i's window at index, the frame recorded that
+   many frames ago.  Unless the loop has been set, the worker only reads what
+   has been written to the ring since then.
+*/
+template <int N, int C>
+static void
+stream_seek(Alo<N, C>* self, int i, uint32_t index, uint32_t recorded)
+{
+	StreamWindow* const w = &self->streams->windows[i];
+
+	w->read = 0;
+	w->seek = index;
+	w->seek_input = self->streams->input_head - recorded;
+	w->seek_start = self->loop_start;
+	w->seek_length = self->loop_samples;
+	w->reseek = false;
+	__atomic_store_n(&w->wanted, w->wanted + 1, __ATOMIC_RELEASE);
+}
+
+/**
+   A loop waiting for its phrase to come round again will start playing from
+   the phrase start, so have the worker read ahead from there as it is
+   recorded.  end is the loop_index after the frames just recorded.
+*/
+template <int N, int C>
+static void
+stream_prepare(Alo<N, C>* self, int i, uint32_t end)
+{
+	StreamWindow* const w = &self->streams->windows[i];
+
+	if (__atomic_load_n(&w->served, __ATOMIC_ACQUIRE) == w->wanted
+	    && (w->reseek || w->seek != self->phrase_start[i]
+		|| w->seek_start != self->loop_start || w->seek_length != self->loop_samples)) {
+		const uint32_t start = self->phrase_start[i];
+		stream_seek(self, i, start, end >= start ? end - start : end + self->loop_samples - start);
+	}
+}
+
+/**
+   Frames a buffer needs to hold the loop.  Until the loop length is known a
+   free running loop can start anywhere in the first max_frames, and run on
+   for up to max_frames after that.
+*/
+template <int N, int C>
+static uint32_t
+ring_frames(const Alo<N, C>* self)
+{
+	return self->loop_samples == self->max_frames ? 2 * self->max_frames
+		: self->loop_start + self->loop_samples;
+}
+
+/**
+   Ask the worker for any buffers we are about to need.  The recording ring,
+   or the file that holds it with disk storage, is requested on the first
+   cycle, and kept, so a phrase can start on the
+   cycle it is played in; only when the loop outgrows it is a longer one
+   asked for, and the old one records on until it comes.  A loop's own
+   buffer is requested once its phrase has started, which leaves a whole
+   pass for the worker to deliver it before the loop is committed.  Until
+   then run() carries on without blocking.  Loop buffers only cover the
+   current loop, rather than the maximum, once the loop length is known.
+   With Capture on a spare loop buffer is kept ready once the loop length is
+   known, as a capture can't wait for one.
+*/
+template <int N, int C>
+static void
+request_buffers(Alo<N, C>* self)
+{
+	if (!self->schedule) {
+		return;
+	}
+
+	const uint32_t frames = ring_frames(self);
+	const bool capturing = !self->bypassed
+		&& override_value(&self->midi_capture, self->ports.capture) > 0.0f;
+	for (int i = 0; i < N; i++) {
+		if (!self->button_state[i]) {
+			self->loop_refused[i] = false;
+		}
+		if (self->phrase_start[i] && !has_buffer(&self->loops[i]) && !self->loop_pending[i]
+		    && !self->loop_refused[i] && self->storage != STORAGE_DISK) {
+			AloWork work = { WORK_ALLOCATE, i, frames, self->storage, NULL };
+			if (self->schedule->schedule_work(self->schedule->handle,
+							  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+				self->loop_pending[i] = true;
+			}
+		}
+	}
+
+	if (self->storage == STORAGE_DISK) {
+		// free running loops can start anywhere in the first max_frames
+		if (!self->streams && !self->streams_pending && !self->streams_refused) {
+			AloWork work = { WORK_STREAM_OPEN, -1, 2 * self->max_frames, STORAGE_DISK, NULL };
+			if (self->schedule->schedule_work(self->schedule->handle,
+							  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+				self->streams_pending = true;
+			}
+		}
+	} else if ((!self->recording || self->recording_frames < frames)
+		   && !self->recording_pending && !self->recording_refused) {
+		// as long as the longest loop, so it needn't be replaced after a reset
+		const uint32_t longest = frames > 2 * self->max_frames ? frames : 2 * self->max_frames;
+		AloWork work = { WORK_ALLOCATE, -1, longest, STORAGE_FLOAT, NULL };
+		if (self->schedule->schedule_work(self->schedule->handle,
+						  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+			self->recording_pending = true;
+		}
+	}
+
+	if (self->spare && (self->spare_frames < frames || self->spare_storage != self->storage)) {
+		release_buffer(self, SPARE_LOOP, self->spare);
+		self->spare = NULL;
+	}
+	if (!capturing) {
+		self->spare_refused = false;
+	} else if (!self->spare && !self->spare_pending && !self->spare_refused
+		   && self->storage != STORAGE_DISK && self->loop_samples != self->max_frames) {
+		AloWork work = { WORK_ALLOCATE, SPARE_LOOP, frames, self->storage, NULL };
+		if (self->schedule->schedule_work(self->schedule->handle,
+						  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+			self->spare_pending = true;
+		}
+	}
+}
+
+template <int N, int C>
+static void
+reset(Alo<N, C>* self)
+{
+	if (self->schedule) {
+		// Give all the memory back, and pick up any change in max loop length
+		for (int i = 0; i < N; i++) {
+			if (has_buffer(&self->loops[i])) {
+				release_view(self, i);
+			}
+			self->loop_refused[i] = false;
+		}
+		self->recording_refused = false;
+		self->streams_refused = false;
+		if (self->spare) {
+			release_buffer(self, SPARE_LOOP, self->spare);
+			self->spare = NULL;
+		}
+		self->spare_refused = false;
+		self->max_frames = (uint32_t)(floorf(*(self->ports.max_loop)) * self->rate);
+		self->storage = *self->ports.storage >= 2.0f ? STORAGE_DISK
+			: *self->ports.storage >= 1.0f ? STORAGE_PCM16 : STORAGE_FLOAT;
+		if (self->streams && (self->storage != STORAGE_DISK
+				      || self->streams->frames < 2 * self->max_frames)) {
+			release_streams(self);
+		}
+		// the ring records on through a reset, unless disk storage takes
+		// over from it or it is longer than the longest loop can now be
+		if (self->recording && (self->storage == STORAGE_DISK
+					|| self->recording_frames > 2 * self->max_frames)) {
+			release_buffer(self, -1, self->recording);
+			self->recording = NULL;
+			self->recording_frames = 0;
+		}
+	}
+
+	cancel_stretch(self);
+	self->pb_loops = (uint32_t)floorf(*(self->ports.pb_loops));
+	self->loop_beats = (uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars));
+	self->loop_samples = self->loop_beats * self->rate  * 60.0f / self->bpm;
+
+	if (self->loop_samples > self->max_frames || self->speed == 0) {
+		self->loop_samples = self->max_frames;
+	}
+	self->loop_index = 0;
+	self->loop_start = 0;
+	trace(self, TRACE_RESET, -1, self->loop_samples);
+	set_peak_tree(&self->peak_tree, 2 * self->max_frames);
+	for (int i = 0; i < N; i++) {
+		self->button_state[i] = !self->bypassed && (*self->ports.loops[i]) > 0.0f;
+		self->state[i] = STATE_RECORDING;
+		self->phrase_start[i] = 0;
+		self->loops[i].unfrozen = 0;
+		self->capture_wanted[i] = false;
+		clear_overview(&self->overview[i]);
+	}
+	if (self->streams) {
+		const StreamOp op = { STREAM_WIPE, -1, 0, 0, 0, 0, 0.0f, false };
+		stream_push(self->streams, &op);
+		for (int i = 0; i < N; i++) {
+			self->streams->windows[i].reseek = true;
+		}
+	}
+}
+
+/**
+   Give back anything stretched for a tempo change, and forget the change.
+*/
+template <int N, int C>
+static void
+cancel_stretch(Alo<N, C>* self)
+{
+	for (int i = 0; i < N; i++) {
+		if (self->stretched[i]) {
+			release_buffer(self, i, self->stretched[i]);
+			self->stretched[i] = NULL;
+		}
+		self->stretch_wanted[i] = false;
+		self->stretch_sent[i] = false;
+	}
+	self->stretch_length = 0;
+}
+
+/**
+   Take up a change of tempo by stretching the loops to the new loop length,
+   rather than wiping them.  The worker stretches each loop once it is
+   frozen, and run() carries on playing the loops as they were until they
+   have all come back, then swaps them in at the end of the loop.  Returns
+   false if there's nothing to stretch, or it can't be done, and the caller
+   should reset as it always has.
+*/
+template <int N, int C>
+static bool
+retempo(Alo<N, C>* self)
+{
+	if (!self->schedule || !self->speed || self->loop_start
+	    || self->storage == STORAGE_DISK || self->streams) {
+		return false;
+	}
+	const uint32_t length = self->loop_beats * self->rate * 60.0f / self->bpm;
+	if (!length || length > self->max_frames) {
+		return false;
+	}
+
+	bool any = false;
+	for (int i = 0; i < N; i++) {
+		any = any || (self->state[i] != STATE_RECORDING && has_buffer(&self->loops[i]));
+	}
+	if (!any) {
+		return false;
+	}
+
+	cancel_stretch(self);
+	if (length != self->loop_samples) {
+		for (int i = 0; i < N; i++) {
+			self->stretch_wanted[i] = self->state[i] != STATE_RECORDING
+				&& has_buffer(&self->loops[i]);
+		}
+		self->stretch_length = length;
+	}
+	return true;
+}
+
+/**
+   Send the worker each loop that is waiting to be stretched, once it no
+   longer needs the recording ring.  Called at the end of run().
+*/
+template <int N, int C>
+static void
+request_stretch(Alo<N, C>* self)
+{
+	if (!self->stretch_length) {
+		return;
+	}
+	for (int i = 0; i < N; i++) {
+		const LoopView* const view = &self->loops[i];
+		if (!self->stretch_wanted[i] || self->stretch_sent[i] || view->unfrozen
+		    || self->state[i] == STATE_RECORDING || !has_buffer(view)) {
+			continue;
+		}
+		const Storage storage = view->pcm ? STORAGE_PCM16 : STORAGE_FLOAT;
+		void* const buffer = view->pcm ? (void*)view->pcm : (void*)view->data;
+		const StretchWork work = {
+			{ WORK_STRETCH, i, self->loop_start + self->stretch_length, storage, buffer },
+			self->stretch_job[i] + 1, self->loop_start, self->loop_samples,
+			self->stretch_length, view->frames, view->scale
+		};
+		// before it is sent, so the worker can tell it is the latest
+		__atomic_store_n(&self->stretch_job[i], work.job, __ATOMIC_RELEASE);
+		if (self->schedule->schedule_work(self->schedule->handle,
+						  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+			self->stretch_sent[i] = true;
+		}
+	}
+}
+
+/**
+   Swap the stretched loops in, if they have all come back.  Called at the
+   end of a loop, with loop_index back at loop_start.  A phrase that was being
+   recorded was counted in the old tempo, so it is dropped.
+*/
+template <int N, int C>
+static void
+swap_stretched(Alo<N, C>* self)
+{
+	for (int i = 0; i < N; i++) {
+		if (self->stretch_wanted[i] && self->state[i] != STATE_RECORDING
+		    && !self->stretched[i]) {
+			return;
+		}
+	}
+
+	const uint32_t old_length = self->loop_samples;
+	const uint32_t length = self->stretch_length;
+	const uint32_t frames = self->loop_start + length;
+	for (int i = 0; i < N; i++) {
+		LoopView* const view = &self->loops[i];
+		void* const buffer = self->stretched[i];
+		self->stretched[i] = NULL;
+		if (buffer && self->state[i] != STATE_RECORDING) {
+			const bool pcm = view->pcm != NULL;
+			release_view(self, i);
+			if (pcm) {
+				view->pcm = (int16_t*)buffer;
+			} else {
+				view->data = (float*)buffer;
+			}
+			view->frames = frames;
+			view->length = length;
+			self->phrase_start[i] = self->loop_start + (uint32_t)(
+				(uint64_t)(self->phrase_start[i] - self->loop_start) * length / old_length);
+			if (self->phrase_start[i] == 0) {
+				self->phrase_start[i] = 1; // 0 would mean no phrase
+			}
+			continue;
+		}
+		if (buffer) {
+			release_buffer(self, i, buffer);
+		}
+		if (self->state[i] == STATE_RECORDING) {
+			self->phrase_start[i] = 0;
+			if (has_buffer(view) && view->frames < frames) {
+				release_view(self, i);
+			}
+		}
+	}
+	self->loop_samples = length;	// a ring too short is replaced by request_buffers()
+	cancel_stretch(self);
+	trace(self, TRACE_STRETCHED, -1, length);
+}
+
+/**
+   The `activate()` method is called by the host to initialise and prepare the
+   plugin instance for running.	 The plugin must reset all internal state
+   except for buffer locations set by `connect_port()`.	 Since this plugin has
+   no other internal state, this method does nothing.
+
+   This method is in the ``instantiation'' threading class, so no other
+   methods on this instance will be called concurrently with it.
+*/
+static void
+activate(LV2_Handle instance)
+{
+	log("Activate");
+}
+
+/**
+   Update the current (midi) position based on a host message.	This is called
+   by run() when a time:Position is received.
+*/
+template <int N, int C>
+static void
+update_position(Alo<N, C>* self, const LV2_Atom_Object* obj)
+{
+	AloURIs* const uris = &self->uris;
+
+	// Received new transport position/speed
+	LV2_Atom *beat = NULL, *bpm = NULL, *bpb = NULL, *speed = NULL;
+	lv2_atom_object_get(obj,
+			    uris->time_barBeat, &beat,
+			    uris->time_beatsPerMinute, &bpm,
+			    uris->time_speed, &speed,
+			    uris->time_beatsPerBar, &bpb,
+			    NULL);
+
+	if (bpb && bpb->type == uris->atom_Float) {
+		if (self->bpb != ((LV2_Atom_Float*)bpb)->body) {
+			self->bpb = ((LV2_Atom_Float*)bpb)->body;
+			set_bar(self);
+			reset(self);
+		}
+	}
+
+	if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) != self->loop_beats){
+		reset(self);
+	}
+
+	if (bpm && bpm->type == uris->atom_Float) {
+		if (round(self->bpm) != round(((LV2_Atom_Float*)bpm)->body)) {
+			// Tempo changed, update BPM
+			self->bpm = ((LV2_Atom_Float*)bpm)->body;
+			set_bar(self);
+			trace(self, TRACE_TEMPO, -1, self->bpm);
+			if (!retempo(self)) {
+				reset(self);
+			}
+		}
+	}
+
+	if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) != self->loop_beats) {
+		reset(self);
+	}
+
+	if (speed && speed->type == uris->atom_Float) {
+		if (self->speed != ((LV2_Atom_Float*)speed)->body) {
+			// Speed changed, e.g. 0 (stop) to 1 (play)
+			// reset the loop start
+			self->speed = ((LV2_Atom_Float*)speed)->body;
+			trace(self, TRACE_SPEED, -1, self->speed);
+			reset(self);
+		};
+	}
+	if (beat && beat->type == uris->atom_Float) {
+		// Received a beat position, synchronise
+		const float position = ((LV2_Atom_Float*)beat)->body;
+		if (self->bar_frames) {
+			// the click carries on from here a frame at a time
+			const double beats = fmod(position, self->bar_beats);
+			const uint32_t phase = (uint32_t)lrint(beats * 60.0 * self->rate / self->bpm);
+			self->click_phase = phase < self->bar_frames ? phase : 0;
+		}
+		if (self->current_bb != (uint32_t)position) {
+			// we are onto the next beat
+			self->current_bb = (uint32_t)position;
+			if (self->current_lb == self->loop_beats) {
+				self->current_lb = 0;
+			}
+			trace(self, TRACE_BEAT, -1, position);
+			self->current_lb += 1;
+		}
+	}
+}
+
+/**
+   Adjust self->state based on button presses.
+*/
+template <int N, int C>
+static void
+button_logic(Alo<N, C>* self, bool new_button_state, int i)
+{
+	if (self->bypassed) {
+		// the switches are picked up again when bypass ends
+		return;
+	}
+	self->button_state[i] = new_button_state;
+
+	// Time between presses is counted in frames, as run() can't ask the clock
+	const bool double_tap = self->button_time[i] != UINT64_MAX
+		&& self->frames - self->button_time[i] < DOUBLE_TAP * self->rate;
+	self->button_time[i] = self->frames;
+	trace(self, new_button_state ? TRACE_BUTTON_ON : TRACE_BUTTON_OFF, i, 0.0f);
+
+	// Free running mode: when a button is pressed,
+	// if there is a button recording, set loop size and start based on its loop
+	if (self->loop_samples == self->max_frames) {
+		for (int j = 0; j < N; j++) {
+			if (self->phrase_start[j] != 0) {
+				self->loop_samples = self->max_frames + self->loop_index - self->phrase_start[j];
+				self->loop_samples = self->loop_samples % self->max_frames;
+				self->loop_start = self->phrase_start[j];
+			}
+		}
+	}
+
+	int on_loops = 0;
+	for (int j = 0; j < N; j++) {
+		if (self->button_state[j] == true) {
+			on_loops += 1;
+		}
+	}
+
+	if (on_loops == 0 && *(self->ports.reset_mode) == 1.0) {
+		// reset if all loops are off
+		reset(self);
+	}
+
+	if (double_tap) {
+		if (*(self->ports.reset_mode) == 2.0 || on_loops == 1) {
+			reset(self);
+		}
+		if (*(self->ports.reset_mode) == 3.0) {
+			self->state[i] = STATE_RECORDING;
+			self->phrase_start[i] = 0;
+			self->loops[i].unfrozen = 0;
+			if (self->loops[i].mapped
+			    || (has_buffer(&self->loops[i]) && self->storage == STORAGE_DISK)) {
+				// the file mapping is read only, and with disk storage
+				// the loop goes to disk
+				release_view(self, i);
+			}
+			if (self->streams) {
+				const StreamOp op = { STREAM_FORGET, (int16_t)i, 0, 0, 0, 0, 0.0f, false };
+				stream_push(self->streams, &op);
+				self->streams->windows[i].reseek = true;
+			}
+			if (self->stretched[i]) {
+				release_buffer(self, i, self->stretched[i]);
+				self->stretched[i] = NULL;
+			}
+			self->stretch_wanted[i] = false;
+			self->stretch_sent[i] = false;
+			clear_overview(&self->overview[i]);
+			trace(self, TRACE_LOOP_RESET, i, 0.0f);
+		}
+	}
+
+	// With Capture on, arming an empty loop takes the pass just played
+	// rather than waiting for the next phrase (but not when wiping it)
+	if (new_button_state && !double_tap && self->state[i] == STATE_RECORDING
+	    && !self->phrase_start[i] && self->loop_samples != self->max_frames
+	    && override_value(&self->midi_capture, self->ports.capture) > 0.0f) {
+		self->capture_wanted[i] = true;
+	}
+}
+
+/**
+   Switches are control ports, so their state holds for the whole cycle, and
+   run() looks at them at the start of it.  A switch only acts when it is
+   moved, so MIDI can drive the same loops in between: whichever was used
+   last wins.
+*/
+template <int N, int C>
+static void
+switch_events(Alo<N, C>* self)
+{
+	for (int i = 0; i < N; i++) {
+		bool new_switch_state = (*self->ports.loops[i]) > 0.0f ? true : false;
+		if (new_switch_state != self->switch_state[i]) {
+			self->switch_state[i] = new_switch_state;
+			if (new_switch_state != self->button_state[i]) {
+				button_logic(self, new_switch_state, i);
+			}
+		}
+	}
+}
+
+/**
+   Fill in the MIDI map for the MIDI ports.  The loops are on notes from
+   [MIDI Base] and on controllers from MIDI_CC_LOOPS, the mix, click and
+   reset on the MIDI_CC_ controllers, and each program recalls the pattern
+   stored for it.  Channels other than [MIDI Channel] (unless it is 0) are
+   left empty.  Only called when a MIDI port changes, so it can take its
+   time.
+*/
+template <int N, int C>
+static void
+build_midi_map(Alo<N, C>* self)
+{
+	const int base = (int)floorf(*self->ports.midi_base);
+	const int channel = (int)floorf(*self->ports.midi_channel);
+	self->map_base = *self->ports.midi_base;
+	self->map_channel = *self->ports.midi_channel;
+
+	memset(self->midi_map, 0, sizeof(self->midi_map));
+	for (int ch = 0; ch < 16; ch++) {
+		if (channel > 0 && ch != channel - 1) {
+			continue;
+		}
+		MidiBinding* const notes = self->midi_map[ch][MIDI_KIND_NOTE];
+		MidiBinding* const controllers = self->midi_map[ch][MIDI_KIND_CONTROLLER];
+		MidiBinding* const programs = self->midi_map[ch][MIDI_KIND_PROGRAM];
+		for (int i = 0; i < N; i++) {
+			if (base + i >= 0 && base + i < 128) {
+				notes[base + i].action = MIDI_LOOP;
+				notes[base + i].arg = (uint8_t)i;
+			}
+			controllers[MIDI_CC_LOOPS + i].action = MIDI_LOOP;
+			controllers[MIDI_CC_LOOPS + i].arg = (uint8_t)i;
+		}
+		controllers[MIDI_CC_MIX].action = MIDI_MIX;
+		controllers[MIDI_CC_CLICK].action = MIDI_CLICK;
+		controllers[MIDI_CC_RESET].action = MIDI_RESET;
+		controllers[MIDI_CC_STORE].action = MIDI_STORE;
+		controllers[MIDI_CC_CAPTURE].action = MIDI_CAPTURE;
+		for (int p = 0; p < MIDI_PATTERNS; p++) {
+			programs[p].action = MIDI_PATTERN;
+			programs[p].arg = (uint8_t)p;
+		}
+	}
+}
+
+/**
+   Turn loops on and off to match a stored pattern.  Loops still recording
+   are left alone, and this doesn't count as pressing the buttons, so it
+   never resets anything.
+*/
+template <int N, int C>
+static void
+recall_pattern(Alo<N, C>* self, uint32_t pattern)
+{
+	for (int i = 0; i < N; i++) {
+		const bool on = (pattern >> i) & 1;
+		if (self->state[i] != STATE_RECORDING && self->button_state[i] != on) {
+			self->button_state[i] = on;
+			trace(self, on ? TRACE_BUTTON_ON : TRACE_BUTTON_OFF, i, 0.0f);
+		}
+	}
+}
+
+/**
+   Act on a MIDI message, as looked up in the MIDI map.  Note on with
+   velocity 0 is note off, as running status senders use it.
+*/
+template <int N, int C>
+static void
+midi_event(Alo<N, C>* self, const LV2_Atom* atom)
+{
+	if (atom->type != self->uris.midi_MidiEvent || atom->size < 2) {
+		return;
+	}
+	const uint8_t* const msg = (const uint8_t*)(atom + 1);
+	const uint8_t value = atom->size > 2 ? msg[2] & 0x7f : 0;
+	MidiKind kind;
+	bool on;
+	switch (lv2_midi_message_type(msg)) {
+	case LV2_MIDI_MSG_NOTE_ON:
+		kind = MIDI_KIND_NOTE;
+		on = value > 0;
+		break;
+	case LV2_MIDI_MSG_NOTE_OFF:
+		kind = MIDI_KIND_NOTE;
+		on = false;
+		break;
+	case LV2_MIDI_MSG_CONTROLLER:
+		kind = MIDI_KIND_CONTROLLER;
+		on = value >= 64;
+		break;
+	case LV2_MIDI_MSG_PGM_CHANGE:
+		kind = MIDI_KIND_PROGRAM;
+		on = true;
+		break;
+	default:
+		return;
+	}
+	if (kind != MIDI_KIND_PROGRAM && atom->size < 3) {
+		return;
+	}
+
+	const MidiBinding binding = self->midi_map[msg[0] & 0x0f][kind][msg[1] & 0x7f];
+	switch ((MidiAction)binding.action) {
+	case MIDI_NONE:
+		break;
+	case MIDI_LOOP:
+		button_logic(self, on, binding.arg);
+		self->midi_control = true;
+		break;
+	case MIDI_MIX:
+		set_override(&self->midi_mix, self->ports.mix, value * 100.0f / 127.0f);
+		break;
+	case MIDI_CLICK:
+		set_override(&self->midi_click, self->ports.click, roundf(value * 10.0f / 127.0f));
+		break;
+	case MIDI_RESET:
+		if (on) {
+			reset(self);
+		}
+		break;
+	case MIDI_STORE:
+		self->midi_store = on;
+		break;
+	case MIDI_CAPTURE:
+		set_override(&self->midi_capture, self->ports.capture, on ? 1.0f : 0.0f);
+		break;
+	case MIDI_PATTERN:
+		if (self->midi_store) {
+			uint32_t pattern = PATTERN_SET;
+			for (int i = 0; i < N; i++) {
+				pattern |= (uint32_t)self->button_state[i] << i;
+			}
+			self->patterns[binding.arg] = pattern;
+		} else if (self->patterns[binding.arg] & PATTERN_SET) {
+			recall_pattern(self, self->patterns[binding.arg]);
+			self->midi_control = true;
+		}
+		break;
+	}
+}
+
+template <int N, int C>
+static void
+control_event(Alo<N, C>* self, const LV2_Atom* atom)
+{
+	const AloURIs* uris = &self->uris;
+
+	// Check if this event is an Object
+	// (or deprecated Blank to tolerate old hosts)
+	if (atom->type == uris->atom_Object || atom->type == uris->atom_Blank) {
+		const LV2_Atom_Object* obj = (const LV2_Atom_Object*)atom;
+		if (obj->body.otype == uris->time_Position) {
+			// Received position information, update
+			update_position(self, obj);
+		}
+	}
+}
+
+/**
+   Turn the last pass of the recording ring into loop i.  Returns false if the
+   loop's buffer hasn't arrived from the worker yet, in which case the loop
+   carries on recording and tries again next time around.
+*/
+template <int N, int C>
+static bool
+commit_loop(Alo<N, C>* self, int i)
+{
+	LoopView* const view = &self->loops[i];
+	const uint32_t frames = self->loop_start + self->loop_samples;
+
+	if (self->export_pinned[i]) {
+		// the worker is writing the old loop out, so don't freeze over it
+		trace(self, TRACE_COMMIT_DEFERRED, i, 0.0f);
+		return false;
+	}
+	if (self->storage == STORAGE_DISK) {
+		const StreamOp op = { STREAM_COMMIT, (int16_t)i, self->loop_index, 0,
+				      self->loop_start, self->loop_samples, 0.0f, false };
+		if (!self->streams || !stream_push(self->streams, &op)) {
+			trace(self, TRACE_COMMIT_DEFERRED, i, 0.0f);
+			return false;
+		}
+		view->offset = self->loop_start;
+		view->length = self->loop_samples;
+		view->unfrozen = 0;
+		return true;
+	}
+
+	if (!self->recording || self->recording_frames < frames
+	    || !has_buffer(view) || view->frames < frames) {
+		trace(self, TRACE_COMMIT_DEFERRED, i, 0.0f);
+		return false;
+	}
+
+	view->offset = self->loop_start;
+	view->length = self->loop_samples;
+	view->unfrozen = self->loop_samples;
+	if (self->stretch_length) {
+		// set in the old tempo, so it needs stretching too
+		self->stretch_wanted[i] = true;
+	}
+
+	if (view->pcm) {
+		// the overdub loop gets replaced by raw input, so it needs full scale
+		float top = view->peak;
+		if (i == N - 1) {
+			top = fmaxf(top, 1.0f);
+		}
+		view->scale = fmaxf(top, PCM16_FLOOR) / PCM16_MAX;
+	}
+	return true;
+}
+
+/**
+   Turn the pass just played, the last loop_samples frames of the ring, into
+   loop i at once.  It is committed by reference like any other loop, but from
+   the current index rather than a phrase start: the loop plays on from here,
+   and each sample is frozen into its buffer as the ring comes round to
+   overwrite it, so nothing is copied now.  A loop with no buffer of its own
+   takes the spare, and if another capture has just taken that, it waits for
+   the worker to bring the next one (a cycle, usually), as the ring still
+   holds the last pass then.  Meanwhile no phrase starts for it.  If no spare
+   is coming, or the commit can't be made, the loop stays armed and records
+   the next phrase as usual.  index 0 would read as no phrase, so a capture
+   there waits a frame (see next_boundary()).
+*/
+template <int N, int C>
+static void
+capture(Alo<N, C>* self, int i)
+{
+	LoopView* const view = &self->loops[i];
+
+	if (!self->button_state[i] || self->state[i] != STATE_RECORDING || self->phrase_start[i]) {
+		self->capture_wanted[i] = false;
+		return;
+	}
+	if (!has_buffer(view) && self->storage != STORAGE_DISK) {
+		if (!self->spare || self->spare_storage != self->storage
+		    || self->spare_frames < self->loop_start + self->loop_samples) {
+			if (self->spare_refused
+			    || override_value(&self->midi_capture, self->ports.capture) <= 0.0f) {
+				// no spare is coming, so record the next phrase instead
+				self->capture_wanted[i] = false;
+			}
+			return;
+		}
+		if (self->spare_storage == STORAGE_PCM16) {
+			view->pcm = (int16_t*)self->spare;
+		} else {
+			view->data = (float*)self->spare;
+		}
+		view->frames = self->spare_frames;
+		self->spare = NULL;
+	}
+	self->capture_wanted[i] = false;
+	// nothing has tracked the level of the pass, so 16 bit loops get full scale
+	view->peak = 1.0f;
+	if (!commit_loop(self, i)) {
+		return;
+	}
+	self->phrase_start[i] = self->loop_index;
+	self->state[i] = STATE_LOOP_ON;
+	overview_from_ring(self, i);
+	if (self->streams) {
+		self->streams->windows[i].reseek = true;
+	}
+	trace(self, TRACE_CAPTURE, i, 0.0f);
+}
+
+/**
+   Vector kernels for run_loops().  Each works on a stretch of samples that
+   doesn't cross a loop wrap, beat or phrase boundary, so there's nothing to
+   branch on inside the loop and the compiler can vectorise them.
+*/
+static inline void
+add_scaled_into(float* out, const float* in, float gain, uint32_t n)
+{
+	for (uint32_t k = 0; k < n; k++) {
+		out[k] += gain * in[k];
+	}
+}
+
+static inline void
+scale_into(float* out, const float* in, float gain, uint32_t n)
+{
+	// out may alias in, as the host is allowed to run us in-place
+	for (uint32_t k = 0; k < n; k++) {
+		out[k] = gain * in[k];
+	}
+}
+
+static inline void
+add_into(float* __restrict out, const float* __restrict loop, uint32_t n)
+{
+	for (uint32_t k = 0; k < n; k++) {
+		out[k] += loop[k];
+	}
+}
+
+static inline void
+copy_into(float* __restrict dst, const float* __restrict src, uint32_t n)
+{
+	memcpy(dst, src, n * sizeof(float));
+}
+
+static inline void
+quantise_into(int16_t* __restrict dst, const float* __restrict src, float gain, uint32_t n)
+{
+	for (uint32_t k = 0; k < n; k++) {
+		const float x = fminf(fmaxf(gain * src[k], -PCM16_MAX), PCM16_MAX);
+		dst[k] = (int16_t)(x + copysignf(0.5f, x));
+	}
+}
+
+static inline void
+add_pcm_into(float* __restrict out, const int16_t* __restrict loop, float scale, uint32_t n)
+{
+	for (uint32_t k = 0; k < n; k++) {
+		out[k] += scale * loop[k];
+	}
+}
+
+/**
+   The metered kernels also add the peak and energy of what they write to a
+   level meter, in the same pass, so the samples are only loaded once.
+*/
+static inline void
+add_level(LevelMeter* level, float peak, float energy)
+{
+	level->peak = fmaxf(level->peak, peak);
+	level->energy += energy;
+}
+
+static inline void
+scale_metered_into(float* out, const float* in, float gain, uint32_t n, LevelMeter* level)
+{
+	// out may alias in, as the host is allowed to run us in-place
+	float peak = 0.0f;
+	float energy = 0.0f;
+	for (uint32_t k = 0; k < n; k++) {
+		const float x = in[k];
+		peak = fmaxf(peak, fabsf(x));
+		energy += x * x;
+		out[k] = gain * x;
+	}
+	add_level(level, peak, energy);
+}
+
+static inline void
+add_metered_into(float* __restrict out, const float* __restrict loop, uint32_t n,
+		 LevelMeter* level)
+{
+	float peak = 0.0f;
+	float energy = 0.0f;
+	for (uint32_t k = 0; k < n; k++) {
+		const float x = loop[k];
+		peak = fmaxf(peak, fabsf(x));
+		energy += x * x;
+		out[k] += x;
+	}
+	add_level(level, peak, energy);
+}
+
+static inline void
+add_pcm_metered_into(float* __restrict out, const int16_t* __restrict loop, float scale,
+		     uint32_t n, LevelMeter* level)
+{
+	float peak = 0.0f;
+	float energy = 0.0f;
+	for (uint32_t k = 0; k < n; k++) {
+		const float x = scale * loop[k];
+		peak = fmaxf(peak, fabsf(x));
+		energy += x * x;
+		out[k] += x;
+	}
+	add_level(level, peak, energy);
+}
+
+static inline void
+measure_level(const float* out, uint32_t n, LevelMeter* level)
+{
+	float peak = 0.0f;
+	float energy = 0.0f;
+	for (uint32_t k = 0; k < n; k++) {
+		peak = fmaxf(peak, fabsf(out[k]));
+		energy += out[k] * out[k];
+	}
+	add_level(level, peak, energy);
+}
+
+/** The peak level of frames [from, from + n) over all C channels */
+template <int C>
+static inline float
+peak_level(const float* const* input, uint32_t from, uint32_t n)
+{
+	float peak = 0.0f;
+	for (int c = 0; c < C; c++) {
+		const float* const in = input[c] + from;
+		for (uint32_t k = 0; k < n; k++) {
+			peak = fmaxf(peak, fabsf(in[k]));
+		}
+	}
+	return peak;
+}
+
+/**
+   Hand frames [index, index + len) of the input to the worker to be written
+   to the ring.  If the worker is too far behind to take them they are lost,
+   and the ring keeps what it had there before.
+*/
+template <int N, int C>
+static void
+stream_record(Alo<N, C>* self, uint32_t index, const float* const* in, uint32_t len)
+{
+	Streams<N, C>* const s = self->streams;
+	const uint32_t head = s->input_head;
+
+	if (len > STREAM_WINDOW - (head - __atomic_load_n(&s->input_tail, __ATOMIC_ACQUIRE))
+	    || s->ops_head - __atomic_load_n(&s->ops_tail, __ATOMIC_ACQUIRE) == STREAM_OPS) {
+		trace(self, TRACE_STREAM_OVERRUN, -1, len);
+		return;
+	}
+
+	const uint32_t slot = head % STREAM_WINDOW;
+	const uint32_t first = len < STREAM_WINDOW - slot ? len : STREAM_WINDOW - slot;
+	for (int c = 0; c < C; c++) {
+		float* const input = s->input + c * STREAM_WINDOW;
+		copy_into(input + slot, in[c], first);
+		copy_into(input, in[c] + first, len - first);
+	}
+	s->input_head = head + len;
+
+	const StreamOp op = { STREAM_DATA, -1, index, len, 0, 0, self->loopmix,
+			      self->state[N - 1] == STATE_LOOP_ON };
+	stream_push(s, &op);
+}
+
+/**
+   Take len frames of loop i from its window, for playing at index, adding
+   them to the output if play is set.  A loop that isn't playing still takes
+   its frames, so the window keeps up with it and it can start at any time.
+*/
+template <int N, int C>
+static void
+stream_play(Alo<N, C>* self, int i, uint32_t index, float* const* out,
+	    uint32_t len, bool play)
+{
+	StreamWindow* const w = &self->streams->windows[i];
+
+	if (__atomic_load_n(&w->served, __ATOMIC_ACQUIRE) != w->wanted) {
+		if (play) {
+			trace(self, TRACE_STREAM_UNDERRUN, i, len);
+		}
+		return;
+	}
+	if (w->reseek || !w->length
+	    || w->loop_start != self->loop_start || w->length != self->loop_samples
+	    || w->loop_start + (w->start - w->loop_start + w->read) % w->length != index) {
+		// by the time the worker has seeked, we will be on the next frames
+		const uint32_t next = index + len;
+		stream_seek(self, i, next < self->loop_start + self->loop_samples
+			    ? next : self->loop_start, 0);
+		if (play) {
+			trace(self, TRACE_STREAM_UNDERRUN, i, len);
+		}
+		return;
+	}
+
+	const uint32_t ready = __atomic_load_n(&w->written, __ATOMIC_ACQUIRE) - w->read;
+	const uint32_t n = ready < len ? ready : len;
+	if (play) {
+		const uint32_t slot = w->read % STREAM_WINDOW;
+		const uint32_t first = n < STREAM_WINDOW - slot ? n : STREAM_WINDOW - slot;
+		for (int c = 0; c < C; c++) {
+			const float* const frames = w->frames + c * STREAM_WINDOW;
+			if (self->metering) {
+				add_metered_into(out[c], frames + slot, first, &self->loop_level[i]);
+				add_metered_into(out[c] + first, frames, n - first,
+						 &self->loop_level[i]);
+			} else {
+				add_into(out[c], frames + slot, first);
+				add_into(out[c] + first, frames, n - first);
+			}
+		}
+		if (n < len) {
+			trace(self, TRACE_STREAM_UNDERRUN, i, len - n);
+		}
+	}
+	__atomic_store_n(&w->read, w->read + n, __ATOMIC_RELEASE);
+}
+
+/**
+   Find the first sample in [from, n) which crosses the threshold on any
+   channel, or n if there isn't one.  Quiet input is skipped a chunk at a time
+   using a (vectorised) peak over the chunk, and only the chunk that crosses
+   is searched sample by sample.
+*/
+template <int C>
+static uint32_t
+find_onset(const float* const* input, float threshold, uint32_t from, uint32_t n)
+{
+	uint32_t k = from;
+	for (; k + ONSET_CHUNK <= n; k += ONSET_CHUNK) {
+		if (peak_level<C>(input, k, ONSET_CHUNK) > threshold) {
+			break;
+		}
+	}
+	for (; k < n; k++) {
+		if (peak_level<C>(input, k, 1) > threshold) {
+			return k;
+		}
+	}
+	return n;
+}
+
+/**
+   Run the envelope follower over [begin, end) of the block, noting where it
+   opens the gate.  The slow attack means a single noisy spike can't open it,
+   and the gate has to close (6dB below the threshold) before it can open
+   again.
+*/
+template <int C>
+static void
+follow_envelope(OnsetDetector* od, const float* const* input,
+		float threshold, uint32_t begin, uint32_t end)
+{
+	float envelope = od->envelope;
+
+	od->n_onsets = 0;
+	for (uint32_t k = begin; k < end; k++) {
+		const float level = peak_level<C>(input, k, 1);
+		envelope += (level > envelope ? od->attack : od->release) * (level - envelope);
+		if (!od->gate && envelope > threshold) {
+			od->gate = true;
+			if (od->n_onsets < ONSET_MAX) {
+				od->onsets[od->n_onsets++] = k;
+			}
+		} else if (od->gate && envelope < threshold * ONSET_HYSTERESIS) {
+			od->gate = false;
+		}
+	}
+	od->envelope = envelope;
+}
+
+/**
+   Get the onset detector ready for the range [begin, end) of the block.  It
+   only does any work while some loop is waiting for its phrase to start.
+*/
+template <int N, int C>
+static void
+onset_begin(Alo<N, C>* self, uint32_t begin, uint32_t end)
+{
+	OnsetDetector* const od = &self->onset;
+
+	bool waiting = false;
+	UNROLL_LOOPS
+	for (uint32_t i = 0; i < N; i++) {
+		if (self->state[i] == STATE_RECORDING && self->button_state[i]
+		    && self->phrase_start[i] == 0 && !self->capture_wanted[i]) {
+			waiting = true;
+		}
+	}
+	if (!waiting || (!self->recording && !self->streams)) {
+		od->active = false;
+		return;
+	}
+
+	if (!od->active) {
+		od->envelope = 0.0f;
+		od->gate = false;
+	}
+	od->active = true;
+	od->mode = *self->ports.onset_mode >= 1.0f ? ONSET_ENVELOPE : ONSET_PEAK;
+	od->from = UINT32_MAX;
+	od->found = 0;
+
+	if (od->mode == ONSET_ENVELOPE) {
+		follow_envelope<C>(od, self->ports.input, self->threshold, begin, end);
+	}
+}
+
+/**
+   The block offset of the first onset in [from, end), or end if there isn't
+   one.  In peak mode the result of the last search is reused, so a range is
+   only ever scanned once.
+*/
+template <int N, int C>
+static uint32_t
+onset_after(Alo<N, C>* self, uint32_t from, uint32_t end)
+{
+	OnsetDetector* const od = &self->onset;
+
+	if (od->mode == ONSET_ENVELOPE) {
+		for (uint32_t j = 0; j < od->n_onsets; j++) {
+			if (od->onsets[j] >= from) {
+				return od->onsets[j];
+			}
+		}
+		return end;
+	}
+
+	if (from < od->from || from > od->found) {
+		od->from = from;
+		od->found = find_onset<C>(self->ports.input, self->threshold, from, end);
+	}
+	return od->found;
+}
+
+/**
+   Apply the phrase and beat transitions for loop i that fall on the current
+   loop_index.  These are the only things that change a loop's state inside
+   run_loops(), so everything up to the next boundary can be done in one go.
+*/
+template <int N, int C>
+static void
+loop_boundary(Alo<N, C>* self, uint32_t i, bool on_beat)
+{
+	if (self->capture_wanted[i] && self->loop_index) {
+		capture(self, i);
+	}
+	if (self->phrase_start[i] && self->phrase_start[i] == self->loop_index) {
+		if (self->button_state[i]) {
+			if (self->state[i] == STATE_RECORDING && commit_loop(self, i)) {
+				overview_from_ring(self, i);
+				self->state[i] = STATE_LOOP_ON;
+				trace(self, TRACE_LOOP_ON, i, 0.0f);
+			} else if (self->state[i] == STATE_LOOP_OFF) {
+				self->state[i] = STATE_LOOP_ON;
+				trace(self, TRACE_LOOP_ON, i, 0.0f);
+			}
+		} else {
+			if (self->state[i] == STATE_RECORDING) {
+				self->phrase_start[i] = 0;
+				clear_overview(&self->overview[i]);
+				trace(self, TRACE_ABANDON, i, 0.0f);
+			} else if (self->state[i] == STATE_LOOP_ON) {
+				self->state[i] = STATE_LOOP_OFF;
+				trace(self, TRACE_LOOP_OFF, i, 0.0f);
+			}
+		}
+	}
+
+	// Per-beat loops mode
+	if (on_beat) {
+		if (self->pb_loops > i && self->state[i] != STATE_RECORDING) {
+			const State state = self->button_state[i] ? STATE_LOOP_ON : STATE_LOOP_OFF;
+			if (state != self->state[i]) {
+				self->state[i] = state;
+				trace(self, state == STATE_LOOP_ON ? TRACE_BEAT_LOOP_ON
+				      : TRACE_BEAT_LOOP_OFF, i, 0.0f);
+			}
+		}
+	}
+}
+
+/**
+   The loop_index of the next wrap, beat or phrase start after the current
+   one.  If loop_index has been left past the end of the loop (free running
+   mode moves the end), we do one sample and then wrap, as before.
+*/
+template <int N, int C>
+static uint32_t
+next_boundary(const Alo<N, C>* self, uint32_t beat_len)
+{
+	const uint32_t index = self->loop_index;
+	const uint32_t end = self->loop_start + self->loop_samples;
+	uint32_t next = index < end ? end : index + 1;
+
+	if (beat_len) {
+		const uint32_t beat = (index / beat_len + 1) * beat_len;
+		if (beat < next) {
+			next = beat;
+		}
+	}
+	UNROLL_LOOPS
+	for (uint32_t i = 0; i < N; i++) {
+		if (self->phrase_start[i] > index && self->phrase_start[i] < next) {
+			next = self->phrase_start[i];
+		}
+		if (self->capture_wanted[i] && !index) {
+			next = 1;
+		}
+	}
+	return next;
+}
+
+/**
+   Copy frames [index, index + n) of the input into the ring, at the mix
+   level, and mix the input and the loops into the outputs.
+*/
+template <int N, int C>
+static void
+mix_segment(Alo<N, C>* self, uint32_t index, const float* const* in, float* const* out,
+	    uint32_t n)
+{
+	const uint32_t stride = self->recording_frames;
+	// a ring too short for the loop is left alone until it is replaced
+	float* const recording = index + n <= stride ? self->recording : NULL;
+
+	for (int c = 0; c < C; c++) {
+		if (recording) {
+			scale_into(recording + c * stride + index, in[c], self->loopmix, n);
+		}
+		if (self->metering) {
+			scale_metered_into(out[c], in[c], self->inmix, n, &self->input_level);
+		} else {
+			scale_into(out[c], in[c], self->inmix, n);
+		}
+	}
+
+	UNROLL_LOOPS
+	for (uint32_t i = 0; i < N; i++) {
+		const LoopView* const view = &self->loops[i];
+		if (self->streams && !has_buffer(view)) {
+			if (self->state[i] != STATE_RECORDING) {
+				stream_play(self, i, index, out, n,
+					    self->state[i] == STATE_LOOP_ON);
+			} else if (self->phrase_start[i] && self->button_state[i]) {
+				stream_prepare(self, i, index + n);
+			}
+			continue;
+		}
+		if (self->state[i] != STATE_LOOP_ON) {
+			continue;
+		}
+		// the last loop is replaced by what's playing now, for overdubs
+		// (unless it was restored and what's playing goes to disk)
+		const bool overdub = i == N - 1 && recording;
+		for (int c = 0; c < C; c++) {
+			const size_t at = (size_t)c * view->frames + index;
+			LevelMeter* const level = &self->loop_level[i];
+			if (view->pcm) {
+				if (self->metering) {
+					add_pcm_metered_into(out[c], view->pcm + at, view->scale,
+							     n, level);
+				} else {
+					add_pcm_into(out[c], view->pcm + at, view->scale, n);
+				}
+				if (overdub) {
+					quantise_into(view->pcm + at, in[c], 1.0f / view->scale, n);
+				}
+			} else {
+				if (self->metering) {
+					add_metered_into(out[c], view->data + at, n, level);
+				} else {
+					add_into(out[c], view->data + at, n);
+				}
+				if (overdub) {
+					copy_into(view->data + at, in[c], n);
+				}
+			}
+		}
+	}
+}
+
+/**
+   Record and play the loops for the range [begin, end) of this cycle.
+*/
+template <int N, int C>
+static void
+run_loops(Alo<N, C>* self, uint32_t begin, uint32_t end)
+{
+	float* const recording = self->recording;
+	const uint32_t stride = self->recording_frames;
+	self->threshold = dbToFloat(*self->ports.threshold);
+
+	const float mix = override_value(&self->midi_mix, self->ports.mix);
+	self->loopmix = fmin(1.0, mix / 50);
+	self->inmix = fmin(1, (100 - mix) / 50);
+
+	const uint32_t beat_len = self->loop_beats ? self->loop_samples / self->loop_beats : 0;
+
+	onset_begin(self, begin, end);
+
+	uint32_t pos = begin;
+	while (pos < end) {
+		const uint32_t index = self->loop_index;
+		const bool on_beat = beat_len && index % beat_len == 0;
+		UNROLL_LOOPS
+		for (uint32_t i = 0; i < N; i++) {
+			loop_boundary(self, i, on_beat);
+		}
+
+		const uint32_t boundary = next_boundary(self, beat_len) - index;
+		const uint32_t len = boundary < end - pos ? boundary : end - pos;
+		const float* in[C];
+		float* out[C];
+		for (int c = 0; c < C; c++) {
+			in[c] = self->ports.input[c] + pos;
+			out[c] = self->ports.output[c] + pos;
+		}
+
+		// Nothing is stored while recording: the ring has it all
+		if (self->onset.active) {
+			uint32_t onset = onset_after(self, pos, end);
+			if (onset == pos && index == 0) {
+				// phrase_start == 0 means "not started yet", so skip it
+				onset = onset_after(self, pos + 1, end);
+			}
+			if (onset < pos + len) {
+				const uint32_t start = index + onset - pos;
+				UNROLL_LOOPS
+				for (uint32_t i = 0; i < N; i++) {
+					if (self->state[i] == STATE_RECORDING && self->button_state[i]
+					    && self->phrase_start[i] == 0 && !self->capture_wanted[i]) {
+						self->phrase_start[i] = start;
+						self->loops[i].peak = 0.0f;
+						overview_from_ring(self, i);
+						if (self->streams) {
+							self->streams->windows[i].reseek = true;
+						}
+						trace_at(self, TRACE_PHRASE_START, i, start,
+							 self->frames + onset - pos, 0.0f);
+					}
+				}
+			}
+		}
+
+		// Compact loops pick their scale from the loudest part of the phrase
+		if (self->storage == STORAGE_PCM16) {
+			float peak = -1.0f;
+			UNROLL_LOOPS
+			for (uint32_t i = 0; i < N; i++) {
+				if (self->state[i] == STATE_RECORDING && self->phrase_start[i]) {
+					if (peak < 0.0f) {
+						peak = self->loopmix * peak_level<C>(in, 0, len);
+					}
+					self->loops[i].peak = fmaxf(self->loops[i].peak, peak);
+				}
+			}
+		}
+
+		// Freeze anything the ring is about to overwrite, then overwrite it
+		UNROLL_LOOPS
+		for (uint32_t i = 0; i < N; i++) {
+			LoopView* const view = &self->loops[i];
+			if (view->unfrozen) {
+				const uint32_t n = view->unfrozen < len ? view->unfrozen : len;
+				for (int c = 0; c < C; c++) {
+					const float* const ring = recording + c * stride + index;
+					const size_t at = (size_t)c * view->frames + index;
+					if (view->pcm) {
+						quantise_into(view->pcm + at, ring, 1.0f / view->scale, n);
+					} else {
+						copy_into(view->data + at, ring, n);
+					}
+				}
+				view->unfrozen -= n;
+			}
+		}
+		if (self->streams) {
+			stream_record(self, index, in, len);
+		}
+		if (recording || self->streams) {
+			peak_tree_record<C>(&self->peak_tree, index, in, self->loopmix, len,
+					    self->loop_start);
+		}
+		mix_segment(self, index, in, out, len);
+
+		pos += len;
+		self->frames += len;
+		self->loop_index += len;
+		if (self->loop_index >= self->loop_start + self->loop_samples) {
+			self->loop_index = self->loop_start;
+			if (self->stretch_length) {
+				swap_stretched(self);
+			}
+		}
+	}
+}
+
+/**
+   Play the click for the range [begin..end) of this cycle, from the bar
+   rendered for the current tempo.  The phase is counted in frames from the
+   last bar position the host sent, so beats land on their frame and don't
+   drift.  The click goes to its own output when that is selected and
+   connected, and into every main output otherwise.
+*/
+template <int N, int C>
+static void
+run_clicks(Alo<N, C>* self, uint32_t begin, uint32_t end)
+{
+	float* const click_out = self->ports.click_out;
+	const bool separate = click_out && self->ports.click_route
+		&& *self->ports.click_route >= 1.0f;
+	if (click_out) {
+		memset(click_out + begin, 0, (end - begin) * sizeof(float));
+	}
+
+	const uint32_t frames = self->bar_frames;
+	if (!frames) {
+		return;
+	}
+	const float click = override_value(&self->midi_click, self->ports.click);
+	bool play = click && self->speed && self->click_bar
+		&& self->click_frames == frames && self->click_beats == self->bar_beats;
+	UNROLL_LOOPS
+	for (uint32_t i = 0; i < N; i++) {
+		if (self->state[i] == STATE_LOOP_ON) {
+			play = false;
+		}
+	}
+
+	const float gain = 0.1f * floorf(click);
+	float* const* const out = separate ? &self->ports.click_out : self->ports.output;
+	const int channels = separate ? 1 : C;
+	uint32_t phase = self->click_phase < frames ? self->click_phase : 0;
+	for (uint32_t pos = begin; pos < end;) {
+		const uint32_t len = end - pos < frames - phase ? end - pos : frames - phase;
+		for (int c = 0; play && c < channels; c++) {
+			add_scaled_into(out[c] + pos, self->click_bar + phase, gain, len);
+		}
+		pos += len;
+		phase += len;
+		if (phase == frames) {
+			phase = 0;
+		}
+	}
+	self->click_phase = phase;
+}
+
+/**
+   Ask the worker for a bar of click when the tempo has changed.  Until it
+   arrives the click is silent.
+*/
+template <int N, int C>
+static void
+request_click(Alo<N, C>* self)
+{
+	if (!self->schedule || self->click_pending
+	    || !override_value(&self->midi_click, self->ports.click) || !self->bar_frames
+	    || (self->click_frames == self->bar_frames && self->click_beats == self->bar_beats)) {
+		return;
+	}
+	AloWork work = { WORK_CLICK, (int)self->bar_beats, self->bar_frames, STORAGE_FLOAT, NULL };
+	if (self->schedule->schedule_work(self->schedule->handle,
+					  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+		self->click_pending = true;
+	}
+}
+
+/**
+   Send the worker each loop that is to be exported, once it has been frozen
+   into its own buffer.  From then until the worker is done, the loop is
+   pinned: a new phrase isn't committed into its buffer, and anything that
+   frees the buffer is queued behind the export, so run() never has to wait
+   or copy.  The overdub loop is still written to as it plays, so like
+   save() an export of it may catch an overdub half way.  Setting the export
+   port to a loop (or N + 1, for all of them) exports it once; set it back to
+   0 to export the same loop again.  Called at the end of run().
+*/
+template <int N, int C>
+static void
+request_exports(Alo<N, C>* self)
+{
+	if (!self->schedule) {
+		return;
+	}
+	const float value = floorf(*self->ports.export_loop);
+	if (value != self->export_value) {
+		self->export_value = value;
+		for (int i = 0; i < N; i++) {
+			self->export_wanted[i] = self->export_wanted[i]
+				|| value == i + 1 || value == N + 1;
+		}
+	}
+
+	for (int i = 0; i < N; i++) {
+		const LoopView* const view = &self->loops[i];
+		if (!self->export_wanted[i] || self->export_pinned[i]
+		    || (has_buffer(view) && view->unfrozen)) {
+			continue;
+		}
+		if (self->state[i] == STATE_RECORDING || (!has_buffer(view) && !self->streams)) {
+			// nothing recorded to export
+			self->export_wanted[i] = false;
+			self->export_progress[i] = -1.0f;
+			self->export_report[i] = true;
+			continue;
+		}
+		const Storage storage = !has_buffer(view) ? STORAGE_DISK
+			: view->pcm ? STORAGE_PCM16 : STORAGE_FLOAT;
+		void* const buffer = storage == STORAGE_DISK ? (void*)self->streams
+			: view->pcm ? (void*)view->pcm : (void*)view->data;
+		const ExportWork work = {
+			{ WORK_EXPORT, i, view->frames, storage, buffer },
+			self->export_job[i] + 1, view->offset, view->length, view->scale, 0.0f
+		};
+		__atomic_store_n(&self->export_job[i], work.job, __ATOMIC_RELEASE);
+		if (self->schedule->schedule_work(self->schedule->handle,
+						  sizeof(work), &work) == LV2_WORKER_SUCCESS) {
+			self->export_wanted[i] = false;
+			self->export_pinned[i] = true;
+			self->export_progress[i] = 0.0f;
+			self->export_report[i] = true;
+		}
+	}
+}
+
+/**
+   Tell the host or GUI how exports are getting on, with an alo:Export object
+   on the notify port for each loop that has news: alo:loop (from 1) and
+   alo:progress (0 to 1, or -1 if the loop couldn't be exported), and when
+   the file is written, alo:path.
+*/
+template <int N, int C>
+static void
+forge_exports(Alo<N, C>* self)
+{
+	const AloURIs* const uris = &self->uris;
+
+	for (int i = 0; i < N; i++) {
+		if (!self->export_report[i]) {
+			continue;
+		}
+		self->export_report[i] = false;
+
+		LV2_Atom_Forge_Frame frame;
+		lv2_atom_forge_frame_time(&self->forge, 0);
+		lv2_atom_forge_object(&self->forge, &frame, 0, uris->alo_Export);
+		lv2_atom_forge_key(&self->forge, uris->alo_loop);
+		lv2_atom_forge_int(&self->forge, i + 1);
+		lv2_atom_forge_key(&self->forge, uris->alo_progress);
+		lv2_atom_forge_float(&self->forge, self->export_progress[i]);
+		if (self->export_progress[i] >= 1.0f) {
+			lv2_atom_forge_key(&self->forge, uris->alo_path);
+			lv2_atom_forge_path(&self->forge, self->export_path[i],
+					    strlen(self->export_path[i]));
+		}
+		lv2_atom_forge_pop(&self->forge, &frame);
+	}
+}
+
+/**
+   Time spent since *last goes to section s, if the load meter is on.
+*/
+static inline void
+lap(uint64_t* spent, Section s, uint64_t* last)
+{
+	if (spent) {
+		const uint64_t now = read_counter();
+		spent[s] += now - *last;
+		*last = now;
+	}
+}
+
+template <int N, int C>
+static void
+run_range(Alo<N, C>* self, uint32_t begin, uint32_t end, uint64_t* spent, uint64_t* last)
+{
+	run_loops(self, begin, end);
+	lap(spent, SECTION_LOOPS, last);
+	run_clicks(self, begin, end);
+	// the output is metered once the click is in it, if it goes there
+	for (int c = 0; self->metering && c < C; c++) {
+		measure_level(self->ports.output[c] + begin, end - begin, &self->output_level);
+	}
+	lap(spent, SECTION_CLICKS, last);
+}
+
+/**
+   Process a cycle, splitting it at each MIDI and control event so that notes
+   and transport changes take effect on the frame they were sent for.  The two
+   sequences are merged in time order, with transport changes ahead of notes
+   on the same frame.  If spent is given, time taken by each section is added
+   to it.
+*/
+template <int N, int C>
+static void
+process(Alo<N, C>* self, uint32_t n_samples, uint64_t* spent)
+{
+	const LV2_Atom_Sequence* const control = self->ports.control;
+	const LV2_Atom_Sequence* const midiin = self->ports.midiin;
+	const LV2_Atom_Event* c = lv2_atom_sequence_begin(&control->body);
+	const LV2_Atom_Event* m = lv2_atom_sequence_begin(&midiin->body);
+	uint64_t last = spent ? read_counter() : 0;
+	uint32_t pos = 0;
+
+	if (*self->ports.midi_base != self->map_base
+	    || *self->ports.midi_channel != self->map_channel) {
+		build_midi_map(self);
+	}
+	switch_events(self);
+	lap(spent, SECTION_EVENTS, &last);
+
+	for (;;) {
+		const bool c_end = lv2_atom_sequence_is_end(&control->body, control->atom.size, c);
+		const bool m_end = lv2_atom_sequence_is_end(&midiin->body, midiin->atom.size, m);
+		if (c_end && m_end) {
+			break;
+		}
+		const bool take_control = !c_end && (m_end || c->time.frames <= m->time.frames);
+		const int64_t frames = take_control ? c->time.frames : m->time.frames;
+		const uint32_t frame = frames < pos ? pos
+			: frames > n_samples ? n_samples : (uint32_t)frames;
+
+		if (frame > pos) {
+			run_range(self, pos, frame, spent, &last);
+			pos = frame;
+		}
+		if (take_control) {
+			control_event(self, &c->body);
+			c = lv2_atom_sequence_next(c);
+		} else {
+			midi_event(self, &m->body);
+			m = lv2_atom_sequence_next(m);
+		}
+		lap(spent, SECTION_EVENTS, &last);
+	}
+
+	if (pos < n_samples) {
+		run_range(self, pos, n_samples, spent, &last);
+	}
+}
+
+/**
+   Start afresh after a report, or when the load meter is switched on.
+*/
+static void
+clear_load(LoadMeter* meter)
+{
+	for (int s = 0; s < NUM_SECTIONS; s++) {
+		meter->min[s] = INFINITY;
+		meter->max[s] = 0.0f;
+		meter->sum[s] = 0.0f;
+	}
+	for (int b = 0; b < LOAD_BINS; b++) {
+		meter->histogram[b] = 0;
+	}
+	meter->total = 0.0f;
+	meter->peak = 0.0f;
+	meter->blocks = 0;
+	meter->frames = 0;
+}
+
+/**
+   Add the time each section took in this cycle to the load meter, against
+   the deadline for the cycle.
+*/
+template <int N, int C>
+static void
+add_load(Alo<N, C>* self, const uint64_t* spent, uint32_t n_samples)
+{
+	LoadMeter* const meter = &self->meter;
+
+	const float per_tick = (float)(self->rate / (n_samples * meter->tick_rate));
+	float load = 0.0f;
+	for (int s = 0; s < NUM_SECTIONS; s++) {
+		const float section = spent[s] * per_tick;
+		meter->min[s] = fminf(meter->min[s], section);
+		meter->max[s] = fmaxf(meter->max[s], section);
+		meter->sum[s] += section;
+		load += section;
+	}
+
+	const uint32_t bin = (uint32_t)(load * (LOAD_BINS - 1));
+	meter->histogram[bin < LOAD_BINS ? bin : LOAD_BINS - 1]++;
+	meter->total += load;
+	meter->peak = fmaxf(meter->peak, load);
+	meter->blocks++;
+	meter->frames += n_samples;
+}
+
+template <int N, int C>
+static void
+forge_section(Alo<N, C>* self, LV2_URID key, Section s)
+{
+	const LoadMeter* const meter = &self->meter;
+	const float figures[3] = {
+		100.0f * meter->min[s],
+		100.0f * meter->sum[s] / meter->blocks,
+		100.0f * meter->max[s]
+	};
+	lv2_atom_forge_key(&self->forge, key);
+	lv2_atom_forge_vector(&self->forge, sizeof(float), self->forge.Float,
+			      3, figures);
+}
+
+/**
+   Publish the load since the last report: the mean and worst block on the
+   output ports, and min/mean/max for each section plus the histogram of block
+   loads (in 10% steps, the last counting overruns) as an alo:Load object on
+   the notify port.  All figures are percentages of the block deadline, except
+   alo:memory: the megabytes of loop buffers leased by every instance, and how
+   many of them are locked.
+*/
+template <int N, int C>
+static void
+report_load(Alo<N, C>* self)
+{
+	LoadMeter* const meter = &self->meter;
+	const AloURIs* uris = &self->uris;
+
+	*self->ports.load = 100.0f * meter->total / meter->blocks;
+	*self->ports.load_peak = 100.0f * meter->peak;
+
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_frame_time(&self->forge, 0);
+	lv2_atom_forge_object(&self->forge, &frame, 0, uris->alo_Load);
+	forge_section(self, uris->alo_loops, SECTION_LOOPS);
+	forge_section(self, uris->alo_clicks, SECTION_CLICKS);
+	forge_section(self, uris->alo_events, SECTION_EVENTS);
+	lv2_atom_forge_key(&self->forge, uris->alo_histogram);
+	lv2_atom_forge_vector(&self->forge, sizeof(int32_t), self->forge.Int,
+			      LOAD_BINS, meter->histogram);
+	const int32_t memory[2] = {
+		(int32_t)(__atomic_load_n(&pool.leased, __ATOMIC_RELAXED) * POOL_CHUNK >> 20),
+		(int32_t)(__atomic_load_n(&pool.locked, __ATOMIC_RELAXED) * POOL_CHUNK >> 20)
+	};
+	lv2_atom_forge_key(&self->forge, uris->alo_memory);
+	lv2_atom_forge_vector(&self->forge, sizeof(int32_t), self->forge.Int, 2, memory);
+	lv2_atom_forge_pop(&self->forge, &frame);
+
+	clear_load(meter);
+}
+
+/** A level in dB, for a meter port */
+static inline float
+level_db(float level)
+{
+	return level > 0.0f ? fmaxf(20.0f * log10f(level), LEVEL_FLOOR) : LEVEL_FLOOR;
+}
+
+static void
+show_level(LevelMeter* level, float* peak_port, float* rms_port, float fall, float smooth,
+	   uint32_t samples)
+{
+	level->held = fmaxf(level->peak, level->held * fall);
+	level->power += (level->energy / samples - level->power) * smooth;
+	level->peak = 0.0f;
+	level->energy = 0.0f;
+	if (peak_port) {
+		*peak_port = level_db(level->held);
+	}
+	if (rms_port) {
+		*rms_port = level_db(sqrtf(level->power));
+	}
+}
+
+/**
+   Put what the level meters saw this cycle on their ports, as the input,
+   output and each loop's peak and rms levels in dB.  Peaks are held and fall
+   back at LEVEL_FALL dB a second, and rms levels are averaged over about
+   LEVEL_WINDOW seconds, so that they can be read by eye whatever the block
+   size.  With the meters off they all read LEVEL_FLOOR.
+*/
+template <int N, int C>
+static void
+report_levels(Alo<N, C>* self, uint32_t n_samples)
+{
+	if (!n_samples) {
+		return;
+	}
+	if (!self->metering) {
+		// nothing was measured, so they go straight to the floor
+		memset(&self->input_level, 0, sizeof(self->input_level));
+		memset(&self->output_level, 0, sizeof(self->output_level));
+		memset(self->loop_level, 0, sizeof(self->loop_level));
+	}
+	const float seconds = (float)(n_samples / self->rate);
+	const float fall = self->metering ? powf(10.0f, -LEVEL_FALL * seconds / 20.0f) : 0.0f;
+	const float smooth = self->metering ? 1.0f - expf(-seconds / (float)LEVEL_WINDOW) : 0.0f;
+	const uint32_t samples = n_samples * C;
+
+	show_level(&self->input_level, self->ports.input_peak, self->ports.input_rms,
+		   fall, smooth, samples);
+	show_level(&self->output_level, self->ports.output_peak, self->ports.output_rms,
+		   fall, smooth, samples);
+	for (int i = 0; i < N; i++) {
+		show_level(&self->loop_level[i], self->ports.loop_peak[i], self->ports.loop_rms[i],
+			   fall, smooth, samples);
+	}
+}
+
+/**
+   Every OVERVIEW_REPORT seconds, tell GUIs where the loops are up to, with an
+   alo:Overview object on the notify port: alo:phase, how far through the
+   loop playback is (0 to 1), and alo:states, each loop's state (0 off, 1
+   playing, 2 recording).  It is followed by an alo:Peaks object for each
+   loop whose waveform has changed: alo:loop (from 1), alo:first, the first
+   of its OVERVIEW_POINTS points that changed, and alo:peaks, the min and max
+   of that point and the changed points straight after it.  No more than
+   OVERVIEW_BUDGET points are sent at a time, and what doesn't fit waits for
+   the next report.
+*/
+template <int N, int C>
+static void
+report_overview(Alo<N, C>* self, uint32_t n_samples)
+{
+	const AloURIs* const uris = &self->uris;
+	LV2_Atom_Forge* const forge = &self->forge;
+
+	self->overview_frames += n_samples;
+	if (self->overview_frames < OVERVIEW_REPORT * self->rate) {
+		return;
+	}
+	self->overview_frames = 0;
+	update_overview(self);
+
+	const float phase = self->loop_samples && self->loop_index >= self->loop_start
+		? (float)(self->loop_index - self->loop_start) / self->loop_samples : 0.0f;
+	int32_t states[N];
+	for (int i = 0; i < N; i++) {
+		states[i] = self->state[i] == STATE_LOOP_ON ? 1
+			: self->state[i] == STATE_RECORDING && self->phrase_start[i] ? 2 : 0;
+	}
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_frame_time(forge, 0);
+	lv2_atom_forge_object(forge, &frame, 0, uris->alo_Overview);
+	lv2_atom_forge_key(forge, uris->alo_phase);
+	lv2_atom_forge_float(forge, fminf(phase, 1.0f));
+	lv2_atom_forge_key(forge, uris->alo_states);
+	lv2_atom_forge_vector(forge, sizeof(int32_t), forge->Int, N, states);
+	lv2_atom_forge_pop(forge, &frame);
+
+	uint32_t budget = OVERVIEW_BUDGET;
+	for (int j = 0; j < N && budget; j++) {
+		const int i = (self->overview_next + j) % N;
+		LoopOverview* const overview = &self->overview[i];
+		uint32_t first = 0;
+		while (first < OVERVIEW_POINTS && !overview->dirty[first]) {
+			first++;
+		}
+		uint32_t n = 0;
+		while (first + n < OVERVIEW_POINTS && overview->dirty[first + n] && n < budget) {
+			n++;
+		}
+		if (!n) {
+			continue;
+		}
+		// an event, an object with three properties, and the peaks
+		const uint32_t needed = 128 + 2 * n * sizeof(float);
+		if (forge->offset + needed > forge->size) {
+			break;
+		}
+		float peaks[2 * OVERVIEW_BUDGET];
+		for (uint32_t p = 0; p < n; p++) {
+			peaks[2 * p] = overview->lo[first + p] / 127.0f;
+			peaks[2 * p + 1] = overview->hi[first + p] / 127.0f;
+		}
+		lv2_atom_forge_frame_time(forge, 0);
+		lv2_atom_forge_object(forge, &frame, 0, uris->alo_Peaks);
+		lv2_atom_forge_key(forge, uris->alo_loop);
+		lv2_atom_forge_int(forge, i + 1);
+		lv2_atom_forge_key(forge, uris->alo_first);
+		lv2_atom_forge_int(forge, (int32_t)first);
+		lv2_atom_forge_key(forge, uris->alo_peaks);
+		lv2_atom_forge_vector(forge, sizeof(float), forge->Float, 2 * n, peaks);
+		lv2_atom_forge_pop(forge, &frame);
+
+		memset(&overview->dirty[first], 0, n * sizeof(bool));
+		budget -= n;
+		self->overview_next = (i + 1) % N;
+	}
+}
+
+/**
+   The `run()` method is the main process function of the plugin.  It processes
+   a block of audio in the audio context.  Since this plugin is
+   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
+   a mutex) or memory allocation are not allowed.
+*/
+template <int N, int C>
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+	const uint32_t fp_mode = enable_ftz();
+
+	self->trace.on = self->schedule && *self->ports.trace > 0.0f;
+	self->metering = *self->ports.meters > 0.0f;
+
+	// Set up the notify port, the host gives us its capacity in atom.size
+	LV2_Atom_Forge_Frame notify_frame;
+	lv2_atom_forge_set_buffer(&self->forge, (uint8_t*)self->ports.notify,
+				  self->ports.notify->atom.size);
+	lv2_atom_forge_sequence_head(&self->forge, &notify_frame, 0);
+
+	// Freewheeling, cycles have no deadline, so there is no load to measure
+	const bool freewheel = self->ports.freewheel && *self->ports.freewheel > 0.0f;
+	LoadMeter* const meter = &self->meter;
+	if (*self->ports.load_meter > 0.0f && !freewheel) {
+		uint64_t spent[NUM_SECTIONS] = { 0 };
+		if (!meter->on) {
+			meter->on = true;
+			clear_load(meter);
+		}
+		process(self, n_samples, spent);
+		add_load(self, spent, n_samples);
+		if (meter->frames >= LOAD_REPORT * self->rate) {
+			report_load(self);
+		}
+	} else {
+		if (meter->on) {
+			meter->on = false;
+			*self->ports.load = 0.0f;
+			*self->ports.load_peak = 0.0f;
+		}
+		process(self, n_samples, NULL);
+	}
+	report_levels(self, n_samples);
+	report_overview(self, n_samples);
+
+	if (! *(self->ports.enabled)) {
+		// wipe the loops on the way into bypass, not on every cycle of it
+		if (!self->bypassed) {
+			self->bypassed = true;
+			reset(self);
+		}
+	} else if (self->bypassed) {
+		self->bypassed = false;
+		for (int i = 0; i < N; i++) {
+			self->button_state[i] = (*self->ports.loops[i]) > 0.0f;
+		}
+	}
+
+	request_buffers(self);
+	request_click(self);
+	request_stretch(self);
+	forge_exports(self);
+	request_exports(self);
+	schedule_streams(self);
+	schedule_trace(self);
+	lv2_atom_forge_pop(&self->forge, &notify_frame);
+	restore_fp_mode(fp_mode);
+}
+
+/**
+   The `deactivate()` method is the counterpart to `activate()`, and is called by
+   the host after running the plugin.  It indicates that the host will not call
+   `run()` again until another call to `activate()` and is mainly useful for more
+   advanced plugins with ``live'' characteristics such as those with auxiliary
+   processing threads.	As with `activate()`, this plugin has no use for this
+   information so this method does nothing.
+
+   This method is in the ``instantiation'' threading class, so no other
+   methods on this instance will be called concurrently with it.
+*/
+
+static void
+deactivate(LV2_Handle instance)
+{
+	log("Deactivate");
+}
+
+/** Dispose of disk storage, on the worker (or in cleanup()) */
+template <int N, int C>
+static void
+close_streams(Streams<N, C>* s)
+{
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	for (int i = 0; i < N; i++) {
+		pool_free(s->windows[i].frames);
+	}
+	pool_free(s->input);
+	free(s);
+}
+
+/**
+   Set up disk storage with regions of the given number of frames, in a file
+   that is unlinked straight away so nothing is left behind.  The file starts
+   empty, and reading past what has been written gives silence.
+*/
+template <int N, int C>
+static Streams<N, C>*
+open_streams(uint32_t frames)
+{
+	Streams<N, C>* s = (Streams<N, C>*)calloc(1, sizeof(Streams<N, C>));
+	if (!s) {
+		return NULL;
+	}
+	s->fd = -1;
+	s->frames = frames;
+	bool ok = (s->input = (float*)pool_alloc(STREAM_WINDOW * C * sizeof(float), false)) != NULL;
+	for (int i = 0; i < N; i++) {
+		ok = ok && (s->windows[i].frames
+			    = (float*)pool_alloc(STREAM_WINDOW * C * sizeof(float), false)) != NULL;
+	}
+
+	const char* dir = getenv("TMPDIR");
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/alo-XXXXXX", dir && *dir ? dir : "/tmp");
+	if (ok && (s->fd = mkstemp(path)) >= 0) {
+		unlink(path);
+		return s;
+	}
+	log("Could not set up disk storage in %s", dir && *dir ? dir : "/tmp");
+	close_streams(s);
+	return NULL;
+}
+
+/** Byte offset of a frame in a region of the file */
+template <int N, int C>
+static inline off_t
+stream_offset(const Streams<N, C>* s, int region, uint32_t index)
+{
+	return ((off_t)region * s->frames + index) * C * sizeof(float);
+}
+
+/**
+   Read n frames of a region into buf, interleaved.  Anything that was never
+   written is silence.
+*/
+template <int N, int C>
+static void
+stream_read(const Streams<N, C>* s, int region, uint32_t index, float* buf, uint32_t n)
+{
+	const size_t size = (size_t)n * C * sizeof(float);
+	const ssize_t got = pread(s->fd, buf, size, stream_offset(s, region, index));
+	const size_t have = got > 0 ? (size_t)got : 0;
+	memset((char*)buf + have, 0, size - have);
+}
+
+template <int N, int C>
+static void
+stream_write(const Streams<N, C>* s, int region, uint32_t index, const float* buf, uint32_t n)
+{
+	const size_t size = (size_t)n * C * sizeof(float);
+	if (pwrite(s->fd, buf, size, stream_offset(s, region, index)) != (ssize_t)size) {
+		log("Disk storage write failed");
+	}
+}
+
+/**
+   Copy loop i from the ring to its own region, up to (but not including) the
+   frame rel frames after where it was set.  This has to happen before the
+   ring is written over.
+*/
+template <int N, int C>
+static void
+freeze_stream(Streams<N, C>* s, int i, uint32_t rel)
+{
+	StreamLoop* const l = &s->loops[i];
+	float buf[STREAM_CHUNK * C];
+
+	while (l->frozen < rel) {
+		const uint32_t o = (l->at - l->start + l->frozen) % l->length;
+		uint32_t n = rel - l->frozen;
+		n = n < STREAM_CHUNK ? n : STREAM_CHUNK;
+		n = n < l->length - o ? n : l->length - o;
+		stream_read(s, 0, l->start + o, buf, n);
+		stream_write(s, i + 1, l->start + o, buf, n);
+		l->frozen += n;
+	}
+}
+
+/**
+   Write count recorded frames from the input queue to the ring at index,
+   after freezing whatever loops they would overwrite.
+*/
+template <int N, int C>
+static void
+stream_data(Streams<N, C>* s, const StreamOp* op)
+{
+	float buf[STREAM_CHUNK * C];
+
+	for (uint32_t done = 0; done < op->count;) {
+		const uint32_t tail = s->input_tail;
+		const uint32_t slot = tail % STREAM_WINDOW;
+		uint32_t n = op->count - done;
+		n = n < STREAM_CHUNK ? n : STREAM_CHUNK;
+		n = n < STREAM_WINDOW - slot ? n : STREAM_WINDOW - slot;
+		const uint32_t p = op->index + done;
+
+		for (int i = 0; i < N; i++) {
+			const StreamLoop* const l = &s->loops[i];
+			if (l->committed && p >= l->start && p + n <= l->start + l->length) {
+				const uint32_t rel = (p - l->start + l->length - (l->at - l->start))
+					% l->length;
+				freeze_stream(s, i, rel + n < l->length ? rel + n : l->length);
+			}
+		}
+
+		for (uint32_t k = 0; k < n; k++) {
+			for (int c = 0; c < C; c++) {
+				buf[C * k + c] = s->input[c * STREAM_WINDOW + slot + k];
+			}
+		}
+		// the overdub loop takes the input as it is played, the ring at the mix level
+		if (op->overdub) {
+			stream_write(s, N, p, buf, n);
+		}
+		if (op->gain != 1.0f) {
+			for (uint32_t k = 0; k < n * C; k++) {
+				buf[k] *= op->gain;
+			}
+		}
+		stream_write(s, 0, p, buf, n);
+
+		__atomic_store_n(&s->input_tail, tail + n, __ATOMIC_RELEASE);
+		done += n;
+	}
+}
+
+/**
+   Read ahead for loop i's window: from the loop's region where it has been
+   frozen, otherwise from the ring.  While the loop is still being recorded,
+   only as much as the ring has caught up with.
+*/
+template <int N, int C>
+static void
+stream_fill(Streams<N, C>* s, int i)
+{
+	StreamWindow* const w = &s->windows[i];
+	const uint32_t wanted = __atomic_load_n(&w->wanted, __ATOMIC_ACQUIRE);
+
+	if (wanted != w->served) {
+		w->start = w->seek;
+		w->loop_start = w->seek_start;
+		w->length = w->seek_length;
+		w->input = w->seek_input;
+		w->written = 0;
+		__atomic_store_n(&w->served, wanted, __ATOMIC_RELEASE);
+	}
+	if (!w->length || w->start < w->loop_start || w->start >= w->loop_start + w->length) {
+		return;
+	}
+
+	const StreamLoop* const l = &s->loops[i];
+	const bool frozen = l->committed && l->start == w->loop_start && l->length == w->length;
+	// a loop played while it's overdubbed must not be read a whole pass ahead
+	const uint32_t ahead = w->length < STREAM_WINDOW ? w->length : STREAM_WINDOW;
+	uint32_t limit = ~0u;
+	if (!frozen) {
+		const int32_t caught = (int32_t)(s->input_tail - w->input);
+		limit = caught < 0 ? 0 : (uint32_t)caught;
+	}
+
+	float buf[STREAM_CHUNK * C];
+	while (__atomic_load_n(&w->wanted, __ATOMIC_ACQUIRE) == w->served) {
+		const uint32_t written = w->written;
+		const uint32_t room = ahead - (written - __atomic_load_n(&w->read, __ATOMIC_ACQUIRE));
+		const uint32_t o = (w->start - w->loop_start + written) % w->length;
+		const uint32_t slot = written % STREAM_WINDOW;
+		uint32_t n = room < STREAM_CHUNK ? room : STREAM_CHUNK;
+		n = n < STREAM_WINDOW - slot ? n : STREAM_WINDOW - slot;
+		n = n < w->length - o ? n : w->length - o;
+		if (!frozen) {
+			n = written < limit ? (n < limit - written ? n : limit - written) : 0;
+		}
+		if (!n || room > ahead) {
+			break;
+		}
+
+		int region = 0;
+		if (frozen) {
+			const uint32_t rel = (o + l->length - (l->at - l->start)) % l->length;
+			if (rel < l->frozen) {
+				region = i + 1;
+				n = n < l->frozen - rel ? n : l->frozen - rel;
+			} else {
+				n = n < l->length - rel ? n : l->length - rel;
+			}
+		}
+
+		stream_read(s, region, w->loop_start + o, buf, n);
+		for (uint32_t k = 0; k < n; k++) {
+			for (int c = 0; c < C; c++) {
+				w->frames[c * STREAM_WINDOW + slot + k] = buf[C * k + c];
+			}
+		}
+		__atomic_store_n(&w->written, written + n, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+   The worker's share of disk storage: carry out everything run() has queued
+   since last time, in order, then top up the windows.
+*/
+template <int N, int C>
+static void
+run_streams(Streams<N, C>* s)
+{
+	const uint32_t head = __atomic_load_n(&s->ops_head, __ATOMIC_ACQUIRE);
+
+	for (uint32_t t = s->ops_tail; t != head; t++) {
+		const StreamOp* const op = &s->ops[t % STREAM_OPS];
+		switch (op->type) {
+		case STREAM_DATA:
+			stream_data(s, op);
+			break;
+		case STREAM_COMMIT: {
+			const StreamLoop l = { true, op->index, op->start, op->length, 0 };
+			s->loops[op->loop] = l;
+			break;
+		}
+		case STREAM_FORGET:
+			s->loops[op->loop].committed = false;
+			break;
+		case STREAM_WIPE:
+			for (int i = 0; i < N; i++) {
+				s->loops[i].committed = false;
+			}
+			break;
+		}
+		__atomic_store_n(&s->ops_tail, t + 1, __ATOMIC_RELEASE);
+	}
+
+	for (int i = 0; i < N; i++) {
+		stream_fill(s, i);
+	}
+}
+
+/**
+   Stretch a loop of from frames to to frames without changing its pitch, by
+   waveform similarity overlap-add (WSOLA).  Windows of the loop overlap by
+   half, each taken from within STRETCH_SEEK of where it falls in time,
+   wherever it best continues the window before.  Loops go round, so both
+   ends of the input and output wrap.
+*/
+static void
+stretch_loop(int channels, const float* in, uint32_t from,
+	     float* out, size_t out_stride, uint32_t to, double rate)
+{
+	uint32_t width = (uint32_t)(STRETCH_WINDOW * rate) & ~1u;
+	width = width < from ? width : from & ~1u;
+	const uint32_t hop = width / 2;
+	const int32_t seek = (int32_t)(STRETCH_SEEK * rate) < (int32_t)hop
+		? (int32_t)(STRETCH_SEEK * rate) : (int32_t)hop;
+	float* const window = (float*)malloc(width * sizeof(float));
+	float* const mono = (float*)malloc((from + width) * sizeof(float));
+	float* const weight = (float*)calloc(to, sizeof(float));
+
+	if (!hop || !window || !mono || !weight) {
+		// too short to be worth more than a straight resample
+		for (uint32_t k = 0; k < to; k++) {
+			const uint32_t j = (uint32_t)((uint64_t)k * from / to);
+			for (int c = 0; c < channels; c++) {
+				out[c * out_stride + k] = in[(size_t)c * from + j];
+			}
+		}
+		free(weight);
+		free(mono);
+		free(window);
+		return;
+	}
+
+	for (uint32_t k = 0; k < width; k++) {
+		window[k] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * k / width);
+	}
+	for (uint32_t k = 0; k < from + width; k++) {
+		// carried on past the end, so a window can be read straight through
+		mono[k] = 0.0f;
+		for (int c = 0; c < channels; c++) {
+			mono[k] += in[(size_t)c * from + k % from];
+		}
+	}
+
+	int64_t prev = 0;
+	for (uint32_t at = 0; at < to; at += hop) {
+		int64_t pos = 0;
+		if (at) {
+			// the best match, over every fourth frame, for what would
+			// naturally follow the last window
+			const int64_t nominal = (int64_t)((double)at * from / to);
+			const float* const follow = mono + (prev + hop) % from;
+			double best = -INFINITY;
+			for (int32_t d = -seek; d <= seek; d += 2) {
+				const int64_t c = nominal + d;
+				const float* const candidate = mono + (c + from) % from;
+				float xy = 0.0f, yy = 1e-9f;
+				for (uint32_t k = 0; k < width; k += 4) {
+					xy += follow[k] * candidate[k];
+					yy += candidate[k] * candidate[k];
+				}
+				const double score = xy / sqrt(yy);
+				if (score > best) {
+					best = score;
+					pos = c;
+				}
+			}
+		}
+		prev = (pos + from) % from;
+		for (uint32_t k = 0; k < width; k++) {
+			const uint32_t o = (at + k) % to;
+			const uint32_t j = (uint32_t)(prev + k) % from;
+			for (int c = 0; c < channels; c++) {
+				out[c * out_stride + o] += window[k] * in[(size_t)c * from + j];
+			}
+			weight[o] += window[k];
+		}
+	}
+
+	for (uint32_t k = 0; k < to; k++) {
+		if (weight[k] > 1e-3f) {
+			for (int c = 0; c < channels; c++) {
+				out[c * out_stride + k] /= weight[k];
+			}
+		}
+	}
+	free(weight);
+	free(mono);
+	free(window);
+}
+
+/**
+   Make the stretched copy of a loop's buffer asked for by a WORK_STRETCH.
+   16 bit loops are stretched as floats and stored at their old scale.
+*/
+static void*
+stretch_buffer(const StretchWork* work, int channels, double rate)
+{
+	const uint32_t frames = work->work.frames;
+	const uint32_t old_frames = work->old_frames;
+	const bool pcm = work->work.storage == STORAGE_PCM16;
+	float* const in = (float*)calloc((size_t)work->from * channels, sizeof(float));
+	float* const out = pcm ? (float*)calloc((size_t)frames * channels, sizeof(float))
+		: (float*)pool_alloc(buffer_size(frames, channels, STORAGE_FLOAT), true);
+	void* result = out;
+
+	if (!in || !out) {
+		if (pcm) {
+			free(out);
+		} else {
+			pool_free(out);
+		}
+		free(in);
+		return NULL;
+	}
+	for (int c = 0; c < channels; c++) {
+		const size_t at = (size_t)c * old_frames + work->start;
+		if (pcm) {
+			add_pcm_into(in + (size_t)c * work->from, (const int16_t*)work->work.buffer + at,
+				     work->scale, work->from);
+		} else {
+			copy_into(in + (size_t)c * work->from, (const float*)work->work.buffer + at,
+				  work->from);
+		}
+	}
+
+	stretch_loop(channels, in, work->from, out + work->start, frames, work->to, rate);
+
+	if (pcm) {
+		int16_t* const stretched = (int16_t*)pool_alloc(buffer_size(frames, channels, STORAGE_PCM16), true);
+		if (stretched) {
+			quantise_into(stretched, out, 1.0f / work->scale, frames * channels);
+		}
+		free(out);
+		result = stretched;
+	}
+	free(in);
+	return result;
+}
+
+/**
+   Destroy a plugin instance (counterpart to `instantiate()`).
+
+   This method is in the ``instantiation'' threading class, so no other
+   methods on this instance will be called concurrently with it.
+*/
+template <int N, int C>
+static void
+cleanup(LV2_Handle instance)
+{
+	log("Cleanup");
+
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+
+	for (int i = 0; i < N; i++) {
+		free_view(self, i);
+		pool_free(self->stretched[i]);
+	}
+	free(self->low_beat);
+	free(self->high_beat);
+	pool_free(self->click_bar);
+	pool_free(self->recording);
+	pool_free(self->spare);
+	if (self->streams) {
+		close_streams(self->streams);
+	}
+	if (self->trace.file) {
+		fclose(self->trace.file);
+	}
+	pthread_mutex_destroy(&self->saving);
+	pool_release();
+	free(self);
+}
+
+/** Little endian, whatever the machine is */
+static void
+put_le(uint8_t* p, uint32_t value, int bytes)
+{
+	for (int b = 0; b < bytes; b++) {
+		p[b] = (uint8_t)(value >> 8 * b);
+	}
+}
+
+/**
+   Write the header of a 32 bit float WAV file of frames frames.
+*/
+static bool
+write_wav_header(FILE* f, int channels, uint32_t rate, uint32_t frames)
+{
+	const uint32_t data = frames * channels * sizeof(float);
+	uint8_t h[58];
+
+	memcpy(h, "RIFF", 4);
+	put_le(h + 4, sizeof(h) - 8 + data, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le(h + 16, 18, 4);
+	put_le(h + 20, 3, 2);			// WAVE_FORMAT_IEEE_FLOAT
+	put_le(h + 22, channels, 2);
+	put_le(h + 24, rate, 4);
+	put_le(h + 28, rate * channels * sizeof(float), 4);
+	put_le(h + 32, channels * sizeof(float), 2);
+	put_le(h + 34, 32, 2);
+	put_le(h + 36, 0, 2);
+	memcpy(h + 38, "fact", 4);
+	put_le(h + 42, 4, 4);
+	put_le(h + 46, frames, 4);
+	memcpy(h + 50, "data", 4);
+	put_le(h + 54, data, 4);
+	return fwrite(h, 1, sizeof(h), f) == sizeof(h);
+}
+
+/**
+   Make a new file for loop i in ALO_EXPORT_DIR, or EXPORT_DIR, named for the
+   loop and the time, and never over an earlier one.
+*/
+static FILE*
+create_export(char* path, size_t size, int i)
+{
+	const char* const env = getenv("ALO_EXPORT_DIR");
+	const char* const dir = env && *env ? env : EXPORT_DIR;
+	const time_t now = time(NULL);
+	char stamp[32];
+	struct tm tm;
 
-	if (bpb && bpb->type == uris->atom_Float) {
-		if (self->bpb != ((LV2_Atom_Float*)bpb)->body) {
-			self->bpb = ((LV2_Atom_Float*)bpb)->body;
-			reset(self);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+	for (int n = 1; n < 100; n++) {
+		if (n == 1) {
+			snprintf(path, size, "%s/alo-loop%d-%s.wav", dir, i + 1, stamp);
+		} else {
+			snprintf(path, size, "%s/alo-loop%d-%s-%d.wav", dir, i + 1, stamp, n);
+		}
+		const int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd >= 0) {
+			return fdopen(fd, "wb");
+		}
+		if (errno != EEXIST) {
+			return NULL;
 		}
 	}
+	return NULL;
+}
 
-	if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) != self->loop_beats){
-		reset(self);
-	}
+/**
+   Write a loop out as a 32 bit float WAV file, from loop_start, telling run()
+   how far it has got as it goes.  A loop in memory is read from its buffer,
+   which run() leaves alone until we answer for the last time.  A loop on disk
+   is brought up to date and frozen into its region first; the disk storage
+   is only touched by the worker, so nothing else is writing to it.
+*/
+template <int N, int C>
+static void
+export_loop(Alo<N, C>* self, const ExportWork* request,
+	    LV2_Worker_Respond_Function respond, LV2_Worker_Respond_Handle handle)
+{
+	ExportWork response = *request;
+	const int i = request->work.loop;
+	const Storage storage = request->work.storage;
+	Streams<N, C>* const s = storage == STORAGE_DISK
+		? (Streams<N, C>*)request->work.buffer : NULL;
+	uint32_t start = request->start;
+	uint32_t length = request->length;
+	float buf[EXPORT_CHUNK * C];
+	char path[sizeof(self->export_path[0])];
 
-	if (bpm && bpm->type == uris->atom_Float) {
-		if (round(self->bpm) != round(((LV2_Atom_Float*)bpm)->body)) {
-			// Tempo changed, update BPM
-			self->bpm = ((LV2_Atom_Float*)bpm)->body;
-			reset(self);
+	bool ok = true;
+	if (s) {
+		run_streams(s);
+		ok = s->loops[i].committed;
+		if (ok) {
+			freeze_stream(s, i, s->loops[i].length);
+			start = s->loops[i].start;
+			length = s->loops[i].length;
 		}
 	}
+	FILE* const f = ok ? create_export(path, sizeof(path), i) : NULL;
+	ok = f && write_wav_header(f, C, (uint32_t)self->rate, length);
 
-	if ((uint32_t)floorf(self->bpb) * (uint32_t)floorf(*(self->ports.bars)) != self->loop_beats) {
-		reset(self);
+	uint32_t report = length / EXPORT_REPORTS;
+	for (uint32_t done = 0; ok && done < length;) {
+		const uint32_t n = length - done < EXPORT_CHUNK ? length - done : EXPORT_CHUNK;
+		if (s) {
+			stream_read(s, i + 1, start + done, buf, n);
+		} else {
+			for (int c = 0; c < C; c++) {
+				const size_t at = (size_t)c * request->work.frames + start + done;
+				if (storage == STORAGE_PCM16) {
+					const int16_t* const pcm = (const int16_t*)request->work.buffer + at;
+					for (uint32_t k = 0; k < n; k++) {
+						buf[k * C + c] = pcm[k] * request->scale;
+					}
+				} else {
+					const float* const data = (const float*)request->work.buffer + at;
+					for (uint32_t k = 0; k < n; k++) {
+						buf[k * C + c] = data[k];
+					}
+				}
+			}
+		}
+		ok = fwrite(buf, C * sizeof(float), n, f) == n;
+		done += n;
+		if (ok && done < length && done >= report) {
+			response.progress = (float)done / length;
+			respond(handle, sizeof(response), &response);
+			report += length / EXPORT_REPORTS;
+		}
 	}
 
-	if (speed && speed->type == uris->atom_Float) {
-		if (self->speed != ((LV2_Atom_Float*)speed)->body) {
-			// Speed changed, e.g. 0 (stop) to 1 (play)
-			// reset the loop start
-			self->speed = ((LV2_Atom_Float*)speed)->body;
-			reset(self);
-			log("Speed change: %G", self->speed);
-			log("Loop: [%d][%d]", self->loop_beats, self->loop_samples);
-		};
-	}
-	if (beat && beat->type == uris->atom_Float) {
-		// Received a beat position, synchronise
-//		const float frames_per_beat = 60.0f / self->bpm * self->rate;
-		self->current_position = ((LV2_Atom_Float*)beat)->body;
-//		const float beat_beats	    = bar_beats - floorf(bar_beats);
-		if (self->current_bb != (uint32_t)self->current_position) {
-			// we are onto the next beat
-			self->current_bb = (uint32_t)self->current_position;
-			if (self->current_lb == self->loop_beats) {
-				self->current_lb = 0;
-			}
-			log("Beat:[%d][%d] index[%d] beat[%G]\n", self->current_bb, self->current_lb, self->loop_index, self->current_position);
-			self->current_lb += 1;
+	if (f) {
+		ok = fclose(f) == 0 && ok;
+		if (!ok) {
+			unlink(path);
 		}
 	}
+	if (ok) {
+		memcpy(self->export_path[i], path, sizeof(path));
+	}
+	response.progress = ok ? 1.0f : -1.0f;
+	respond(handle, sizeof(response), &response);
 }
 
 /**
-   Adjust self->state based on button presses.
+   Do work in a non-realtime thread.  This is called by the host's worker
+   thread for each message scheduled from run().
 */
-static void
-button_logic(LV2_Handle instance, bool new_button_state, int i)
+template <int N, int C>
+static LV2_Worker_Status
+work(LV2_Handle		      instance,
+     LV2_Worker_Respond_Function respond,
+     LV2_Worker_Respond_Handle   handle,
+     uint32_t		      size,
+     const void*		      data)
 {
-	Alo* self = (Alo*)instance;
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+	const AloWork* request = (const AloWork*)data;
 
-	struct timeval te;
-	gettimeofday(&te, NULL); // get current time
-	long long milliseconds = te.tv_sec*1000LL + te.tv_usec/1000;
+	switch (request->type) {
+	case WORK_ALLOCATE: {
+		AloWork response = *request;
+		response.buffer = pool_alloc(buffer_size(request->frames, C, request->storage), true);
+		respond(handle, sizeof(response), &response);
+		break;
+	}
+	case WORK_FREE:
+		pthread_mutex_lock(&self->saving);
+		pool_free(request->buffer);
+		pthread_mutex_unlock(&self->saving);
+		break;
+	case WORK_UNMAP:
+		pthread_mutex_lock(&self->saving);
+		munmap(request->buffer, buffer_size(request->frames, C, request->storage));
+		pthread_mutex_unlock(&self->saving);
+		break;
+	case WORK_TRACE:
+		drain_trace(self);
+		respond(handle, size, data);
+		break;
+	case WORK_STREAM_OPEN: {
+		AloWork response = *request;
+		response.buffer = open_streams<N, C>(request->frames);
+		respond(handle, sizeof(response), &response);
+		break;
+	}
+	case WORK_STREAM:
+		run_streams((Streams<N, C>*)request->buffer);
+		respond(handle, size, data);
+		break;
+	case WORK_STREAM_CLOSE:
+		close_streams((Streams<N, C>*)request->buffer);
+		break;
+	case WORK_STRETCH: {
+		// the loop may have been restored over, and freed, since it was sent
+		StretchWork response = *(const StretchWork*)data;
+		pthread_mutex_lock(&self->saving);
+		response.work.buffer = response.job == __atomic_load_n(
+			&self->stretch_job[request->loop], __ATOMIC_ACQUIRE)
+			? stretch_buffer(&response, C, self->rate) : NULL;
+		pthread_mutex_unlock(&self->saving);
+		respond(handle, sizeof(response), &response);
+		break;
+	}
+	case WORK_EXPORT: {
+		// as for a stretch, the loop may have been restored over since
+		const ExportWork* const export_work = (const ExportWork*)data;
+		pthread_mutex_lock(&self->saving);
+		if (export_work->job == __atomic_load_n(&self->export_job[request->loop],
+							__ATOMIC_ACQUIRE)) {
+			export_loop(self, export_work, respond, handle);
+		}
+		pthread_mutex_unlock(&self->saving);
+		break;
+	}
+	case WORK_CLICK: {
+		AloWork response = *request;
+		response.buffer = render_click(self->high_beat, self->low_beat, self->beat_len,
+					       request->frames, request->loop);
+		respond(handle, sizeof(response), &response);
+		break;
+	}
+	}
 
-	log("[%d] Button logic", i);
-	self->button_state[i] = new_button_state;
+	return LV2_WORKER_SUCCESS;
+}
 
+/**
+   Handle a response from the worker.  This is called by the host in the
+   audio thread, so it only installs the buffer; anything that turns out to
+   be stale goes straight back to the worker.
+*/
+template <int N, int C>
+static LV2_Worker_Status
+work_response(LV2_Handle  instance,
+	      uint32_t	  size,
+	      const void* data)
+{
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+	const AloWork* response = (const AloWork*)data;
 
-	int difference = milliseconds - self->button_time[i];
-	self->button_time[i] = milliseconds;
-	if (new_button_state == true) {
-		log("[%d] Button ON", i);
-	} else {
-		log("[%d] Button OFF", i);
+	if (response->type == WORK_TRACE) {
+		self->trace.pending = false;
+		return LV2_WORKER_SUCCESS;
 	}
-
-	// Free running mode: when a button is pressed,
-	// if there is a button recording, set loop size and start based on its loop
-	if (self->loop_samples == LOOP_SIZE) {
-		for (int j = 0; j < NUM_LOOPS; j++) {
-			if (self->phrase_start[j] != 0) {
-				self->loop_samples = LOOP_SIZE + self->loop_index - self->phrase_start[j];
-				self->loop_samples = self->loop_samples % LOOP_SIZE;
-				self->loop_start = self->phrase_start[j];
+	if (response->type == WORK_STREAM) {
+		self->stream_job = false;
+		return LV2_WORKER_SUCCESS;
+	}
+	if (response->type == WORK_STRETCH) {
+		const StretchWork* const stretch = (const StretchWork*)data;
+		const int i = response->loop;
+		if (stretch->job != self->stretch_job[i] || !self->stretch_sent[i]
+		    || stretch->to != self->stretch_length) {
+			if (response->buffer) {
+				release_buffer(self, i, response->buffer);
 			}
+		} else if (!response->buffer) {
+			// no memory for it, so the tempo change wipes the loops after all
+			trace(self, TRACE_ALLOCATION_FAILED, i, 0.0f);
+			reset(self);
+		} else {
+			self->stretched[i] = response->buffer;
 		}
+		return LV2_WORKER_SUCCESS;
 	}
-
-	int on_loops = 0;
-	for (int j = 0; j < NUM_LOOPS; j++) {
-		if (self->button_state[j] == true) {
-			on_loops += 1;
+	if (response->type == WORK_EXPORT) {
+		const ExportWork* const export_work = (const ExportWork*)data;
+		const int i = response->loop;
+		if (export_work->job == self->export_job[i]) {
+			self->export_progress[i] = export_work->progress;
+			self->export_report[i] = true;
+			if (export_work->progress >= 1.0f || export_work->progress < 0.0f) {
+				self->export_pinned[i] = false;
+			}
+		}
+		return LV2_WORKER_SUCCESS;
+	}
+	if (response->type == WORK_CLICK) {
+		self->click_pending = false;
+		if (!response->buffer) {
+			trace(self, TRACE_ALLOCATION_FAILED, -1, 0.0f);
+		} else if (response->frames == self->bar_frames
+			   && (uint32_t)response->loop == self->bar_beats) {
+			if (self->click_bar) {
+				release_buffer(self, -1, self->click_bar);
+			}
+			self->click_bar = (float*)response->buffer;
+			self->click_frames = response->frames;
+			self->click_beats = response->loop;
+		} else {
+			release_buffer(self, -1, response->buffer);
+		}
+		return LV2_WORKER_SUCCESS;
+	}
+	if (response->type == WORK_STREAM_OPEN) {
+		Streams<N, C>* const streams = (Streams<N, C>*)response->buffer;
+		self->streams_pending = false;
+		if (!streams) {
+			self->streams_refused = true;
+			trace(self, TRACE_ALLOCATION_FAILED, -1, 0.0f);
+		} else if (self->storage == STORAGE_DISK && !self->streams
+			   && response->frames >= 2 * self->max_frames) {
+			self->streams = streams;
+			trace(self, TRACE_RECORDING_READY, -1, 0.0f);
+		} else {
+			AloWork work = { WORK_STREAM_CLOSE, -1, 0, STORAGE_DISK, streams };
+			self->schedule->schedule_work(self->schedule->handle, sizeof(work), &work);
 		}
+		return LV2_WORKER_SUCCESS;
+	}
+	if (response->type != WORK_ALLOCATE) {
+		return LV2_WORKER_SUCCESS;
 	}
 
-	if (on_loops == 0 && *(self->ports.reset_mode) == 1.0) {
-		// reset if all loops are off
-		reset(self);
-		log("[%d] STATE: RESET mode 0", i);
+	if (!response->buffer) {
+		// out of memory, or over the pool's budget: refuse to record rather
+		// than asking again every cycle
+		trace(self, TRACE_ALLOCATION_FAILED, response->loop, 0.0f);
+		if (response->loop == SPARE_LOOP) {
+			self->spare_pending = false;
+			self->spare_refused = true;
+		} else if (response->loop < 0) {
+			self->recording_pending = false;
+			self->recording_refused = true;
+		} else {
+			self->loop_pending[response->loop] = false;
+			self->loop_refused[response->loop] = true;
+		}
+		return LV2_WORKER_SUCCESS;
 	}
 
-	if (difference < 1000) {
-		if (*(self->ports.reset_mode) == 2.0 || on_loops == 1) {
-			reset(self);
-			log("[%d] STATE: RESET mode 2", i);
+	// the loop may have been reset to a longer one, or a different storage
+	// format, while we were waiting
+	const bool fits = response->frames >= self->loop_start + self->loop_samples;
+	if (response->loop == SPARE_LOOP) {
+		self->spare_pending = false;
+		if (fits && !self->spare && response->storage == self->storage) {
+			self->spare = response->buffer;
+			self->spare_frames = response->frames;
+			self->spare_storage = response->storage;
+			return LV2_WORKER_SUCCESS;
 		}
-		if (*(self->ports.reset_mode) == 3.0) {
-			self->state[i] = STATE_RECORDING;
-			self->phrase_start[i] = 0;
-			log("[%d] STATE: RECORDING (button reset)", i);
+	} else if (response->loop < 0) {
+		self->recording_pending = false;
+		if (fits && (!self->recording || self->recording_frames < response->frames)) {
+			if (self->recording) {
+				release_buffer(self, -1, self->recording);
+			}
+			self->recording = (float*)response->buffer;
+			self->recording_frames = response->frames;
+			trace(self, TRACE_RECORDING_READY, -1, 0.0f);
+			if (!pool_locked(response->buffer)) {
+				trace(self, TRACE_UNLOCKED, -1, 0.0f);
+			}
+			return LV2_WORKER_SUCCESS;
+		}
+	} else {
+		LoopView* const view = &self->loops[response->loop];
+		self->loop_pending[response->loop] = false;
+		if (fits && !has_buffer(view) && response->storage == self->storage) {
+			if (response->storage == STORAGE_PCM16) {
+				view->pcm = (int16_t*)response->buffer;
+			} else {
+				view->data = (float*)response->buffer;
+			}
+			view->frames = response->frames;
+			trace(self, TRACE_LOOP_READY, response->loop, 0.0f);
+			if (!pool_locked(response->buffer)) {
+				trace(self, TRACE_UNLOCKED, response->loop, 0.0f);
+			}
+			return LV2_WORKER_SUCCESS;
 		}
 	}
-	log("[%d] Button logic ends", i);
+
+	release_buffer(self, response->loop, response->buffer);
+	return LV2_WORKER_SUCCESS;
 }
 
 /**
-   ** Taken directly from metro.c **
-   Play back audio for the range [begin..end) relative to this cycle.  This is
-   called by run() in-between events to output audio up until the current time.
+   Loops are saved as raw sample files in the state directory, one per loop,
+   with its channels one after the other and laid out exactly as the loop's
+   buffer is in memory.  Frames before loop_start are never written, so take
+   no space on most filesystems.  Everything else (the loop length and start,
+   phrase starts, loop states, and the sample rate it all counts in) is saved
+   as properties.
 */
 static void
-click(Alo* self, uint32_t begin, uint32_t end)
+loop_file_name(char* name, size_t size, int i)
 {
-	float* const output_l = self->ports.output_l;
-	float* const output_r = self->ports.output_r;
+	snprintf(name, size, "loop%d.raw", i + 1);
+}
 
-	float amplitude = (uint32_t)floorf(*(self->ports.click));
+template <int N, int C>
+static LV2_URID
+loop_key(Alo<N, C>* self, int i)
+{
+	char uri[64];
+	snprintf(uri, sizeof(uri), "%s#loop%d", ALO_URI, i + 1);
+	return self->map->map(self->map->handle, uri);
+}
 
-	for (uint32_t idx = begin; idx < end; idx++) {
-		if (self->high_beat_offset < self->beat_len) {
-			output_l[idx] += 0.1 * amplitude * self->high_beat[self->high_beat_offset];
-			output_r[idx] += 0.1 * amplitude * self->high_beat[self->high_beat_offset];
-			self->high_beat_offset++;
-		}
+/**
+   Write frames [from, from + n) of one channel of the recording ring to a
+   loop file, as the freeze in run_loops() would have left them in the loop.
+*/
+template <int N, int C>
+static bool
+write_unfrozen(const Alo<N, C>* self, const LoopView* view, int fd, uint32_t frames,
+	       int channel, uint32_t from, uint32_t n)
+{
+	const float* const ring = self->recording + (size_t)channel * self->recording_frames;
+	float   data[1024];
+	int16_t pcm[1024];
 
-		if (self->low_beat_offset < self->beat_len) {
-			output_l[idx] += 0.1 * amplitude * self->low_beat[self->low_beat_offset];
-			output_r[idx] += 0.1 * amplitude * self->low_beat[self->low_beat_offset];
-			self->low_beat_offset++;
+	while (n) {
+		const uint32_t len = n < 1024 ? n : 1024;
+		const off_t at = (off_t)channel * frames + from;
+		ssize_t size;
+		if (view->pcm) {
+			quantise_into(pcm, ring + from, 1.0f / view->scale, len);
+			size = len * sizeof(int16_t);
+			if (pwrite(fd, pcm, size, at * sizeof(int16_t)) != size) {
+				return false;
+			}
+		} else {
+			copy_into(data, ring + from, len);
+			size = len * sizeof(float);
+			if (pwrite(fd, data, size, at * sizeof(float)) != size) {
+				return false;
+			}
 		}
+		from += len;
+		n -= len;
 	}
+	return true;
 }
 
-static void
-run_clicks(Alo* self, uint32_t n_samples)
+/**
+   Write loop i to a file at path.  A loop committed less than a pass ago is
+   partly still in the recording ring, so that part is taken from there.
+*/
+template <int N, int C>
+static bool
+write_loop(const Alo<N, C>* self, int i, const char* path)
 {
-	bool play_click = true;
+	const LoopView* const view = &self->loops[i];
+	const uint32_t start = self->loop_start;
+	const uint32_t length = self->loop_samples;
+	const uint32_t frames = start + length;
+	const Storage storage = view->pcm ? STORAGE_PCM16 : STORAGE_FLOAT;
+	const size_t sample = storage == STORAGE_PCM16 ? sizeof(int16_t) : sizeof(float);
+	const char* const base = view->pcm ? (const char*)view->pcm : (const char*)view->data;
 
-	const float old_beat = floorf(self->current_position);
-	self->current_position += n_samples / self->rate / 60.0f * self->bpm;
-	const float new_beat = floorf(self->current_position);
-	self->current_position = fmodf(self->current_position, self->bpb);
-	const float beat = floorf(self->current_position);
+	// Write a new file and move it into place, as the old one may be mapped
+	char temp[4096];
+	snprintf(temp, sizeof(temp), "%s.new", path);
+	const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
 
-	for (uint32_t i = 0; i < NUM_LOOPS; i++) {
-		if (self->state[i] == STATE_LOOP_ON) {
-			play_click = false;
-		}
+	bool ok = ftruncate(fd, buffer_size(frames, C, storage)) == 0;
+	for (int c = 0; ok && c < C; c++) {
+		const ssize_t size = (ssize_t)length * sample;
+		ok = pwrite(fd, base + ((size_t)c * view->frames + start) * sample, size,
+			    ((off_t)c * frames + start) * sample) == size;
 	}
 
-	if (play_click && *self->ports.click && self->speed) {
-		if (new_beat != old_beat) {
-			const uint32_t sample_offset =
-				(uint32_t)((self->current_position - beat) * self->rate);
+	// the freeze started at the phrase start, and has this far to go
+	const uint32_t unfrozen = view->unfrozen < length ? view->unfrozen : length;
+	if (unfrozen && self->recording) {
+		const uint32_t from = start + (self->phrase_start[i] - start + length - unfrozen) % length;
+		const uint32_t first = frames - from < unfrozen ? frames - from : unfrozen;
+		for (int c = 0; ok && c < C; c++) {
+			ok = write_unfrozen(self, view, fd, frames, c, from, first)
+				&& write_unfrozen(self, view, fd, frames, c, start, unfrozen - first);
+		}
+	}
 
-			click(self, 0, sample_offset);
+	ok = close(fd) == 0 && ok;
+	if (ok) {
+		ok = rename(temp, path) == 0;
+	}
+	if (!ok) {
+		unlink(temp);
+	}
+	return ok;
+}
 
-			if (beat == 0.0f) {
-				self->high_beat_offset = 0;
-			} else {
-				self->low_beat_offset = 0;
-			}
+/**
+   State values for the loops are vectors of 32 bit numbers, one per loop, or
+   count of them for the MIDI patterns.
+*/
+template <int N, int C>
+static LV2_State_Status
+store_vector(Alo<N, C>* self, LV2_State_Store_Function store, LV2_State_Handle handle,
+	     LV2_URID key, LV2_URID type, const void* elements, uint32_t count = N)
+{
+	uint8_t value[sizeof(LV2_Atom_Vector_Body)
+		      + (N > MIDI_PATTERNS ? N : MIDI_PATTERNS) * sizeof(int32_t)];
+	LV2_Atom_Vector_Body* const body = (LV2_Atom_Vector_Body*)value;
+	body->child_size = sizeof(int32_t);
+	body->child_type = type;
+	memcpy(body + 1, elements, count * sizeof(int32_t));
+	return store(handle, key, value, sizeof(*body) + count * sizeof(int32_t),
+		     self->forge.Vector, LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+}
 
-			click(self, sample_offset, n_samples);
-		}
-		else {
-			click(self, 0, n_samples);
-		}
+template <int N, int C>
+static const void*
+retrieve_vector(Alo<N, C>* self, LV2_State_Retrieve_Function retrieve,
+		LV2_State_Handle handle, LV2_URID key, LV2_URID type, uint32_t count = N)
+{
+	size_t   size;
+	uint32_t value_type;
+	uint32_t flags;
+	const LV2_Atom_Vector_Body* const body = (const LV2_Atom_Vector_Body*)
+		retrieve(handle, key, &size, &value_type, &flags);
+	if (!body || value_type != self->forge.Vector
+	    || size != sizeof(*body) + count * sizeof(int32_t)
+	    || body->child_type != type || body->child_size != sizeof(int32_t)) {
+		return NULL;
 	}
+	return body + 1;
 }
 
-static void
-run_events(Alo* self)
+static const void*
+retrieve_value(LV2_State_Retrieve_Function retrieve, LV2_State_Handle handle,
+	       LV2_URID key, LV2_URID type, size_t size)
 {
-	const LV2_Atom_Sequence* midiin = self->ports.midiin;
-
-	for (const LV2_Atom_Event* ev = lv2_atom_sequence_begin(&midiin->body);
-		!lv2_atom_sequence_is_end(&midiin->body, midiin->atom.size, ev);
+	size_t   value_size;
+	uint32_t value_type;
+	uint32_t flags;
+	const void* const value = retrieve(handle, key, &value_size, &value_type, &flags);
+	return value && value_type == type && value_size == size ? value : NULL;
+}
 
-		ev = lv2_atom_sequence_next(ev)) {
+/**
+   Save the loops.  Hosts may call this while run() is running, so the loops
+   are read as they are (an overdub in progress may be caught half way), and
+   the worker is kept from freeing any buffer until we're done with it.
+*/
+template <int N, int C>
+static LV2_State_Status
+save(LV2_Handle                instance,
+     LV2_State_Store_Function  store,
+     LV2_State_Handle          handle,
+     uint32_t                  flags,
+     const LV2_Feature* const* features)
+{
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+	const AloURIs* const uris = &self->uris;
+	const LV2_Atom_Forge* const forge = &self->forge;
+	const uint32_t pod = LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE;
 
-		if (ev->body.type == self->uris.midi_MidiEvent) {
-			const uint8_t* const msg = (const uint8_t*)(ev + 1);
-			int i = msg[1] - (uint32_t)floorf(*(self->ports.midi_base));
-			if (i >= 0 && i < NUM_LOOPS) {
-				if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_ON) {
-					button_logic(self, true, i);
-				}
-				if (lv2_midi_message_type(msg) == LV2_MIDI_MSG_NOTE_OFF) {
-					button_logic(self, false, i);
-				}
-				self->midi_control = true;
-			}
+	LV2_State_Make_Path* make_path = NULL;
+	LV2_State_Map_Path* map_path = NULL;
+	for (int i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_STATE__makePath)) {
+			make_path = (LV2_State_Make_Path*)features[i]->data;
+		} else if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+			map_path = (LV2_State_Map_Path*)features[i]->data;
 		}
 	}
+	if (!make_path) {
+		return LV2_STATE_ERR_NO_FEATURE;
+	}
 
-	if (self->midi_control == false) {
-		for (int i = 0; i < NUM_LOOPS; i++) {
-			bool new_button_state = (*self->ports.loops[i]) > 0.0f ? true : false;
-			if (new_button_state != self->button_state[i]) {
-				button_logic(self, new_button_state, i);
-			}
+	pthread_mutex_lock(&self->saving);
+
+	const double rate = self->rate;
+	const int32_t loop_beats = self->loop_beats;
+	const int32_t loop_samples = self->loop_samples;
+	const int32_t loop_start = self->loop_start;
+	const int32_t max_frames = self->max_frames;
+	const int32_t midi_control = self->midi_control;
+	int32_t loop_state[N];
+	int32_t button_state[N];
+	int32_t phrase_start[N];
+	int32_t storage[N];
+	float   scale[N];
+
+	for (int i = 0; i < N; i++) {
+		const LoopView* const view = &self->loops[i];
+		loop_state[i] = STATE_RECORDING;
+		button_state[i] = self->button_state[i];
+		phrase_start[i] = self->phrase_start[i];
+		storage[i] = view->pcm ? STORAGE_PCM16 : STORAGE_FLOAT;
+		scale[i] = view->scale;
+		if (self->state[i] == STATE_RECORDING || !has_buffer(view)
+		    || view->frames < (uint32_t)(loop_start + loop_samples)) {
+			continue;
 		}
+
+		char name[16];
+		loop_file_name(name, sizeof(name), i);
+		char* const path = make_path->path(make_path->handle, name);
+		if (path && write_loop(self, i, path)) {
+			char* const value = map_path
+				? map_path->abstract_path(map_path->handle, path)
+				: strdup(path);
+			store(handle, loop_key(self, i), value, strlen(value) + 1,
+			      forge->Path, pod);
+			loop_state[i] = self->state[i];
+			free(value);
+		}
+		free(path);
 	}
 
-	const AloURIs* uris = &self->uris;
+	pthread_mutex_unlock(&self->saving);
 
-	// from metro.c
-	// Work forwards in time frame by frame, handling events as we go
-	const LV2_Atom_Sequence* in = self->ports.control;
+	store(handle, uris->alo_rate, &rate, sizeof(rate), forge->Double, pod);
+	store(handle, uris->alo_bpm, &self->bpm, sizeof(float), forge->Float, pod);
+	store(handle, uris->alo_bpb, &self->bpb, sizeof(float), forge->Float, pod);
+	store(handle, uris->alo_speed, &self->speed, sizeof(float), forge->Float, pod);
+	store(handle, uris->alo_loopBeats, &loop_beats, sizeof(int32_t), forge->Int, pod);
+	store(handle, uris->alo_loopSamples, &loop_samples, sizeof(int32_t), forge->Int, pod);
+	store(handle, uris->alo_loopStart, &loop_start, sizeof(int32_t), forge->Int, pod);
+	store(handle, uris->alo_maxFrames, &max_frames, sizeof(int32_t), forge->Int, pod);
+	store(handle, uris->alo_midiControl, &midi_control, sizeof(int32_t), forge->Int, pod);
+	store_vector(self, store, handle, uris->alo_loopState, forge->Int, loop_state);
+	store_vector(self, store, handle, uris->alo_buttonState, forge->Int, button_state);
+	store_vector(self, store, handle, uris->alo_phraseStart, forge->Int, phrase_start);
+	store_vector(self, store, handle, uris->alo_storage, forge->Int, storage);
+	store_vector(self, store, handle, uris->alo_scale, forge->Float, scale);
+	store_vector(self, store, handle, uris->alo_patterns, forge->Int, self->patterns,
+		     MIDI_PATTERNS);
+	return LV2_STATE_SUCCESS;
+}
 
-	for (const LV2_Atom_Event* ev = lv2_atom_sequence_begin(&in->body);
-	    !lv2_atom_sequence_is_end(&in->body, in->atom.size, ev);
+static inline float
+stored_sample(const void* base, Storage storage, float scale, size_t k)
+{
+	return storage == STORAGE_PCM16 ? scale * ((const int16_t*)base)[k]
+		: ((const float*)base)[k];
+}
 
-	    ev = lv2_atom_sequence_next(ev)) {
+/**
+   Copy a loop from one buffer to another, changing its length if the sample
+   rate has changed.  The loop is cyclic, so the (Catmull-Rom) interpolation
+   wraps around its ends; at the same length it is a plain copy.  Buffers hold
+   all the channels, the given number of frames apart.
+*/
+static void
+resample_loop(int channels, const void* src, Storage src_storage, float src_scale,
+	      uint32_t src_frames, uint32_t src_start, uint32_t src_length,
+	      void* dst, Storage dst_storage, float dst_scale,
+	      uint32_t dst_frames, uint32_t dst_start, uint32_t dst_length)
+{
+	const double step = (double)src_length / dst_length;
 
-		// Check if this event is an Object
-		// (or deprecated Blank to tolerate old hosts)
-		if (ev->body.type == uris->atom_Object || ev->body.type == uris->atom_Blank) {
-			const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
-			if (obj->body.otype == uris->time_Position) {
-				// Received position information, update
-				update_position(self, obj);
+	for (int c = 0; c < channels; c++) {
+		const size_t from = (size_t)c * src_frames + src_start;
+		const size_t to = (size_t)c * dst_frames + dst_start;
+		for (uint32_t j = 0; j < dst_length; j++) {
+			const double position = j * step;
+			const uint32_t k = (uint32_t)position;
+			const float t = (float)(position - k);
+			float p[4];
+			for (uint32_t n = 0; n < 4; n++) {
+				const uint32_t at = (k + src_length + n - 1) % src_length;
+				p[n] = stored_sample(src, src_storage, src_scale, from + at);
+			}
+			const float y = p[1] + 0.5f * t * (p[2] - p[0]
+				+ t * (2.0f * p[0] - 5.0f * p[1] + 4.0f * p[2] - p[3]
+				       + t * (3.0f * (p[1] - p[2]) + p[3] - p[0])));
+			if (dst_storage == STORAGE_PCM16) {
+				const float x = fminf(fmaxf(y / dst_scale, -PCM16_MAX), PCM16_MAX);
+				((int16_t*)dst)[to + j] = (int16_t)(x + copysignf(0.5f, x));
+			} else {
+				((float*)dst)[to + j] = y;
 			}
 		}
 	}
 }
 
-static void
-run_loops(Alo* self, uint32_t n_samples)
+/**
+   Bring loop i back from its file.  When nothing needs converting, the file
+   is mapped and played from where it lies, so this takes the same time
+   however long the loop is; the pages are read ahead in the background and
+   come in as they are played.  A change of sample rate means resampling into
+   new memory, as does the overdub loop (which is written to as it plays), and
+   a host without a worker, which has its buffers already.
+*/
+template <int N, int C>
+static bool
+restore_loop(Alo<N, C>* self, int i, const char* path, Storage storage, float scale,
+	     uint32_t start, uint32_t length, uint32_t new_start, uint32_t new_length)
 {
-	const float* const input_l  = self->ports.input_l;
-	const float* const input_r  = self->ports.input_r;
-	float* const output_l = self->ports.output_l;
-	float* const output_r = self->ports.output_r;
-	float sample_l = 0.0;
-	float sample_r = 0.0;
-	float* const recording = self->recording;
-	self->threshold = dbToFloat(*self->ports.threshold);
-
-	self->loopmix = fmin(1.0, *self->ports.mix / 50);
-	self->inmix = fmin(1, (100 - *self->ports.mix) / 50);
-
-	for (uint32_t pos = 0; pos < n_samples; pos++) {
-		// recording always happens
-		sample_l = input_l[pos];
-		sample_r = input_r[pos];
-		output_l[pos] = self->inmix * input_l[pos];
-		output_r[pos] = self->inmix * input_r[pos];
-		recording[self->loop_index] = sample_l;
-		recording[self->loop_index + LOOP_SIZE] = sample_r;
-
-		for (uint32_t i = 0; i < NUM_LOOPS; i++) {
-
-			if (self->phrase_start[i] && self->phrase_start[i] == self->loop_index) {
-				if (self->button_state[i]) {
-					self->state[i] = STATE_LOOP_ON;
-					log("[%d]PHRASE: LOOP ON [%d]", i, self->loop_index);
-				} else {
-					if (self->state[i] == STATE_RECORDING) {
-						self->phrase_start[i] = 0;
-						log("[%d]PHRASE: Abandon phrase [%d]", i, self->loop_index);
-					} else {
-						self->state[i] = STATE_LOOP_OFF;
-						log("[%d]PHRASE: LOOP OFF [%d]", i, self->loop_index);
-					}
-				}
-			}
+	LoopView* const view = &self->loops[i];
+	const uint32_t frames = start + length;
+	const uint32_t new_frames = new_start + new_length;
+	const size_t size = buffer_size(frames, C, storage);
 
-            // Per-beat loops mode
-			if (self->loop_index % (self->loop_samples / self->loop_beats) == 0) {
-				if (self->pb_loops > i && self->state[i] != STATE_RECORDING) {
-					if (self->button_state[i]) {
-						self->state[i] = STATE_LOOP_ON;
-						log("[%d]BEAT: LOOP ON [%d]", i, self->loop_index);
-					} else {
-						self->state[i] = STATE_LOOP_OFF;
-						log("[%d]BEAT: LOOP OFF [%d]", i, self->loop_index);
-					}
-				}
-			}
+	const int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void* file = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size == size) {
+		// read only: a loop played from its file is never written to, and
+		// is let go before the loop is recorded again
+		file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (file == MAP_FAILED) {
+		return false;
+	}
 
-			float* const loop = self->loops[i];
-			if (self->state[i] == STATE_RECORDING && self->button_state[i]) {
-				loop[self->loop_index] = self->loopmix * sample_l;
-				loop[self->loop_index + LOOP_SIZE] = self->loopmix * sample_r;
-				if (self->phrase_start[i] == 0) {
-					if (fabs(sample_l) > self->threshold || fabs(sample_r) > self->threshold) {
-						self->phrase_start[i] = self->loop_index;
-						log("[%d]>>> DETECTED PHRASE START [%d]<<<", i, self->loop_index);
-					}
-				}
-			}
+	if (self->schedule && i != N - 1 && new_length == length) {
+		madvise(file, size, MADV_WILLNEED);
+		if (storage == STORAGE_PCM16) {
+			view->pcm = (int16_t*)file;
+		} else {
+			view->data = (float*)file;
+		}
+		view->frames = frames;
+		view->mapped = true;
+		view->scale = scale;
+		return true;
+	}
 
-			if (self->state[i] == STATE_LOOP_ON) {
-				output_l[pos] += loop[self->loop_index];
-				output_r[pos] += loop[self->loop_index + LOOP_SIZE];
-				if (i == 5) {
-					loop[self->loop_index] = sample_l;
-					loop[self->loop_index + LOOP_SIZE] = sample_r;
-				}
-			}
+	if (self->schedule) {
+		void* const buffer = pool_alloc(buffer_size(new_frames, C, storage), true);
+		if (!buffer) {
+			munmap(file, size);
+			return false;
 		}
-		self->loop_index += 1;
-		if (self->loop_index >= self->loop_start + self->loop_samples) {
-			self->loop_index = self->loop_start;
+		if (storage == STORAGE_PCM16) {
+			view->pcm = (int16_t*)buffer;
+		} else {
+			view->data = (float*)buffer;
 		}
+		view->frames = new_frames;
+		view->scale = scale;
+		resample_loop(C, file, storage, scale, frames, start, length,
+			      buffer, storage, scale, new_frames, new_start, new_length);
+	} else if (view->data && view->frames >= new_frames) {
+		// the buffers from instantiate() are float, whatever was saved
+		resample_loop(C, file, storage, scale, frames, start, length,
+			      view->data, STORAGE_FLOAT, 1.0f, view->frames, new_start, new_length);
+	} else {
+		munmap(file, size);
+		return false;
 	}
+	munmap(file, size);
+	return true;
 }
 
 /**
-   The `run()` method is the main process function of the plugin.  It processes
-   a block of audio in the audio context.  Since this plugin is
-   `lv2:hardRTCapable`, `run()` must be real-time safe, so blocking (e.g. with
-   a mutex) or memory allocation are not allowed.
+   Restore the loops saved by save().  Whatever was playing before is wiped,
+   even if nothing was saved.  If the loops were saved at a different sample
+   rate they are resampled, and everything counted in frames is scaled to
+   match.
 */
-static void
-run(LV2_Handle instance, uint32_t n_samples)
+template <int N, int C>
+static LV2_State_Status
+restore(LV2_Handle                  instance,
+	LV2_State_Retrieve_Function retrieve,
+	LV2_State_Handle            handle,
+	uint32_t                    flags,
+	const LV2_Feature* const*   features)
 {
-	Alo* self = (Alo*)instance;
+	Alo<N, C>* self = (Alo<N, C>*)instance;
+	const AloURIs* const uris = &self->uris;
+	const LV2_Atom_Forge* const forge = &self->forge;
 
-	run_loops(self, n_samples);
-	run_clicks(self, n_samples);
-	run_events(self);
+	LV2_State_Map_Path* map_path = NULL;
+	for (int i = 0; features[i]; ++i) {
+		if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+			map_path = (LV2_State_Map_Path*)features[i]->data;
+		}
+	}
 
-	if (! *(self->ports.enabled)) {
-		reset(self);
+	// The worker may be stretching or exporting a loop as we free it, so wait
+	// for it, and have it drop any stretch or export still queued.  What came
+	// back already goes too, and an export cut short is reported as failed.
+	pthread_mutex_lock(&self->saving);
+	for (int i = 0; i < N; i++) {
+		if (self->schedule) {
+			free_view(self, i);
+		}
+		pool_free(self->stretched[i]);
+		self->stretched[i] = NULL;
+		__atomic_store_n(&self->stretch_job[i], self->stretch_job[i] + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&self->export_job[i], self->export_job[i] + 1, __ATOMIC_RELEASE);
+		if (self->export_pinned[i]) {
+			self->export_pinned[i] = false;
+			self->export_progress[i] = -1.0f;
+			self->export_report[i] = true;
+		}
 	}
-}
+	pthread_mutex_unlock(&self->saving);
+	cancel_stretch(self);
 
-/**
-   The `deactivate()` method is the counterpart to `activate()`, and is called by
-   the host after running the plugin.  It indicates that the host will not call
-   `run()` again until another call to `activate()` and is mainly useful for more
-   advanced plugins with ``live'' characteristics such as those with auxiliary
-   processing threads.	As with `activate()`, this plugin has no use for this
-   information so this method does nothing.
+	for (int i = 0; i < N; i++) {
+		self->state[i] = STATE_RECORDING;
+		self->phrase_start[i] = 0;
+		self->loops[i].unfrozen = 0;
+		clear_overview(&self->overview[i]);
+	}
 
-   This method is in the ``instantiation'' threading class, so no other
-   methods on this instance will be called concurrently with it.
-*/
+	// Sessions saved before there were patterns have none
+	const uint32_t* const patterns = (const uint32_t*)retrieve_vector(
+		self, retrieve, handle, uris->alo_patterns, forge->Int, MIDI_PATTERNS);
+	if (patterns) {
+		memcpy(self->patterns, patterns, sizeof(self->patterns));
+	} else {
+		memset(self->patterns, 0, sizeof(self->patterns));
+	}
 
-static void
-deactivate(LV2_Handle instance)
-{
-	log("Deactivate");
-}
+	const double* const rate = (const double*)retrieve_value(
+		retrieve, handle, uris->alo_rate, forge->Double, sizeof(double));
+	const float* const bpm = (const float*)retrieve_value(
+		retrieve, handle, uris->alo_bpm, forge->Float, sizeof(float));
+	const float* const bpb = (const float*)retrieve_value(
+		retrieve, handle, uris->alo_bpb, forge->Float, sizeof(float));
+	const float* const speed = (const float*)retrieve_value(
+		retrieve, handle, uris->alo_speed, forge->Float, sizeof(float));
+	const int32_t* const loop_beats = (const int32_t*)retrieve_value(
+		retrieve, handle, uris->alo_loopBeats, forge->Int, sizeof(int32_t));
+	const int32_t* const loop_samples = (const int32_t*)retrieve_value(
+		retrieve, handle, uris->alo_loopSamples, forge->Int, sizeof(int32_t));
+	const int32_t* const loop_start = (const int32_t*)retrieve_value(
+		retrieve, handle, uris->alo_loopStart, forge->Int, sizeof(int32_t));
+	const int32_t* const max_frames = (const int32_t*)retrieve_value(
+		retrieve, handle, uris->alo_maxFrames, forge->Int, sizeof(int32_t));
+	const int32_t* const midi_control = (const int32_t*)retrieve_value(
+		retrieve, handle, uris->alo_midiControl, forge->Int, sizeof(int32_t));
+	const int32_t* const loop_state = (const int32_t*)retrieve_vector(
+		self, retrieve, handle, uris->alo_loopState, forge->Int);
+	const int32_t* const button_state = (const int32_t*)retrieve_vector(
+		self, retrieve, handle, uris->alo_buttonState, forge->Int);
+	const int32_t* const phrase_start = (const int32_t*)retrieve_vector(
+		self, retrieve, handle, uris->alo_phraseStart, forge->Int);
+	const int32_t* const storage = (const int32_t*)retrieve_vector(
+		self, retrieve, handle, uris->alo_storage, forge->Int);
+	const float* const scale = (const float*)retrieve_vector(
+		self, retrieve, handle, uris->alo_scale, forge->Float);
 
-/**
-   Destroy a plugin instance (counterpart to `instantiate()`).
+	if (!rate || !bpm || !bpb || !speed || !loop_beats || !loop_samples
+	    || !loop_start || !max_frames || !midi_control || !loop_state || !button_state
+	    || !phrase_start || !storage || !scale
+	    || *rate <= 0.0 || *loop_samples <= 0 || *loop_start < 0 || *max_frames <= 0) {
+		return LV2_STATE_SUCCESS;
+	}
 
-   This method is in the ``instantiation'' threading class, so no other
-   methods on this instance will be called concurrently with it.
-*/
-static void
-cleanup(LV2_Handle instance)
-{
-	log("Cleanup");
+	const double ratio = self->rate / *rate;
+	const uint32_t start = *loop_start;
+	const uint32_t length = *loop_samples;
+	const uint32_t new_start = (uint32_t)lround(start * ratio);
+	const uint32_t new_length = (uint32_t)lround(length * ratio);
+	if (*rate != self->rate) {
+		log("Restore: loops saved at %g Hz, resampling to %g Hz", *rate, self->rate);
+	}
 
-	Alo* self = (Alo*)instance;
+	if (self->schedule) {
+		pool_free(self->recording);
+		self->recording = (float*)pool_alloc(buffer_size(new_start + new_length, C, STORAGE_FLOAT), true);
+		self->recording_frames = self->recording ? new_start + new_length : 0;
+		self->max_frames = (uint32_t)lround(*max_frames * ratio);
+		set_peak_tree(&self->peak_tree, 2 * self->max_frames);
+	}
+	if (!new_length || self->recording_frames < new_start + new_length) {
+		return LV2_STATE_SUCCESS;
+	}
+
+	self->bpm = *bpm;
+	self->bpb = *bpb;
+	set_bar(self);
+	self->speed = *speed;
+	self->loop_beats = *loop_beats;
+	self->loop_samples = new_length;
+	self->loop_start = new_start;
+	self->loop_index = new_start;
+	self->midi_control = *midi_control != 0;
+
+	for (int i = 0; i < N; i++) {
+		self->button_state[i] = button_state[i] != 0;
+		if ((loop_state[i] != STATE_LOOP_ON && loop_state[i] != STATE_LOOP_OFF)
+		    || (uint32_t)phrase_start[i] < start
+		    || (uint32_t)phrase_start[i] >= start + length) {
+			continue;
+		}
 
-	for (int i = 0; i < NUM_LOOPS; i++) {
-		free(self->loops[i]);
+		size_t   size;
+		uint32_t type;
+		uint32_t value_flags;
+		const char* const value = (const char*)retrieve(
+			handle, loop_key(self, i), &size, &type, &value_flags);
+		if (!value || type != forge->Path) {
+			continue;
+		}
+		char* const path = map_path
+			? map_path->absolute_path(map_path->handle, value)
+			: strdup(value);
+		const Storage format = storage[i] == STORAGE_PCM16 ? STORAGE_PCM16 : STORAGE_FLOAT;
+		if (path && restore_loop(self, i, path, format, scale[i],
+					 start, length, new_start, new_length)) {
+			const uint32_t phrase = (uint32_t)lround((phrase_start[i] - start) * ratio);
+			self->phrase_start[i] = new_start + phrase % new_length;
+			if (self->phrase_start[i] == 0) {
+				self->phrase_start[i] = 1; // 0 would mean no phrase
+			}
+			self->state[i] = (State)loop_state[i];
+			self->loops[i].offset = new_start;
+			self->loops[i].length = new_length;
+			overview_from_view(self, i);
+		}
+		free(path);
 	}
-	free(self->low_beat);
-	free(self->high_beat);
-	free(self->recording);
-	free(self);
+	return LV2_STATE_SUCCESS;
 }
 
 /**
    The `extension_data()` function returns any extension data supported by the
    plugin.  Note that this is not an instance method, but a function on the
    plugin descriptor.  It is usually used by plugins to implement additional
-   interfaces.	This plugin does not have any extension data, so this function
-   returns NULL.
+   interfaces.	This plugin provides the worker interface, used to allocate
+   loop buffers outside the audio thread, and the state interface, which saves
+   and restores the loops.
 
    This method is in the ``discovery'' threading class, so no other functions
    or methods in this plugin library will be called concurrently with it.
 */
+template <int N, int C>
 static const void*
 extension_data(const char* uri)
 {
+	static const LV2_Worker_Interface worker = { work<N, C>, work_response<N, C>, NULL };
+	static const LV2_State_Interface state = { save<N, C>, restore<N, C> };
+	if (!strcmp(uri, LV2_WORKER__interface)) {
+		return &worker;
+	} else if (!strcmp(uri, LV2_STATE__interface)) {
+		return &state;
+	}
 	return NULL;
 }
 
@@ -836,16 +5315,29 @@ extension_data(const char* uri)
    Every plugin must define an `LV2_Descriptor`.  It is best to define
    descriptors statically to avoid leaking memory and non-portable shared
    library constructors and destructors to clean up properly.
+
+   There is one for each number of loops and channels ALO can be built with.
+   Each variant is compiled separately, so loops over the loops and channels
+   have a fixed trip count the compiler can unroll, and instances only carry
+   state and buffers for the loops and channels they have.
 */
-static const LV2_Descriptor descriptor = {
-	ALO_URI,
-	instantiate,
-	connect_port,
-	activate,
-	run,
-	deactivate,
-	cleanup,
-	extension_data
+#define ALO_VARIANT(uri, loops, channels) {		\
+	uri,						\
+	instantiate<loops, channels>,			\
+	connect_port<loops, channels>,			\
+	activate,					\
+	run<loops, channels>,				\
+	deactivate,					\
+	cleanup<loops, channels>,			\
+	extension_data<loops, channels>			\
+}
+
+static const LV2_Descriptor descriptors[] = {
+	ALO_VARIANT(ALO_URI, 6, 2),
+	ALO_VARIANT(ALO_URI "-2", 2, 2),
+	ALO_VARIANT(ALO_URI "-16", 16, 2),
+	ALO_VARIANT(ALO_URI "-mono", 6, 1),
+	ALO_VARIANT(ALO_URI "-quad", 6, 4)
 };
 
 /**
@@ -862,8 +5354,8 @@ LV2_SYMBOL_EXPORT
 const LV2_Descriptor*
 lv2_descriptor(uint32_t index)
 {
-	switch (index) {
-	case 0:	 return &descriptor;
-	default: return NULL;
+	if (index < sizeof(descriptors) / sizeof(descriptors[0])) {
+		return &descriptors[index];
 	}
+	return NULL;
 }
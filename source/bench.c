@@ -0,0 +1,1172 @@
+/*
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/**
+   alo-bench drives the plugin without a host, so we can see what run() costs
+   without deploying to a device.  It is linked against alo.c and goes in
+   through lv2_descriptor() like any host would, supplying the urid:map and
+   worker in host.h, which runs jobs between (never during) calls to run().
+
+   Each case plays synthetic audio with time:Position updates and MIDI notes
+   arming the loops, lets the loops get recorded, and then measures a stretch
+   of steady state.  Results are printed one JSON object per line.
+
+   The last cases save the loops through the state interface and restore them
+   into a new instance, at the same and at a different sample rate, and time
+   both.
+
+   The export case writes every loop to a WAV file while they play.  The midi
+   case sends a burst of MIDI messages in every block, and times each one.
+   The overview case checks that every loop is drawn on the notify port, and
+   the levels case reads the level meters and times them.
+   The capture case arms the loops with Capture on, and checks that each
+   plays the pass before it was armed at once.
+   The block_sizes case plays the same take at several block lengths, with
+   the loops armed in a gap and while a phrase plays, against a model of the
+   plugin one frame at a time (or, with the click on and in free running
+   mode, against the take played one frame at a time), and fails the bench
+   (exit status 1) if the output differs by a single bit.
+
+   Usage: alo-bench [-s seconds] [-b block_size] [-n loops] [-c channels] [-d] [-l] [-t]
+
+   With -n the 2 or 16 loop variant of the plugin is measured instead of the
+   usual 6 loops, and with -c the mono (1) or quad (4) channel one instead of
+   stereo.  With -d the loops are kept on disk rather than in memory.
+   Either way the disk is compared with memory on one case.
+
+   With -l the plugin's own load meter is switched on, and what it reports is
+   added to the results.  With -t tracing is switched on, and the trace is
+   counted but not kept.
+*/
+
+#include <dirent.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/atom/util.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/log/log.h"
+#include "lv2/lv2plug.in/ns/ext/midi/midi.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/state/state.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "host.h"
+
+#define BENCH_RATE 48000.0
+#define BENCH_BPM 120.0f
+#define BENCH_BPB 4.0f
+#define BENCH_WARMUP 8.0	// seconds for loops to be recorded before we measure
+#define ARM_AT 1.0		// seconds, in a gap between phrases
+#define ARM_PLAYING_AT 0.3	// seconds, part way into the first phrase
+#define SET_LENGTH_AT 3.7	// free running: loop length is 2 seconds
+#define ARM_REST_AT 4.0		// free running: arm the other loops
+#define BENCH_PATTERN 4.0	// seconds of synthetic input, repeated
+#define MAX_BLOCK 4096
+#define SEQ_SIZE 4096
+#define MIDI_BURST 64		// MIDI messages per block when measuring MIDI
+#define MIDI_BASE 60
+#define MAX_PROPERTIES 64
+#define OVERVIEW_POINTS 128	// points across each loop in alo:Peaks
+#define OTHER_RATE 44100.0	// restore at this rate to test resampling
+
+static uint32_t n_loops = 6;	// which variant of the plugin to run...
+static uint32_t n_channels = 2;	// ...with this many channels
+static uint32_t matrix_storage = 0; // storage port value for the run cases
+
+typedef struct {
+	uint32_t block;
+	uint32_t loops;		// number of loops armed
+	bool     free_running;
+	bool     click;
+	bool     click_out;	// send the click to its own port, and capture that
+	uint32_t storage;	// value for the storage port
+	float    retempo;	// scale the tempo by this after the warm up, or 0
+	double   rate;		// sample rate, or 0 for BENCH_RATE
+	const char* save_to;	// save state into this directory at the end
+	const char* restore_from; // restore state from this directory first
+} Case;
+
+typedef struct {
+	double   ns_per_sample;
+	double   worst_block_us;
+	double   instantiate_us;
+	long     rss_kb;
+	float    load;		// as reported by the plugin's load meter
+	float    load_peak;
+	double   save_ms;
+	double   restore_us;
+	double   worst_work_ms;	// longest the worker took between two cycles
+	float    levels[4];	// input and output peak and rms, in dB, at the end
+	float    loop_levels[2];	// and the first loop's
+} Result;
+
+/** A saved state property, kept in memory like a host's would be */
+typedef struct {
+	uint32_t key;
+	uint32_t type;
+	size_t   size;
+	void*    value;
+} Property;
+
+static Property properties[MAX_PROPERTIES];
+static uint32_t n_properties = 0;
+
+static WorkQueue queue;	// the instance being run's
+
+static float    pattern[2][(size_t)(BENCH_PATTERN * BENCH_RATE)];
+static bool     load_meter = false;
+static bool     tracing = false;
+static bool     exporting = false; // export all the loops when measuring starts
+static uint32_t midi_burst = 0;	// MIDI messages sent in each measured block
+static bool     metering = false; // the level meters are off, as in alo.ttl
+static bool     capturing = false; // Capture on, only loops in the mix, armed late
+static double   arm_at = ARM_AT;   // seconds, when the loops are armed
+static bool     watching = false; // keep what the notify port says of waveforms
+static float    drawn[MAX_LOOPS][OVERVIEW_POINTS]; // highest peak of each point
+static uint32_t overviews = 0;
+static uint32_t peak_points = 0;
+static uint64_t log_lines = 0;
+
+/**
+   Trace output is counted and thrown away: we want the cost of tracing, not
+   the cost of a terminal.
+*/
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list ap)
+{
+	char line[256];
+	log_lines++;
+	return vsnprintf(line, sizeof(line), fmt, ap);
+}
+
+static LV2_State_Status
+store_property(LV2_State_Handle handle, uint32_t key, const void* value,
+	       size_t size, uint32_t type, uint32_t flags)
+{
+	if (n_properties == MAX_PROPERTIES) {
+		return LV2_STATE_ERR_NO_SPACE;
+	}
+	Property* const p = &properties[n_properties++];
+	p->key = key;
+	p->type = type;
+	p->size = size;
+	p->value = malloc(size);
+	memcpy(p->value, value, size);
+	return LV2_STATE_SUCCESS;
+}
+
+static const void*
+retrieve_property(LV2_State_Handle handle, uint32_t key, size_t* size,
+		  uint32_t* type, uint32_t* flags)
+{
+	for (uint32_t i = 0; i < n_properties; i++) {
+		if (properties[i].key == key) {
+			*size = properties[i].size;
+			*type = properties[i].type;
+			*flags = LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE;
+			return properties[i].value;
+		}
+	}
+	return NULL;
+}
+
+static void
+clear_properties(void)
+{
+	for (uint32_t i = 0; i < n_properties; i++) {
+		free(properties[i].value);
+	}
+	n_properties = 0;
+}
+
+/** Files go in the directory given as the handle */
+static char*
+make_path(LV2_State_Make_Path_Handle handle, const char* path)
+{
+	char* const full = (char*)malloc(strlen((const char*)handle) + strlen(path) + 2);
+	sprintf(full, "%s/%s", (const char*)handle, path);
+	return full;
+}
+
+/** Paths are saved as they are */
+static char*
+map_path(LV2_State_Map_Path_Handle handle, const char* path)
+{
+	return strdup(path);
+}
+
+static long
+rss_kb(void)
+{
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (!f) {
+		return 0;
+	}
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+   Phrases of two notes with a gap between, plus a little noise, so the onset
+   detector has something to find and the loops have something to play.
+*/
+static void
+make_pattern(void)
+{
+	const uint32_t frames = (uint32_t)(BENCH_PATTERN * BENCH_RATE);
+	uint32_t seed = 1;
+
+	for (uint32_t i = 0; i < frames; i++) {
+		const double t = i / BENCH_RATE;
+		const double phase = fmod(t, 1.7);
+		const float envelope = phase < 0.9 ? (float)sin(M_PI * phase / 0.9) : 0.0f;
+		seed = seed * 1664525u + 1013904223u;
+		const float noise = ((seed >> 9) / 8388608.0f - 0.5f) * 0.0005f;
+		pattern[0][i] = noise + 0.3f * envelope * (float)sin(2 * M_PI * 220 * t);
+		pattern[1][i] = noise + 0.3f * envelope * (float)sin(2 * M_PI * 330 * t);
+	}
+}
+
+static void
+forge_midi(LV2_Atom_Forge* forge, uint32_t time, uint8_t status, uint8_t note)
+{
+	const uint8_t msg[3] = { status, note, 100 };
+	lv2_atom_forge_frame_time(forge, time);
+	lv2_atom_forge_atom(forge, sizeof(msg), map_uri(NULL, LV2_MIDI__MidiEvent));
+	lv2_atom_forge_write(forge, msg, sizeof(msg));
+}
+
+/**
+   Run one case.  If capture is given, the left output of the measured stretch
+   is copied into it.
+*/
+/**
+   Keep the alo:Peaks the plugin sent on the notify port, and count them and
+   the alo:Overview objects.
+*/
+static void
+watch_notify(const LV2_Atom_Sequence* notify)
+{
+	const LV2_URID overview = map_uri(NULL, ALO_URI "#Overview");
+	const LV2_URID peaks = map_uri(NULL, ALO_URI "#Peaks");
+
+	LV2_ATOM_SEQUENCE_FOREACH(notify, ev) {
+		const LV2_Atom_Object* obj = (const LV2_Atom_Object*)&ev->body;
+		if (obj->body.otype == overview) {
+			overviews++;
+		} else if (obj->body.otype == peaks) {
+			const LV2_Atom_Int* loop = NULL;
+			const LV2_Atom_Int* first = NULL;
+			const LV2_Atom_Vector* points = NULL;
+			lv2_atom_object_get(obj, map_uri(NULL, ALO_URI "#loop"), &loop,
+					    map_uri(NULL, ALO_URI "#first"), &first,
+					    map_uri(NULL, ALO_URI "#peaks"), &points, 0);
+			if (!loop || !first || !points) {
+				continue;
+			}
+			const float* p = (const float*)LV2_ATOM_CONTENTS_CONST(LV2_Atom_Vector, points);
+			const uint32_t n = (points->atom.size - sizeof(LV2_Atom_Vector_Body))
+				/ sizeof(float) / 2;
+			for (uint32_t k = 0; k < n && first->body + k < OVERVIEW_POINTS; k++) {
+				drawn[loop->body - 1][first->body + k] = p[2 * k + 1];
+			}
+			peak_points += n;
+		}
+	}
+}
+
+static void
+run_case(const LV2_Descriptor* descriptor, const Case* c, double seconds,
+	 float* capture, Result* result)
+{
+	static float    input[MAX_CHANNELS][MAX_BLOCK];
+	static float    output[MAX_CHANNELS][MAX_BLOCK];
+	static float    click_out[MAX_BLOCK];
+	static uint64_t control_buf[SEQ_SIZE / 8];
+	static uint64_t midi_buf[SEQ_SIZE / 8];
+	static uint64_t notify_buf[SEQ_SIZE / 8];
+	float           controls[NUM_PORTS];
+	float           switches[MAX_LOOPS] = { 0 };	// loops are played by MIDI
+	float           levels[2 * MAX_LOOPS];	// each loop's peak and rms
+
+	LV2_URID_Map        map      = { NULL, map_uri };
+	LV2_Worker_Schedule schedule = { &queue, schedule_work };
+	LV2_Log_Log         logger   = { NULL, log_printf, log_vprintf };
+	const LV2_Feature   map_feature      = { LV2_URID__map, &map };
+	const LV2_Feature   schedule_feature = { LV2_WORKER__schedule, &schedule };
+	const LV2_Feature   log_feature      = { LV2_LOG__log, &logger };
+	const int32_t       block = (int32_t)c->block;
+	const LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__nominalBlockLength),
+		  sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &block },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	const LV2_Feature   options_feature  = { LV2_OPTIONS__options, (void*)options };
+	const LV2_Feature   fixed_feature    = { LV2_BUF_SIZE__fixedBlockLength, NULL };
+	const LV2_Feature*  features[]       = {
+		&map_feature, &schedule_feature, &log_feature, &fixed_feature,
+		&options_feature, NULL
+	};
+
+	const double rate = c->rate ? c->rate : BENCH_RATE;
+	const double t0 = now_ns();
+	LV2_Handle handle = descriptor->instantiate(descriptor, rate, ".", features);
+	result->instantiate_us = (now_ns() - t0) / 1e3;
+	if (!handle) {
+		fprintf(stderr, "Failed to instantiate plugin\n");
+		exit(1);
+	}
+	const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)
+		descriptor->extension_data(LV2_WORKER__interface);
+	const LV2_State_Interface* state = (const LV2_State_Interface*)
+		descriptor->extension_data(LV2_STATE__interface);
+	LV2_State_Map_Path  path_map  = { NULL, map_path, map_path };
+	LV2_State_Make_Path path_make = { (void*)(c->save_to ? c->save_to : c->restore_from),
+					  make_path };
+	const LV2_Feature   map_path_feature  = { LV2_STATE__mapPath, &path_map };
+	const LV2_Feature   make_path_feature = { LV2_STATE__makePath, &path_make };
+	const LV2_Feature*  state_features[]  = {
+		&map_path_feature, &make_path_feature, NULL
+	};
+
+	memset(controls, 0, sizeof(controls));
+	controls[PORT_THRESHOLD] = -40;
+	controls[PORT_MIDI_BASE] = MIDI_BASE;
+	controls[PORT_CLICK] = c->click ? 5 : 0;
+	controls[PORT_BARS] = 1;
+	controls[PORT_MIX] = 50;
+	controls[PORT_RESET_MODE] = 3;
+	controls[PORT_ENABLED] = 1;
+	controls[PORT_MAX_LOOP] = 60;
+	controls[PORT_STORAGE] = c->storage;
+	controls[PORT_LOAD_METER] = load_meter ? 1 : 0;
+	controls[PORT_TRACE] = tracing ? 1 : 0;
+	controls[PORT_METERS] = metering ? 1 : 0;
+	controls[PORT_CAPTURE] = capturing ? 1 : 0;
+	if (capturing) {
+		controls[PORT_MIX] = 100;
+	}
+	controls[PORT_CLICK_ROUTE] = c->click_out ? 1 : 0;
+
+	for (uint32_t ch = 0; ch < n_channels; ch++) {
+		descriptor->connect_port(handle, ch, input[ch]);
+		descriptor->connect_port(handle, n_channels + ch, output[ch]);
+	}
+	connect_controls(descriptor, handle, n_loops, n_channels, switches, controls,
+			 levels, midi_buf, control_buf, notify_buf, click_out);
+	descriptor->activate(handle);
+
+	result->restore_us = 0.0;
+	if (c->restore_from) {
+		const double start = now_ns();
+		state->restore(handle, retrieve_property, NULL, 0, state_features);
+		result->restore_us = (now_ns() - start) / 1e3;
+	}
+
+	LV2_Atom_Forge forge;
+	lv2_atom_forge_init(&forge, &map);
+
+	const uint32_t pattern_frames = (uint32_t)(BENCH_PATTERN * BENCH_RATE);
+	const uint64_t warmup = (uint64_t)(BENCH_WARMUP * BENCH_RATE);
+	const uint64_t total = warmup + (uint64_t)(seconds * BENCH_RATE);
+	// loops to be captured are armed once the warm up has played them a pass
+	const uint64_t arm = capturing ? warmup : (uint64_t)(arm_at * BENCH_RATE);
+	const uint64_t set_length = (uint64_t)(SET_LENGTH_AT * BENCH_RATE);
+	const uint64_t arm_rest = (uint64_t)(ARM_REST_AT * BENCH_RATE);
+	const float speed = c->free_running ? 0.0f : 1.0f;
+	double beat = 0.0;
+	double elapsed = 0.0;
+	double worst = 0.0;
+	double worst_work = 0.0;
+	uint64_t measured = 0;
+	float bpm = BENCH_BPM;
+
+	for (uint64_t frame = 0; frame < total; frame += c->block) {
+		for (uint32_t i = 0; i < c->block; i++) {
+			const uint32_t p = (uint32_t)((frame + i) % pattern_frames);
+			for (uint32_t ch = 0; ch < n_channels; ch++) {
+				input[ch][i] = pattern[ch % 2][p];
+			}
+		}
+
+		LV2_Atom_Forge_Frame seq_frame;
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)control_buf, sizeof(control_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		if (c->retempo && frame == warmup) {
+			bpm *= c->retempo;
+		}
+		if (exporting && frame <= warmup && warmup < frame + c->block) {
+			controls[PORT_EXPORT] = (float)(n_loops + 1);
+		}
+		if (!c->free_running || frame == 0) {
+			forge_position(&forge, 0, beat, bpm * speed, BENCH_BPB, speed);
+		}
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		// Arm the loops, each note on its own frame.  Free running loops get
+		// their length from releasing another button, and the rest are armed
+		// after that so they don't start on the wrap.
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_buf, sizeof(midi_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		if (c->loops && frame <= arm && arm < frame + c->block) {
+			const uint32_t now = c->free_running ? 1 : c->loops;
+			for (uint32_t i = 0; i < now; i++) {
+				forge_midi(&forge, arm - frame, LV2_MIDI_MSG_NOTE_ON, MIDI_BASE + i);
+			}
+		}
+		if (midi_burst && frame >= warmup) {
+			// controllers, programs with no pattern and notes off the
+			// loops, so the loops play on as they were
+			static const uint8_t kinds[3][2] = {
+				{ LV2_MIDI_MSG_CONTROLLER, 20 },
+				{ LV2_MIDI_MSG_PGM_CHANGE, 127 },
+				{ LV2_MIDI_MSG_NOTE_ON, 0 },
+			};
+			for (uint32_t k = 0; k < midi_burst; k++) {
+				forge_midi(&forge, k * c->block / midi_burst, kinds[k % 3][0],
+					   kinds[k % 3][1]);
+			}
+		}
+		if (c->free_running && c->loops) {
+			if (frame <= set_length && set_length < frame + c->block) {
+				forge_midi(&forge, set_length - frame, LV2_MIDI_MSG_NOTE_OFF,
+					   MIDI_BASE + 1);
+			}
+			if (frame <= arm_rest && arm_rest < frame + c->block) {
+				for (uint32_t i = 1; i < c->loops; i++) {
+					forge_midi(&forge, arm_rest - frame, LV2_MIDI_MSG_NOTE_ON,
+						   MIDI_BASE + i);
+				}
+			}
+		}
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		LV2_Atom* const notify = (LV2_Atom*)notify_buf;
+		notify->size = sizeof(notify_buf) - sizeof(LV2_Atom);
+		notify->type = 0;
+
+		const double start = now_ns();
+		descriptor->run(handle, c->block);
+		const double took = now_ns() - start;
+
+		if (frame >= warmup) {
+			if (capture) {
+				memcpy(capture + (frame - warmup), c->click_out ? click_out : output[0],
+				       c->block * sizeof(float));
+			}
+			elapsed += took;
+			measured += c->block;
+			if (took > worst) {
+				worst = took;
+			}
+		}
+		if (watching) {
+			watch_notify((const LV2_Atom_Sequence*)notify_buf);
+		}
+		if (worker) {
+			const double work_start = now_ns();
+			run_worker(worker, handle, &queue);
+			worst_work = fmax(worst_work, now_ns() - work_start);
+		}
+		beat += c->block / BENCH_RATE * bpm / 60.0;
+	}
+
+	result->rss_kb = rss_kb();
+	result->ns_per_sample = measured ? elapsed / measured : 0.0;
+	result->worst_block_us = worst / 1e3;
+	result->worst_work_ms = worst_work / 1e6;
+	result->load = controls[PORT_LOAD];
+	result->load_peak = controls[PORT_LOAD_PEAK];
+	for (uint32_t k = 0; k < 4; k++) {
+		result->levels[k] = controls[PORT_INPUT_PEAK + k];
+	}
+	result->loop_levels[0] = levels[0];
+	result->loop_levels[1] = levels[1];
+
+	result->save_ms = 0.0;
+	if (c->save_to) {
+		clear_properties();
+		const double start = now_ns();
+		state->save(handle, store_property, NULL, 0, state_features);
+		result->save_ms = (now_ns() - start) / 1e6;
+	}
+
+	descriptor->deactivate(handle);
+	descriptor->cleanup(handle);
+}
+
+static void
+print_result(const Case* c, const Result* r)
+{
+	printf("{\"case\":\"run\",\"variant\":%u,\"channels\":%u,\"block\":%u,\"loops\":%u,"
+	       "\"mode\":\"%s\",\"click\":%s,\"storage\":%u,\"ns_per_sample\":%.3f,"
+	       "\"worst_block_us\":%.2f,\"instantiate_us\":%.1f,\"rss_kb\":%ld",
+	       n_loops, n_channels, c->block, c->loops, c->free_running ? "free" : "sync",
+	       c->click ? "true" : "false", c->storage, r->ns_per_sample, r->worst_block_us,
+	       r->instantiate_us, r->rss_kb);
+	if (load_meter) {
+		printf(",\"load_pct\":%.2f,\"load_peak_pct\":%.2f",
+		       r->load, r->load_peak);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/**
+   Compare 16 bit or disk loop storage with float, playing all the loops.
+*/
+static void
+measure_snr(const LV2_Descriptor* descriptor, double seconds, uint32_t storage,
+	    const char* name)
+{
+	const uint32_t block = 256;
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + block;
+	float* reference = (float*)calloc(frames, sizeof(float));
+	float* compact = (float*)calloc(frames, sizeof(float));
+	Case c = { block, n_loops, false, false, false, 0, 0.0f, 0.0, NULL, NULL };
+	Result r;
+
+	run_case(descriptor, &c, seconds, reference, &r);
+	c.storage = storage;
+	run_case(descriptor, &c, seconds, compact, &r);
+
+	double signal = 0.0, noise = 0.0;
+	for (size_t i = 0; i < frames; i++) {
+		const double d = (double)reference[i] - compact[i];
+		signal += (double)reference[i] * reference[i];
+		noise += d * d;
+	}
+	printf("{\"case\":\"snr\",\"variant\":%u,\"storage\":\"%s\",\"loops\":%u,"
+	       "\"snr_db\":%.2f}\n", n_loops, name, n_loops, noise > 0.0 ? 10.0 * log10(signal / noise) : INFINITY);
+
+	free(compact);
+	free(reference);
+}
+
+/**
+   Check the click lands on the beat: route it to its own output with no loops
+   playing, and see how far each click starts from where the transport says
+   its beat is.
+*/
+static void
+measure_click(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + block;
+	float* click = (float*)calloc(frames, sizeof(float));
+	Case c = { block, 0, false, true, true, 0, 0.0f, 0.0, NULL, NULL };
+	Result r;
+
+	run_case(descriptor, &c, seconds, click, &r);
+
+	// measuring starts on a beat, as the warm up is a whole number of them
+	const double beat_frames = 60.0 / BENCH_BPM * BENCH_RATE;
+	uint32_t clicks = 0;
+	double worst = 0.0;
+	for (size_t k = 0; k < frames; k++) {
+		if (click[k] != 0.0f && (k == 0 || click[k - 1] == 0.0f)) {
+			const double beat = k / beat_frames;
+			const double off = (beat - floor(beat + 0.5)) * beat_frames;
+			worst = fmax(worst, fabs(off));
+			clicks++;
+			k += (size_t)(beat_frames / 2);
+		}
+	}
+	printf("{\"case\":\"click\",\"variant\":%u,\"clicks\":%u,\"worst_offset_frames\":%.1f,"
+	       "\"ns_per_sample\":%.3f}\n", n_loops, clicks, worst, r.ns_per_sample);
+
+	free(click);
+}
+
+/**
+   Change the tempo with all the loops playing, and see whether they survive
+   it: the level the loops add over no loops at all, in the second half of
+   the run, against the same with the tempo left alone.
+*/
+static void
+measure_stretch(const LV2_Descriptor* descriptor, double seconds, float retempo)
+{
+	const uint32_t block = 256;
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + block;
+	float* dry = (float*)calloc(frames, sizeof(float));
+	float* wet = (float*)calloc(frames, sizeof(float));
+	double level[2];
+	Result r;
+
+	for (int changed = 0; changed < 2; changed++) {
+		Case c = { block, 0, false, false, false, 0, 0.0f, 0.0, NULL, NULL };
+		c.retempo = changed ? retempo : 0.0f;
+		run_case(descriptor, &c, seconds, dry, &r);
+		c.loops = n_loops;
+		run_case(descriptor, &c, seconds, wet, &r);
+
+		level[changed] = 0.0;
+		for (size_t k = frames / 2; k < frames; k++) {
+			const double d = (double)wet[k] - dry[k];
+			level[changed] += d * d;
+		}
+	}
+	printf("{\"case\":\"stretch\",\"variant\":%u,\"loops\":%u,\"tempo\":%.2f,"
+	       "\"kept_db\":%.2f,\"worst_work_ms\":%.2f,\"worst_block_us\":%.2f}\n",
+	       n_loops, n_loops, retempo, 10.0 * log10(level[1] / level[0]),
+	       r.worst_work_ms, r.worst_block_us);
+
+	free(wet);
+	free(dry);
+}
+
+/**
+   Give the shared loop pool room for the recording and only half the loops,
+   then arm them all.  The rest should be refused, not crash: the level the
+   loops add over no loops at all should drop by about half, against the same
+   with no budget.
+*/
+static void
+measure_pool(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + block;
+	float* dry = (float*)calloc(frames, sizeof(float));
+	float* wet = (float*)calloc(frames, sizeof(float));
+	// the pool leases whole megabytes, for a loop of one bar at BENCH_BPM
+	const double loop_bytes = BENCH_BPB * 60.0 / BENCH_BPM * BENCH_RATE
+		* n_channels * sizeof(float);
+	const uint32_t budget_mb = (uint32_t)ceil((loop_bytes + 64) / (1 << 20)) * (1 + n_loops / 2);
+	double level[2];
+	Result r;
+
+	Case c = { block, 0, false, false, false, 0, 0.0f, 0.0, NULL, NULL };
+	run_case(descriptor, &c, seconds, dry, &r);
+	c.loops = n_loops;
+	for (int limited = 0; limited < 2; limited++) {
+		char mb[16];
+		snprintf(mb, sizeof(mb), "%u", budget_mb);
+		if (limited) {
+			setenv("ALO_POOL_MB", mb, 1);
+		}
+		run_case(descriptor, &c, seconds, wet, &r);
+		unsetenv("ALO_POOL_MB");
+
+		level[limited] = 0.0;
+		for (size_t k = 0; k < frames; k++) {
+			const double d = (double)wet[k] - dry[k];
+			level[limited] += d * d;
+		}
+	}
+	printf("{\"case\":\"pool\",\"variant\":%u,\"loops\":%u,\"pool_mb\":%u,"
+	       "\"kept_db\":%.2f,\"ns_per_sample\":%.3f}\n", n_loops, n_loops, budget_mb,
+	       10.0 * log10(level[1] / level[0]), r.ns_per_sample);
+
+	free(wet);
+	free(dry);
+}
+
+/**
+   Size of the files in a directory, and delete them if asked.
+*/
+static long
+directory_kb(const char* dir, bool remove)
+{
+	long blocks = 0;
+	DIR* d = opendir(dir);
+	if (!d) {
+		return 0;
+	}
+	for (struct dirent* e = readdir(d); e; e = readdir(d)) {
+		char path[4096];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (e->d_name[0] != '.' && stat(path, &st) == 0) {
+			blocks += st.st_blocks;
+			if (remove) {
+				unlink(path);
+			}
+		}
+	}
+	closedir(d);
+	return blocks / 2;
+}
+
+/**
+   Export all the loops while they play and record, and see that it doesn't
+   show in the worst block: against the same case without the export, and
+   with every loop written to a file of the right size.
+*/
+static void
+measure_export(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	const long loop_bytes = (long)(BENCH_BPB * 60.0 / BENCH_BPM * BENCH_RATE)
+		* n_channels * sizeof(float);
+	char dir[] = "/tmp/alo-bench-XXXXXX";
+	Result plain, r;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Can't make an export directory\n");
+		exit(1);
+	}
+	setenv("ALO_EXPORT_DIR", dir, 1);
+
+	Case c = { block, n_loops, false, false, false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+	run_case(descriptor, &c, seconds, NULL, &plain);
+	exporting = true;
+	run_case(descriptor, &c, seconds, NULL, &r);
+	exporting = false;
+	unsetenv("ALO_EXPORT_DIR");
+
+	uint32_t files = 0, right = 0;
+	DIR* d = opendir(dir);
+	for (struct dirent* e = d ? readdir(d) : NULL; e; e = readdir(d)) {
+		char path[4096];
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (e->d_name[0] != '.' && stat(path, &st) == 0) {
+			files++;
+			right += st.st_size == 58 + loop_bytes;	// float WAV header, then the loop
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+	printf("{\"case\":\"export\",\"variant\":%u,\"loops\":%u,\"storage\":%u,"
+	       "\"files\":%u,\"right_size\":%u,\"worst_block_us\":%.2f,"
+	       "\"plain_worst_block_us\":%.2f,\"worst_work_ms\":%.2f}\n", n_loops, n_loops,
+	       matrix_storage, files, right, r.worst_block_us, plain.worst_block_us,
+	       r.worst_work_ms);
+
+	directory_kb(dir, true);
+	rmdir(dir);
+}
+
+/**
+   Send a burst of MIDI messages in every block with all the loops playing,
+   and see what each one costs over the same case without them.  Each
+   message also cuts the cycle short, as it would in a host.
+*/
+static void
+measure_midi(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	Case c = { block, n_loops, false, false, false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+	Result plain, r;
+
+	run_case(descriptor, &c, seconds, NULL, &plain);
+	midi_burst = MIDI_BURST;
+	run_case(descriptor, &c, seconds, NULL, &r);
+	midi_burst = 0;
+
+	printf("{\"case\":\"midi\",\"variant\":%u,\"loops\":%u,\"events_per_block\":%u,"
+	       "\"ns_per_event\":%.1f,\"worst_block_us\":%.2f,"
+	       "\"plain_worst_block_us\":%.2f}\n", n_loops, n_loops, MIDI_BURST,
+	       (r.ns_per_sample - plain.ns_per_sample) * block / MIDI_BURST,
+	       r.worst_block_us, plain.worst_block_us);
+}
+
+/**
+   What the plugin played before it was split into segments, one frame at a
+   time, for a take of the block_sizes case in sync mode with the click off:
+   each armed loop records the input at the mix level, its phrase starts at
+   the first frame over the threshold, it plays from when that comes round
+   again, and the last loop is replaced by what is played over it.  Notes
+   take effect on their own frame.  The left output of the measured stretch
+   goes into out.
+*/
+static void
+reference_take(double seconds, uint32_t loops, float* out)
+{
+	const uint32_t length = (uint32_t)(BENCH_BPB * BENCH_RATE * 60.0f / BENCH_BPM);
+	const uint32_t pattern_frames = (uint32_t)(BENCH_PATTERN * BENCH_RATE);
+	const uint64_t warmup = (uint64_t)(BENCH_WARMUP * BENCH_RATE);
+	const uint64_t total = warmup + (uint64_t)(seconds * BENCH_RATE);
+	const uint64_t arm = (uint64_t)(arm_at * BENCH_RATE);
+	const float threshold = powf(10.0f, -40 * 0.05f);
+	const float loopmix = (float)fmin(1.0, 50.0f / 50);
+	const float inmix = (float)fmin(1, (100 - 50.0f) / 50);
+	float* const data = (float*)calloc((size_t)n_loops * n_channels * length, sizeof(float));
+	uint32_t phrase_start[MAX_LOOPS] = { 0 };
+	bool on[MAX_LOOPS] = { false };
+
+	if (!data) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (uint64_t frame = 0; frame < total; frame++) {
+		const uint32_t index = (uint32_t)(frame % length);
+		const uint32_t p = (uint32_t)(frame % pattern_frames);
+		float sum = inmix * pattern[0][p];
+		for (uint32_t i = 0; i < loops && frame >= arm; i++) {
+			float* const loop = data + (size_t)i * n_channels * length;
+			if (phrase_start[i] && phrase_start[i] == index) {
+				on[i] = true;
+			}
+			if (!on[i]) {
+				bool loud = false;
+				for (uint32_t ch = 0; ch < n_channels; ch++) {
+					loop[ch * length + index] = loopmix * pattern[ch % 2][p];
+					loud = loud || fabsf(pattern[ch % 2][p]) > threshold;
+				}
+				if (!phrase_start[i] && loud) {
+					phrase_start[i] = index;
+				}
+			} else {
+				sum += loop[index];
+				for (uint32_t ch = 0; i == n_loops - 1 && ch < n_channels; ch++) {
+					loop[ch * length + index] = pattern[ch % 2][p];
+				}
+			}
+		}
+		if (frame >= warmup) {
+			out[frame - warmup] = sum;
+		}
+	}
+	free(data);
+}
+
+/**
+   Play the same take at block lengths that do and don't have kernels of
+   their own, and see that the output is the same to the bit as it should
+   be.  In sync mode with the click off, that is reference_take(), with the
+   loops armed in a gap and while a phrase is playing.  With the click on,
+   and in free running mode, there is nothing to hold it against but the
+   same take one frame at a time.  Any difference fails the bench: the frame
+   it starts at, and the largest, are printed.
+*/
+static bool
+measure_block_sizes(const LV2_Descriptor* descriptor, double seconds)
+{
+	// each divides the warm up, so measuring starts on the same frame
+	static const uint32_t blocks[] = { 1, 64, 256, 1000, 3000 };
+	static const struct {
+		bool   free_running;
+		bool   click;
+		double arm_at;
+	} takes[] = {
+		{ false, false, ARM_AT },
+		{ false, false, ARM_PLAYING_AT },
+		{ false, true,  ARM_AT },
+		{ true,  true,  ARM_AT },
+	};
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + MAX_BLOCK;
+	float* const reference = (float*)calloc(frames, sizeof(float));
+	float* const out = (float*)calloc(frames, sizeof(float));
+	bool same = true;
+
+	if (!reference || !out) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (size_t t = 0; t < sizeof(takes) / sizeof(takes[0]); t++) {
+		Case c = { 1, n_loops, takes[t].free_running, takes[t].click, false,
+			   matrix_storage, 0.0f, 0.0, NULL, NULL };
+		const bool modelled = !c.free_running && !c.click;
+		Result r;
+		arm_at = takes[t].arm_at;
+		if (modelled) {
+			reference_take(seconds, c.loops, reference);
+		} else {
+			run_case(descriptor, &c, seconds, reference, &r);
+		}
+		for (size_t b = modelled ? 0 : 1; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+			c.block = blocks[b];
+			memset(out, 0, frames * sizeof(float));
+			run_case(descriptor, &c, seconds, out, &r);
+
+			const size_t measured = (size_t)(seconds * BENCH_RATE);
+			size_t first = measured;
+			float worst = 0.0f;
+			for (size_t k = 0; k < measured; k++) {
+				if (out[k] != reference[k]) {
+					first = first < k ? first : k;
+					worst = fmaxf(worst, fabsf(out[k] - reference[k]));
+				}
+			}
+			same = same && first == measured;
+			printf("{\"case\":\"block_sizes\",\"variant\":%u,\"loops\":%u,"
+			       "\"mode\":\"%s\",\"click\":%s,\"armed_at\":%g,\"against\":\"%s\","
+			       "\"storage\":%u,\"block\":%u,\"identical\":%s,"
+			       "\"first_diff_frame\":%lld,\"max_diff\":%g}\n", n_loops, n_loops,
+			       c.free_running ? "free" : "sync", c.click ? "true" : "false",
+			       arm_at, modelled ? "reference" : "block 1", matrix_storage,
+			       blocks[b], first == measured ? "true" : "false",
+			       first == measured ? -1LL : (long long)first, worst);
+			fflush(stdout);
+		}
+	}
+	arm_at = ARM_AT;
+	free(out);
+	free(reference);
+	return same;
+}
+
+/**
+   Play all the loops, and read the level meters at the end.  The input and
+   each loop are the synthetic pattern at 0.3 of full scale.  What the meters
+   cost is against the same case with them switched off.
+*/
+static void
+measure_levels(const LV2_Descriptor* descriptor, double seconds)
+{
+	Case c = { 256, n_loops, false, false, false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+	Result plain, r;
+
+	run_case(descriptor, &c, seconds, NULL, &plain);
+	metering = true;
+	run_case(descriptor, &c, seconds, NULL, &r);
+	metering = false;
+	printf("{\"case\":\"levels\",\"variant\":%u,\"loops\":%u,\"input_peak_db\":%.1f,"
+	       "\"input_rms_db\":%.1f,\"output_peak_db\":%.1f,\"output_rms_db\":%.1f,"
+	       "\"loop1_peak_db\":%.1f,\"loop1_rms_db\":%.1f,\"ns_per_sample\":%.3f,"
+	       "\"plain_ns_per_sample\":%.3f}\n", n_loops, n_loops, r.levels[0], r.levels[1],
+	       r.levels[2], r.levels[3], r.loop_levels[0], r.loop_levels[1], r.ns_per_sample,
+	       plain.ns_per_sample);
+}
+
+/**
+   Arm all the loops with Capture on when measuring starts, long after the
+   pattern has been playing, and see that they play what was played a loop
+   before straight away.  With only the loops in the mix, that is the first
+   frame any loop is heard, the frame from which they all are (each capture
+   after the first waits for the worker to bring a spare buffer), and the
+   worst difference from the input a loop earlier after that.  What it costs
+   is against the same loops recorded as usual.
+*/
+static void
+measure_capture(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	const uint32_t loop_frames = (uint32_t)(BENCH_BPB * 60.0 / BENCH_BPM * BENCH_RATE);
+	const uint32_t pattern_frames = (uint32_t)(BENCH_PATTERN * BENCH_RATE);
+	const uint64_t warmup = (uint64_t)(BENCH_WARMUP * BENCH_RATE);
+	const size_t frames = (size_t)(seconds * BENCH_RATE);
+	float* const out = (float*)calloc(frames + MAX_BLOCK, sizeof(float));
+	Case c = { block, n_loops, false, false, false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+	Result plain, r;
+
+	if (!out) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	run_case(descriptor, &c, seconds, NULL, &plain);
+	capturing = true;
+	run_case(descriptor, &c, seconds, out, &r);
+	capturing = false;
+
+	size_t first = frames, all = 0;
+	for (size_t k = 0; k < frames; k++) {
+		const float played = pattern[0][(warmup + k - loop_frames) % pattern_frames];
+		if (first == frames && out[k] != 0.0f) {
+			first = k;
+		}
+		if (fabsf(out[k] - n_loops * played) > 1e-3f) {
+			all = k + 1;
+		}
+	}
+	float worst = 0.0f;
+	for (size_t k = all; k < frames; k++) {
+		const float played = pattern[0][(warmup + k - loop_frames) % pattern_frames];
+		worst = fmaxf(worst, fabsf(out[k] - n_loops * played));
+	}
+	printf("{\"case\":\"capture\",\"variant\":%u,\"loops\":%u,\"storage\":%u,"
+	       "\"first_frame\":%zu,\"all_frame\":%zu,\"max_error\":%.6f,"
+	       "\"ns_per_sample\":%.3f,\"plain_ns_per_sample\":%.3f}\n", n_loops, n_loops,
+	       matrix_storage, first, all, worst, r.ns_per_sample, plain.ns_per_sample);
+	free(out);
+}
+
+/**
+   Record all the loops, and see that each of them is drawn on the notify
+   port: how many of its points have a peak, for the loop with fewest.
+*/
+static void
+measure_overview(const LV2_Descriptor* descriptor, double seconds)
+{
+	Case c = { 256, n_loops, false, false, false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+	Result r;
+
+	memset(drawn, 0, sizeof(drawn));
+	overviews = peak_points = 0;
+	watching = true;
+	run_case(descriptor, &c, seconds, NULL, &r);
+	watching = false;
+
+	// the pattern is silent between phrases, so not every point has a peak
+	uint32_t least = OVERVIEW_POINTS;
+	for (uint32_t i = 0; i < n_loops; i++) {
+		uint32_t points = 0;
+		for (uint32_t p = 0; p < OVERVIEW_POINTS; p++) {
+			points += drawn[i][p] > 0.0f;
+		}
+		least = points < least ? points : least;
+	}
+	printf("{\"case\":\"overview\",\"variant\":%u,\"loops\":%u,\"overviews\":%u,"
+	       "\"peak_points\":%u,\"least_points_drawn\":%u}\n", n_loops, n_loops,
+	       overviews, peak_points, least);
+}
+
+/**
+   Save all the loops, then restore them into a new instance with no loops
+   armed, at the same and at a different rate.  The level of the restored
+   loops is what the new instance plays over an instance with no loops at all.
+*/
+static void
+measure_state(const LV2_Descriptor* descriptor, double seconds)
+{
+	const uint32_t block = 256;
+	const size_t frames = (size_t)(seconds * BENCH_RATE) + block;
+	float* dry = (float*)calloc(frames, sizeof(float));
+	float* restored = (float*)calloc(frames, sizeof(float));
+	char dir[] = "/tmp/alo-bench-XXXXXX";
+	Result r;
+
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Can't make a state directory\n");
+		exit(1);
+	}
+
+	Case c = { block, n_loops, false, false, false, 0, 0.0f, 0.0, NULL, NULL };
+	c.save_to = dir;
+	run_case(descriptor, &c, 1.0, NULL, &r);
+	const double save_ms = r.save_ms;
+	const long state_kb = directory_kb(dir, false);
+
+	const double rates[] = { BENCH_RATE, OTHER_RATE };
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		Case play = { block, 0, false, false, false, 0, 0.0f, 0.0, NULL, NULL };
+		play.rate = rates[i];
+		run_case(descriptor, &play, seconds, dry, &r);
+		play.restore_from = dir;
+		run_case(descriptor, &play, seconds, restored, &r);
+
+		double level = 0.0;
+		for (size_t k = 0; k < frames; k++) {
+			const double d = (double)restored[k] - dry[k];
+			level += d * d;
+		}
+		printf("{\"case\":\"state\",\"variant\":%u,\"loops\":%u,\"rate\":%.0f,"
+		       "\"save_ms\":%.2f,\"state_kb\":%ld,\"restore_us\":%.1f,"
+		       "\"restored_db\":%.2f}\n", n_loops, n_loops, rates[i], save_ms,
+		       state_kb, r.restore_us, 10.0 * log10(level / frames));
+	}
+
+	clear_properties();
+	directory_kb(dir, true);
+	rmdir(dir);
+	free(restored);
+	free(dry);
+}
+
+int
+main(int argc, char** argv)
+{
+	static const uint32_t blocks[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+	double seconds = 10.0;
+	uint32_t only_block = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:n:c:dlt")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'b':
+			only_block = (uint32_t)atoi(optarg);
+			break;
+		case 'n':
+			n_loops = (uint32_t)atoi(optarg);
+			break;
+		case 'c':
+			n_channels = (uint32_t)atoi(optarg);
+			break;
+		case 'd':
+			matrix_storage = 2;
+			break;
+		case 'l':
+			load_meter = true;
+			break;
+		case 't':
+			tracing = true;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds] [-b block_size] [-n loops] [-c channels] [-d] [-l] [-t]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (only_block > MAX_BLOCK) {
+		fprintf(stderr, "Block size must be at most %d\n", MAX_BLOCK);
+		return 1;
+	}
+
+	const LV2_Descriptor* descriptor = find_variant(n_loops, n_channels);
+	if (!descriptor) {
+		fprintf(stderr, "No %u loop, %u channel variant of the plugin\n", n_loops, n_channels);
+		return 1;
+	}
+	make_pattern();
+
+	// none, one, half and all of the loops
+	const uint32_t loops[] = { 0, 1, n_loops / 2, n_loops };
+
+	for (size_t b = 0; b < sizeof(blocks) / sizeof(blocks[0]); b++) {
+		if (only_block && blocks[b] != only_block) {
+			continue;
+		}
+		for (size_t l = 0; l < sizeof(loops) / sizeof(loops[0]); l++) {
+			if (l && loops[l] == loops[l - 1]) {
+				continue;
+			}
+			for (int mode = 0; mode < 2; mode++) {
+				for (int click = 0; click < 2; click++) {
+					const Case c = { blocks[b], loops[l], mode == 1, click == 1,
+							 false, matrix_storage, 0.0f, 0.0, NULL, NULL };
+					Result r;
+					run_case(descriptor, &c, seconds, NULL, &r);
+					print_result(&c, &r);
+				}
+			}
+		}
+	}
+
+	measure_snr(descriptor, seconds, 1, "pcm16");
+	measure_snr(descriptor, seconds, 2, "disk");
+	measure_state(descriptor, seconds);
+	measure_click(descriptor, seconds);
+	measure_stretch(descriptor, seconds, 1.05f);
+	measure_pool(descriptor, seconds);
+	measure_export(descriptor, seconds);
+	measure_midi(descriptor, seconds);
+	measure_overview(descriptor, seconds);
+	measure_levels(descriptor, seconds);
+	measure_capture(descriptor, seconds);
+	const bool same = measure_block_sizes(descriptor, seconds);
+	if (tracing) {
+		printf("{\"case\":\"trace\",\"lines\":%llu}\n",
+		       (unsigned long long)log_lines);
+	}
+	return same ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/*
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/**
+   The host that alo-bench, alo-render and alo-rtcheck give the plugin: port
+   indices, a urid:map, a worker whose jobs are done between (never during)
+   calls to run(), and the time:Position and variant lookup they all need.
+
+   Each tool defines its own log_vprintf(), for what becomes of the plugin's
+   log: alo-bench counts it, alo-render prints it and alo-rtcheck drops it.
+*/
+
+#ifndef ALO_HOST_H
+#define ALO_HOST_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/log/log.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#define MAX_URIS 128
+#define MAX_MESSAGES 64
+#define MAX_MESSAGE_SIZE 256
+#define MAX_LOOPS 16
+#define MAX_CHANNELS 4
+#define ALO_URI "http://devcurmudgeon.com/alo"
+
+/**
+   Port indices, as in alo.ttl.  Other variants have one input and one output
+   per channel, then one switch per loop, and the ports from PORT_THRESHOLD on
+   follow after them: see port_index().
+*/
+typedef enum {
+	PORT_INPUT_L = 0,
+	PORT_INPUT_R = 1,
+	PORT_OUTPUT_L = 2,
+	PORT_OUTPUT_R = 3,
+	PORT_LOOP1 = 4,
+	PORT_THRESHOLD = 10,
+	PORT_MIDIIN = 11,
+	PORT_MIDI_BASE = 12,
+	PORT_INSTANT_LOOPS = 13,
+	PORT_CLICK = 14,
+	PORT_BARS = 15,
+	PORT_CONTROL = 16,
+	PORT_MIX = 17,
+	PORT_RESET_MODE = 18,
+	PORT_ENABLED = 19,
+	PORT_MAX_LOOP = 20,
+	PORT_ONSET_MODE = 21,
+	PORT_STORAGE = 22,
+	PORT_LOAD_METER = 23,
+	PORT_LOAD = 24,
+	PORT_LOAD_PEAK = 25,
+	PORT_NOTIFY = 26,
+	PORT_TRACE = 27,
+	PORT_CLICK_OUT = 28,
+	PORT_CLICK_ROUTE = 29,
+	PORT_FREEWHEEL = 30,
+	PORT_EXPORT = 31,
+	PORT_MIDI_CHANNEL = 32,
+	PORT_METERS = 33,
+	PORT_INPUT_PEAK = 34,
+	PORT_INPUT_RMS = 35,
+	PORT_OUTPUT_PEAK = 36,
+	PORT_OUTPUT_RMS = 37,
+	PORT_CAPTURE = 38,
+	NUM_PORTS,
+	PORT_LOOP1_PEAK = NUM_PORTS	// then rms, and the same for each loop after it
+} Port;
+
+typedef struct {
+	uint64_t data[MAX_MESSAGE_SIZE / 8]; // aligned, as a host's would be
+	uint32_t size;
+} Message;
+
+/** What the plugin has asked its worker for, one per instance */
+typedef struct {
+	Message  jobs[MAX_MESSAGES];
+	uint32_t n_jobs;
+	Message  responses[MAX_MESSAGES];
+	uint32_t n_responses;
+} WorkQueue;
+
+static char*           uris[MAX_URIS];
+static uint32_t        n_uris = 0;
+static pthread_mutex_t uri_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list ap);
+
+/**
+   The index of a port from PORT_THRESHOLD on, or of a loop's level meter, in
+   the variant with this many loops and channels.
+*/
+static inline uint32_t
+port_index(uint32_t port, uint32_t loops, uint32_t channels)
+{
+	return port + loops - 6 + 2 * channels - 4;
+}
+
+/**
+   Connect the loop switches, the ports from PORT_THRESHOLD on and the loops'
+   level meters.  The atom ports and the click output get the buffers given,
+   and the other ports their place in controls.  The audio ports are left to
+   the caller.
+*/
+static inline void
+connect_controls(const LV2_Descriptor* descriptor, LV2_Handle handle,
+		 uint32_t loops, uint32_t channels, float* switches,
+		 float* controls, float* levels, void* midi_buf,
+		 void* control_buf, void* notify_buf, float* click_out)
+{
+	for (uint32_t i = 0; i < loops; i++) {
+		descriptor->connect_port(handle, 2 * channels + i, &switches[i]);
+	}
+	for (uint32_t p = PORT_THRESHOLD; p < NUM_PORTS; p++) {
+		const uint32_t index = port_index(p, loops, channels);
+		switch (p) {
+		case PORT_CLICK_OUT: descriptor->connect_port(handle, index, click_out);  break;
+		case PORT_MIDIIN:   descriptor->connect_port(handle, index, midi_buf);    break;
+		case PORT_CONTROL:  descriptor->connect_port(handle, index, control_buf); break;
+		case PORT_NOTIFY:   descriptor->connect_port(handle, index, notify_buf);  break;
+		default:            descriptor->connect_port(handle, index, &controls[p]);
+		}
+	}
+	for (uint32_t i = 0; i < 2 * loops; i++) {
+		descriptor->connect_port(handle, port_index(PORT_LOOP1_PEAK + i, loops, channels),
+					 &levels[i]);
+	}
+}
+
+/** Instances on other threads map too, so the table is locked */
+static inline LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri)
+{
+	pthread_mutex_lock(&uri_lock);
+	for (uint32_t i = 0; i < n_uris; i++) {
+		if (!strcmp(uris[i], uri)) {
+			pthread_mutex_unlock(&uri_lock);
+			return i + 1;
+		}
+	}
+	if (n_uris == MAX_URIS) {
+		fprintf(stderr, "Too many URIs\n");
+		exit(1);
+	}
+	uris[n_uris] = strdup(uri);
+	const LV2_URID urid = ++n_uris;
+	pthread_mutex_unlock(&uri_lock);
+	return urid;
+}
+
+static inline LV2_Worker_Status
+queue_message(Message* queue, uint32_t* count, uint32_t size, const void* data)
+{
+	if (*count == MAX_MESSAGES || size > MAX_MESSAGE_SIZE) {
+		return LV2_WORKER_ERR_NO_SPACE;
+	}
+	queue[*count].size = size;
+	memcpy(queue[*count].data, data, size);
+	*count += 1;
+	return LV2_WORKER_SUCCESS;
+}
+
+static inline int
+log_printf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	const int ret = log_vprintf(handle, type, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+
+/** The handle is the instance's WorkQueue */
+static inline LV2_Worker_Status
+schedule_work(LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data)
+{
+	WorkQueue* const q = (WorkQueue*)handle;
+	return queue_message(q->jobs, &q->n_jobs, size, data);
+}
+
+static inline LV2_Worker_Status
+respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data)
+{
+	WorkQueue* const q = (WorkQueue*)handle;
+	return queue_message(q->responses, &q->n_responses, size, data);
+}
+
+/**
+   Do the work run() asked for, then hand the responses back, as a host's
+   worker thread would between cycles.
+*/
+static inline void
+run_worker(const LV2_Worker_Interface* worker, LV2_Handle handle, WorkQueue* q)
+{
+	for (uint32_t i = 0; i < q->n_jobs; i++) {
+		worker->work(handle, respond, q, q->jobs[i].size, q->jobs[i].data);
+	}
+	q->n_jobs = 0;
+	for (uint32_t i = 0; i < q->n_responses; i++) {
+		worker->work_response(handle, q->responses[i].size, q->responses[i].data);
+	}
+	q->n_responses = 0;
+	if (worker->end_run) {
+		worker->end_run(handle);
+	}
+}
+
+static inline double
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** A time:Position at this frame, beat counted from the start of bar 1 */
+static inline void
+forge_position(LV2_Atom_Forge* forge, uint32_t time, double beat, float bpm,
+	       float bpb, float speed)
+{
+	LV2_Atom_Forge_Frame frame;
+	lv2_atom_forge_frame_time(forge, time);
+	lv2_atom_forge_object(forge, &frame, 0, map_uri(NULL, LV2_TIME__Position));
+	lv2_atom_forge_key(forge, map_uri(NULL, LV2_TIME__barBeat));
+	lv2_atom_forge_float(forge, (float)fmod(beat, bpb));
+	lv2_atom_forge_key(forge, map_uri(NULL, LV2_TIME__beatsPerMinute));
+	lv2_atom_forge_float(forge, bpm);
+	lv2_atom_forge_key(forge, map_uri(NULL, LV2_TIME__beatsPerBar));
+	lv2_atom_forge_float(forge, bpb);
+	lv2_atom_forge_key(forge, map_uri(NULL, LV2_TIME__speed));
+	lv2_atom_forge_float(forge, speed);
+	lv2_atom_forge_pop(forge, &frame);
+}
+
+/** The variant of the plugin for this many loops and channels, if there is one */
+static inline const LV2_Descriptor*
+find_variant(uint32_t loops, uint32_t channels)
+{
+	char uri[64];
+	if (loops == 6 && channels == 1) {
+		snprintf(uri, sizeof(uri), "%s-mono", ALO_URI);
+	} else if (loops == 6 && channels == 4) {
+		snprintf(uri, sizeof(uri), "%s-quad", ALO_URI);
+	} else if (loops == 6 && channels == 2) {
+		snprintf(uri, sizeof(uri), "%s", ALO_URI);
+	} else if (channels == 2) {
+		snprintf(uri, sizeof(uri), "%s-%u", ALO_URI, loops);
+	} else {
+		return NULL;
+	}
+	for (uint32_t i = 0; lv2_descriptor(i); i++) {
+		if (!strcmp(lv2_descriptor(i)->URI, uri)) {
+			return lv2_descriptor(i);
+		}
+	}
+	return NULL;
+}
+
+#endif  // ALO_HOST_H
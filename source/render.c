@@ -0,0 +1,822 @@
+/*
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/**
+   alo-render bounces takes to WAV files as fast as the machine will go.  A
+   take is a WAV file of the input, captured dry, and the events played along
+   with it: transport, loop buttons and control changes.  Like alo-bench it is
+   linked against alo.c and goes in through lv2_descriptor(), but as a host
+   that is freewheeling: the plugin's freewheel port is set, and the worker's
+   jobs are done between calls to run(), so nothing ever waits on the clock
+   and the same take always renders the same.
+
+   Every take is its own instance of the plugin, picked by the take's channel
+   count, and the instances are spread over a thread per core.  With -k each
+   take also gets a second instance, with [MIX] held at 100, whose output is
+   the loops alone.
+
+   Usage: alo-render [-j threads] [-b block_size] [-n loops] [-k] [-o dir] take.wav...
+
+   The events for take.wav are read from take.events next to it, if there is
+   one.  Each line is a time in seconds and what happens then:
+
+     0.0 tempo 120 4     transport rolls at 120 bpm, 4 beats to the bar
+     9.5 stop            transport stops
+     1.0 note 60 on      MIDI note on (or off) on the plugin's MIDI input
+     4.0 cc 20 100       MIDI control change, controller 20 to 100
+     6.0 program 3       MIDI program change
+     2.0 loop3 1         loop switch 3 on (or 0 for off)
+     2.0 mix 75          any other input control, by its symbol in alo.ttl
+     30.0 end            render at least this long, for loops to play out
+
+   Anything after a # is a comment.  Controls start at the plugin's defaults,
+   except [CLICK], which is off.  Output goes to dir/take-alo.wav, and with -k
+   dir/take-loops.wav, as 32 bit float at the take's rate.  One JSON object is
+   printed for each file written, and one for the whole run.
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/log/log.h"
+#include "lv2/lv2plug.in/ns/ext/midi/midi.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "host.h"
+
+#define RENDER_BLOCK 1024	// default frames per run()
+#define MAX_BLOCK 8192
+#define SEQ_SIZE 16384
+#define MAX_JOBS 1024
+#define DEFAULT_BPB 4.0f
+
+#define WAV_PCM 1
+#define WAV_FLOAT 3
+#define WAV_EXTENSIBLE 0xFFFE
+
+/** Input controls that events can set, and where they start */
+static const struct {
+	const char* symbol;
+	Port        port;
+	float       value;
+} control_ports[] = {
+	{ "threshold",     PORT_THRESHOLD,     -40.0f },
+	{ "midi_base",     PORT_MIDI_BASE,     60.0f },
+	{ "instant_loops", PORT_INSTANT_LOOPS, 0.0f },
+	{ "click",         PORT_CLICK,         0.0f },	// 1 in alo.ttl
+	{ "bars",          PORT_BARS,          2.0f },
+	{ "mix",           PORT_MIX,           50.0f },
+	{ "reset_mode",    PORT_RESET_MODE,    3.0f },
+	{ "ENABLED",       PORT_ENABLED,       1.0f },
+	{ "max_loop",      PORT_MAX_LOOP,      60.0f },
+	{ "onset",         PORT_ONSET_MODE,    0.0f },
+	{ "storage",       PORT_STORAGE,       0.0f },
+	{ "load_meter",    PORT_LOAD_METER,    0.0f },
+	{ "trace",         PORT_TRACE,         0.0f },
+	{ "click_route",   PORT_CLICK_ROUTE,   0.0f },
+	{ "export",        PORT_EXPORT,        0.0f },
+	{ "midi_channel",  PORT_MIDI_CHANNEL,  0.0f },
+	{ "meters",        PORT_METERS,        0.0f },
+	{ "capture",       PORT_CAPTURE,       0.0f },
+};
+
+typedef enum {
+	STEM_MIX,	// the plugin's output, as the take set it up
+	STEM_LOOPS,	// with [MIX] held at 100, so only the loops
+	NUM_STEMS
+} Stem;
+
+static const char* const stem_names[NUM_STEMS] = { "alo", "loops" };
+
+typedef enum {
+	EVENT_TEMPO,	// a: beats per minute, b: beats per bar
+	EVENT_STOP,
+	EVENT_NOTE_ON,	// a: note number
+	EVENT_NOTE_OFF,
+	EVENT_CC,	// a: controller, b: value
+	EVENT_PROGRAM,	// a: program
+	EVENT_SWITCH,	// a: loop, from 0, b: value
+	EVENT_CONTROL,	// a: Port, b: value
+	EVENT_END
+} EventType;
+
+typedef struct {
+	uint64_t  frame;
+	uint32_t  line;		// keeps events on the same frame in file order
+	EventType type;
+	float     a;
+	float     b;
+} Event;
+
+typedef struct {
+	FILE*    file;
+	uint16_t format;	// WAV_PCM or WAV_FLOAT
+	uint16_t channels;
+	uint16_t bits;
+	uint32_t rate;
+	uint64_t frames;	// in the data chunk
+} WavFile;
+
+typedef struct {
+	const char* take;
+	Stem        stem;
+	uint64_t    frames;	// of input, to hand out the longest first
+	double      seconds;	// rendered...
+	double      render_ms;	// ...in this long
+	bool        failed;
+} Job;
+
+static pthread_mutex_t instance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Job      jobs[MAX_JOBS];
+static uint32_t n_jobs = 0;
+static uint32_t next_job = 0;	// taken by the threads in turn
+static uint32_t n_loops = 6;
+static uint32_t block = RENDER_BLOCK;
+static const char* out_dir = ".";
+
+/** The plugin's log goes to stderr, with the take it is about */
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list ap)
+{
+	char line[256];
+	const int ret = vsnprintf(line, sizeof(line), fmt, ap);
+	fprintf(stderr, "%s: %s", ((const Job*)handle)->take, line);
+	return ret;
+}
+
+static uint32_t
+le16(const uint8_t* p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+le32(const uint8_t* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+put16(uint8_t* p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8 & 0xff;
+}
+
+static void
+put32(uint8_t* p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+/**
+   Open a WAV file and leave it at the start of the samples.  Integer PCM of
+   16, 24 or 32 bits and 32 bit float are understood, plainly or in
+   WAVE_FORMAT_EXTENSIBLE.
+*/
+static const char*
+wav_open(WavFile* w, const char* path)
+{
+	uint8_t header[12], chunk[8], fmt[40];
+	bool have_fmt = false;
+
+	memset(w, 0, sizeof(*w));
+	if (!(w->file = fopen(path, "rb"))) {
+		return strerror(errno);
+	}
+	if (fread(header, 1, 12, w->file) != 12 || memcmp(header, "RIFF", 4)
+	    || memcmp(header + 8, "WAVE", 4)) {
+		return "not a WAV file";
+	}
+	while (fread(chunk, 1, 8, w->file) == 8) {
+		const uint32_t size = le32(chunk + 4);
+		if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+			const uint32_t keep = size < sizeof(fmt) ? size : sizeof(fmt);
+			if (fread(fmt, 1, keep, w->file) != keep) {
+				break;
+			}
+			fseek(w->file, size - keep + (size & 1), SEEK_CUR);
+			w->format = le16(fmt);
+			w->channels = le16(fmt + 2);
+			w->rate = le32(fmt + 4);
+			w->bits = le16(fmt + 14);
+			if (w->format == WAV_EXTENSIBLE && keep >= 26) {
+				w->format = le16(fmt + 24);	// the sub format GUID starts with it
+			}
+			have_fmt = true;
+		} else if (!memcmp(chunk, "data", 4) && have_fmt) {
+			const bool pcm = w->format == WAV_PCM
+				&& (w->bits == 16 || w->bits == 24 || w->bits == 32);
+			const bool flt = w->format == WAV_FLOAT && w->bits == 32;
+			if (!pcm && !flt) {
+				return "only 16, 24 or 32 bit PCM and 32 bit float are supported";
+			}
+			if (!w->channels || !w->rate) {
+				return "no channels or no sample rate";
+			}
+			w->frames = size / (w->channels * (w->bits / 8));
+			return NULL;
+		} else {
+			fseek(w->file, size + (size & 1), SEEK_CUR);
+		}
+	}
+	return "no audio in file";
+}
+
+/**
+   Read up to frames frames into one buffer per channel, as floats, and
+   silence after the end of the file.  Returns the frames actually read.
+*/
+static uint32_t
+wav_read(WavFile* w, float* const* planar, uint32_t frames, uint8_t* scratch)
+{
+	const uint32_t bytes = w->bits / 8;
+	const uint32_t want = frames < w->frames ? frames : (uint32_t)w->frames;
+	const uint32_t got = (uint32_t)fread(scratch, w->channels * bytes, want, w->file);
+
+	w->frames -= got;
+	for (uint32_t i = 0; i < got; i++) {
+		for (uint32_t c = 0; c < w->channels; c++) {
+			const uint8_t* const p = scratch + (i * w->channels + c) * bytes;
+			float v;
+			if (w->format == WAV_FLOAT) {
+				memcpy(&v, p, sizeof(v));
+			} else if (bytes == 2) {
+				v = (int16_t)le16(p) / 32768.0f;
+			} else if (bytes == 3) {
+				v = (int32_t)((uint32_t)p[0] << 8 | p[1] << 16 | (uint32_t)p[2] << 24)
+					/ 2147483648.0f;
+			} else {
+				v = (int32_t)le32(p) / 2147483648.0f;
+			}
+			planar[c][i] = v;
+		}
+	}
+	for (uint32_t c = 0; c < w->channels; c++) {
+		memset(planar[c] + got, 0, (frames - got) * sizeof(float));
+	}
+	return got;
+}
+
+/** Write the header of a 32 bit float WAV file, or with frames, rewrite it */
+static bool
+wav_header(FILE* f, uint16_t channels, uint32_t rate, uint64_t frames)
+{
+	const uint32_t data = (uint32_t)(frames * channels * sizeof(float));
+	uint8_t h[58];
+
+	memcpy(h, "RIFF", 4);
+	put32(h + 4, sizeof(h) - 8 + data);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put32(h + 16, 18);
+	put16(h + 20, WAV_FLOAT);
+	put16(h + 22, channels);
+	put32(h + 24, rate);
+	put32(h + 28, rate * channels * sizeof(float));
+	put16(h + 32, channels * sizeof(float));
+	put16(h + 34, 32);
+	put16(h + 36, 0);
+	memcpy(h + 38, "fact", 4);
+	put32(h + 42, 4);
+	put32(h + 46, (uint32_t)frames);
+	memcpy(h + 50, "data", 4);
+	put32(h + 54, data);
+	return fseek(f, 0, SEEK_SET) == 0 && fwrite(h, 1, sizeof(h), f) == sizeof(h);
+}
+
+static bool
+wav_write(FILE* f, const float* const* planar, uint32_t channels, uint32_t frames,
+	  float* scratch)
+{
+	for (uint32_t i = 0; i < frames; i++) {
+		for (uint32_t c = 0; c < channels; c++) {
+			scratch[i * channels + c] = planar[c][i];
+		}
+	}
+	return fwrite(scratch, channels * sizeof(float), frames, f) == frames;
+}
+
+static int
+compare_events(const void* a, const void* b)
+{
+	const Event* const x = (const Event*)a;
+	const Event* const y = (const Event*)b;
+	if (x->frame != y->frame) {
+		return x->frame < y->frame ? -1 : 1;
+	}
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/**
+   Read a take's events, in order of time.  A missing file is no events; a
+   line that can't be understood is an error.
+*/
+static const char*
+read_events(const char* path, double rate, Event** events, uint32_t* count)
+{
+	char line[256];
+	uint32_t size = 0, number = 0;
+	FILE* f = fopen(path, "r");
+
+	*events = NULL;
+	*count = 0;
+	if (!f) {
+		return errno == ENOENT ? NULL : strerror(errno);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char what[32], arg[32];
+		double seconds;
+		float a = 0.0f;
+		Event e;
+
+		number++;
+		line[strcspn(line, "#")] = '\0';
+		const int n = sscanf(line, "%lf %31s %f %31s", &seconds, what, &a, arg);
+		if (n <= 0) {
+			continue;
+		}
+		if (n < 2 || seconds < 0.0) {
+			fclose(f);
+			return "an event needs a time and what happens";
+		}
+		e.frame = (uint64_t)llround(seconds * rate);
+		e.line = number;
+		e.a = a;
+		e.b = 0.0f;
+		if (!strcmp(what, "tempo") && n >= 3 && a > 0.0f) {
+			e.type = EVENT_TEMPO;
+			e.b = n == 4 ? (float)atof(arg) : DEFAULT_BPB;
+		} else if (!strcmp(what, "stop")) {
+			e.type = EVENT_STOP;
+		} else if (!strcmp(what, "end")) {
+			e.type = EVENT_END;
+		} else if (!strcmp(what, "note") && n == 4 && a >= 0.0f && a < 128.0f
+			   && (!strcmp(arg, "on") || !strcmp(arg, "off"))) {
+			e.type = strcmp(arg, "on") ? EVENT_NOTE_OFF : EVENT_NOTE_ON;
+		} else if (!strcmp(what, "cc") && n == 4 && a >= 0.0f && a < 128.0f
+			   && atoi(arg) >= 0 && atoi(arg) < 128) {
+			e.type = EVENT_CC;
+			e.b = (float)atoi(arg);
+		} else if (!strcmp(what, "program") && n == 3 && a >= 0.0f && a < 128.0f) {
+			e.type = EVENT_PROGRAM;
+		} else if (!strncmp(what, "loop", 4) && n == 3 && atoi(what + 4) >= 1
+			   && (uint32_t)atoi(what + 4) <= n_loops) {
+			e.type = EVENT_SWITCH;
+			e.b = a;
+			e.a = (float)(atoi(what + 4) - 1);
+		} else {
+			bool known = false;
+			for (size_t p = 0; p < sizeof(control_ports) / sizeof(control_ports[0]); p++) {
+				if (!strcmp(what, control_ports[p].symbol) && n == 3) {
+					e.type = EVENT_CONTROL;
+					e.a = (float)control_ports[p].port;
+					e.b = a;
+					known = true;
+				}
+			}
+			if (!known) {
+				fprintf(stderr, "%s:%u: don't know \"%s\"\n", path, number, what);
+				fclose(f);
+				free(*events);
+				*events = NULL;
+				return "bad event";
+			}
+		}
+		if (*count == size) {
+			size = size ? 2 * size : 64;
+			*events = (Event*)realloc(*events, size * sizeof(Event));
+		}
+		(*events)[(*count)++] = e;
+	}
+	fclose(f);
+	qsort(*events, *count, sizeof(Event), compare_events);
+	return NULL;
+}
+
+static bool
+is_midi(EventType type)
+{
+	return type == EVENT_NOTE_ON || type == EVENT_NOTE_OFF
+		|| type == EVENT_CC || type == EVENT_PROGRAM;
+}
+
+static void
+forge_midi(LV2_Atom_Forge* forge, uint32_t time, const Event* e)
+{
+	const uint8_t status = e->type == EVENT_NOTE_ON ? LV2_MIDI_MSG_NOTE_ON
+		: e->type == EVENT_NOTE_OFF ? LV2_MIDI_MSG_NOTE_OFF
+		: e->type == EVENT_CC ? LV2_MIDI_MSG_CONTROLLER : LV2_MIDI_MSG_PGM_CHANGE;
+	const uint8_t msg[3] = { status, (uint8_t)e->a,
+				 (uint8_t)(e->type == EVENT_CC ? e->b : 100) };
+	const uint32_t size = e->type == EVENT_PROGRAM ? 2 : 3;
+	lv2_atom_forge_frame_time(forge, time);
+	lv2_atom_forge_atom(forge, size, map_uri(NULL, LV2_MIDI__MidiEvent));
+	lv2_atom_forge_write(forge, msg, size);
+}
+
+/**
+   The file a job renders to: take.wav goes to dir/take-alo.wav, or
+   dir/take-loops.wav for the loops alone.
+*/
+static void
+output_path(const Job* job, char* path, size_t size)
+{
+	const char* const base = strrchr(job->take, '/') ? strrchr(job->take, '/') + 1 : job->take;
+	const char* const dot = strrchr(base, '.');
+	const int base_len = dot && dot > base ? (int)(dot - base) : (int)strlen(base);
+	snprintf(path, size, "%s/%.*s-%s.wav", out_dir, base_len, base, stem_names[job->stem]);
+}
+
+/**
+   Render one job.  Each call to run() is cut short at the next event that
+   isn't MIDI, so control changes land on their frame like MIDI does.  While
+   the transport rolls, every cycle starts with a time:Position, and so does
+   every beat within it, as a host would send them.
+*/
+static const char*
+render(Job* job)
+{
+	float           input[MAX_CHANNELS][MAX_BLOCK];
+	float           output[MAX_CHANNELS][MAX_BLOCK];
+	float           click_out[MAX_BLOCK];
+	float           interleaved[MAX_CHANNELS * MAX_BLOCK];
+	uint8_t         raw[MAX_CHANNELS * 4 * MAX_BLOCK];
+	uint64_t        control_buf[SEQ_SIZE / 8];
+	uint64_t        midi_buf[SEQ_SIZE / 8];
+	uint64_t        notify_buf[SEQ_SIZE / 8];
+	float           controls[NUM_PORTS] = { 0 };
+	float           switches[MAX_LOOPS] = { 0 };
+	float           levels[2 * MAX_LOOPS];	// each loop's peak and rms
+	char            path[4096];
+	WavFile         wav;
+	WorkQueue       queue;
+	Event*          events = NULL;
+	uint32_t        n_events = 0;
+
+	const char* error = wav_open(&wav, job->take);
+	if (error) {
+		if (wav.file) {
+			fclose(wav.file);
+		}
+		return error;
+	}
+	const uint32_t channels = wav.channels;
+	const LV2_Descriptor* const descriptor = find_variant(n_loops, channels);
+	if (!descriptor) {
+		fclose(wav.file);
+		return "no variant of the plugin for this many channels and loops";
+	}
+
+	// take.wav has its events in take.events
+	const char* const base = strrchr(job->take, '/') ? strrchr(job->take, '/') + 1 : job->take;
+	const char* const dot = strrchr(job->take, '.');
+	const int stem_len = dot && dot > base ? (int)(dot - job->take) : (int)strlen(job->take);
+	snprintf(path, sizeof(path), "%.*s.events", stem_len, job->take);
+	if ((error = read_events(path, wav.rate, &events, &n_events))) {
+		fclose(wav.file);
+		return error;
+	}
+	uint64_t total = wav.frames;
+	for (uint32_t e = 0; e < n_events; e++) {
+		if (events[e].type == EVENT_END && events[e].frame > total) {
+			total = events[e].frame;
+		}
+	}
+	output_path(job, path, sizeof(path));
+	FILE* const out = fopen(path, "wb");
+	if (!out || !wav_header(out, channels, wav.rate, 0)) {
+		if (out) {
+			fclose(out);
+		}
+		fclose(wav.file);
+		free(events);
+		return "can't write output";
+	}
+
+	LV2_URID_Map        map      = { NULL, map_uri };
+	LV2_Worker_Schedule schedule = { &queue, schedule_work };
+	LV2_Log_Log         logger   = { job, log_printf, log_vprintf };
+	const LV2_Feature   map_feature      = { LV2_URID__map, &map };
+	const LV2_Feature   schedule_feature = { LV2_WORKER__schedule, &schedule };
+	const LV2_Feature   log_feature      = { LV2_LOG__log, &logger };
+	const int32_t       nominal = (int32_t)block;	// events split some cycles
+	const LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__nominalBlockLength),
+		  sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &nominal },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	const LV2_Feature   options_feature  = { LV2_OPTIONS__options, (void*)options };
+	const LV2_Feature*  features[]       = {
+		&map_feature, &schedule_feature, &log_feature, &options_feature, NULL
+	};
+
+	queue.n_jobs = queue.n_responses = 0;
+	pthread_mutex_lock(&instance_lock);	// instantiation class, one at a time
+	LV2_Handle handle = descriptor->instantiate(descriptor, wav.rate, ".", features);
+	pthread_mutex_unlock(&instance_lock);
+	if (!handle) {
+		fclose(out);
+		fclose(wav.file);
+		free(events);
+		return "failed to instantiate plugin";
+	}
+	const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)
+		descriptor->extension_data(LV2_WORKER__interface);
+
+	for (size_t p = 0; p < sizeof(control_ports) / sizeof(control_ports[0]); p++) {
+		controls[control_ports[p].port] = control_ports[p].value;
+	}
+	controls[PORT_FREEWHEEL] = 1.0f;
+
+	float* inputs[MAX_CHANNELS];
+	const float* rendered[MAX_CHANNELS];
+	for (uint32_t ch = 0; ch < channels; ch++) {
+		inputs[ch] = input[ch];
+		rendered[ch] = output[ch];
+		descriptor->connect_port(handle, ch, input[ch]);
+		descriptor->connect_port(handle, channels + ch, output[ch]);
+	}
+	connect_controls(descriptor, handle, n_loops, channels, switches, controls,
+			 levels, midi_buf, control_buf, notify_buf, click_out);
+	descriptor->activate(handle);
+
+	LV2_Atom_Forge forge;
+	lv2_atom_forge_init(&forge, &map);
+
+	const double start = now_ns();
+	uint32_t next = 0;		// next event
+	bool rolling = false;
+	bool moved = true;		// transport changed, tell the plugin
+	float bpm = 120.0f;
+	float bpb = DEFAULT_BPB;
+	double beat = 0.0;
+
+	for (uint64_t frame = 0; frame < total && !error; ) {
+		// events that aren't MIDI take effect here, and end the cycle
+		for (; next < n_events && events[next].frame <= frame
+			     && !is_midi(events[next].type); next++) {
+			const Event* const e = &events[next];
+			switch (e->type) {
+			case EVENT_TEMPO:
+				if (!rolling || bpb != e->b) {
+					beat = 0.0;
+				}
+				rolling = true;
+				bpm = e->a;
+				bpb = e->b;
+				moved = true;
+				break;
+			case EVENT_STOP:
+				rolling = false;
+				moved = true;
+				break;
+			case EVENT_SWITCH:
+				switches[(uint32_t)e->a] = e->b;
+				break;
+			case EVENT_CONTROL:
+				controls[(uint32_t)e->a] = e->b;
+				break;
+			default:
+				break;
+			}
+		}
+		if (job->stem == STEM_LOOPS) {
+			controls[PORT_MIX] = 100.0f;
+		}
+		uint32_t len = total - frame < block ? (uint32_t)(total - frame) : block;
+		for (uint32_t e = next; e < n_events && events[e].frame < frame + len; e++) {
+			if (!is_midi(events[e].type) && events[e].frame > frame) {
+				len = (uint32_t)(events[e].frame - frame);
+				break;
+			}
+		}
+
+		wav_read(&wav, inputs, len, raw);
+
+		LV2_Atom_Forge_Frame seq_frame;
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)control_buf, sizeof(control_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		const double per_frame = bpm / 60.0 / wav.rate;
+		if (rolling) {
+			forge_position(&forge, 0, beat, bpm, bpb, 1.0f);
+			for (double b = floor(beat) + 1.0; ; b += 1.0) {
+				const uint32_t at = (uint32_t)ceil((b - beat) / per_frame);
+				if (at >= len) {
+					break;
+				}
+				forge_position(&forge, at, beat + at * per_frame, bpm, bpb, 1.0f);
+			}
+			beat += len * per_frame;
+		} else if (moved) {
+			forge_position(&forge, 0, 0.0, 0.0f, bpb, 0.0f);
+		}
+		moved = false;
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_buf, sizeof(midi_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		for (; next < n_events && events[next].frame < frame + len
+			     && is_midi(events[next].type); next++) {
+			forge_midi(&forge, (uint32_t)(events[next].frame - frame), &events[next]);
+		}
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		LV2_Atom* const notify = (LV2_Atom*)notify_buf;
+		notify->size = sizeof(notify_buf) - sizeof(LV2_Atom);
+		notify->type = 0;
+
+		descriptor->run(handle, len);
+		if (!wav_write(out, rendered, channels, len, interleaved)) {
+			error = "can't write output";
+		}
+		if (worker) {
+			run_worker(worker, handle, &queue);
+		}
+		frame += len;
+	}
+	job->render_ms = (now_ns() - start) / 1e6;
+	job->seconds = (double)total / wav.rate;
+
+	descriptor->deactivate(handle);
+	pthread_mutex_lock(&instance_lock);
+	descriptor->cleanup(handle);
+	pthread_mutex_unlock(&instance_lock);
+
+	if (!error && !wav_header(out, channels, wav.rate, total)) {
+		error = "can't write output";
+	}
+	if (fclose(out) && !error) {
+		error = "can't write output";
+	}
+	fclose(wav.file);
+	free(events);
+	return error;
+}
+
+/** Take jobs in turn until there are none left */
+static void*
+render_thread(void* arg)
+{
+	for (;;) {
+		const uint32_t j = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+		if (j >= n_jobs) {
+			return NULL;
+		}
+		Job* const job = &jobs[j];
+		const char* const error = render(job);
+		if (error) {
+			fprintf(stderr, "%s: %s\n", job->take, error);
+			job->failed = true;
+			continue;
+		}
+		printf("{\"take\":\"%s\",\"stem\":\"%s\",\"seconds\":%.2f,\"render_ms\":%.1f,"
+		       "\"speed\":%.1f}\n", job->take, stem_names[job->stem], job->seconds,
+		       job->render_ms, job->seconds * 1e3 / fmax(job->render_ms, 1e-3));
+		fflush(stdout);
+	}
+}
+
+/** Longest takes first, so the last thread to finish isn't left with one */
+static int
+compare_jobs(const void* a, const void* b)
+{
+	const Job* const x = (const Job*)a;
+	const Job* const y = (const Job*)b;
+	return x->frames < y->frames ? 1 : x->frames > y->frames ? -1 : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool stems = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:b:n:ko:")) != -1) {
+		switch (opt) {
+		case 'j':
+			n_threads = atol(optarg);
+			break;
+		case 'b':
+			block = (uint32_t)atoi(optarg);
+			break;
+		case 'n':
+			n_loops = (uint32_t)atoi(optarg);
+			break;
+		case 'k':
+			stems = true;
+			break;
+		case 'o':
+			out_dir = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j threads] [-b block_size] [-n loops] [-k] [-o dir] take.wav...\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Nothing to render\n");
+		return 1;
+	}
+	if (block == 0 || block > MAX_BLOCK) {
+		fprintf(stderr, "Block size must be 1 to %d\n", MAX_BLOCK);
+		return 1;
+	}
+	if (n_loops > MAX_LOOPS) {
+		fprintf(stderr, "No %u loop variant of the plugin\n", n_loops);
+		return 1;
+	}
+
+	for (int a = optind; a < argc; a++) {
+		WavFile wav;
+		const char* const error = wav_open(&wav, argv[a]);
+		if (wav.file) {
+			fclose(wav.file);
+		}
+		if (error) {
+			fprintf(stderr, "%s: %s\n", argv[a], error);
+			return 1;
+		}
+		for (int s = 0; s < (stems ? NUM_STEMS : 1); s++) {
+			if (n_jobs == MAX_JOBS) {
+				fprintf(stderr, "Too many takes\n");
+				return 1;
+			}
+			Job* const job = &jobs[n_jobs++];
+			job->take = argv[a];
+			job->stem = (Stem)s;
+			job->frames = wav.frames;
+		}
+	}
+	// two threads writing the same file would each spoil the other's
+	for (uint32_t j = 0; j < n_jobs; j++) {
+		char path[4096], other[4096];
+		output_path(&jobs[j], path, sizeof(path));
+		for (uint32_t k = 0; k < j; k++) {
+			output_path(&jobs[k], other, sizeof(other));
+			if (!strcmp(path, other)) {
+				fprintf(stderr, "%s and %s would both render to %s\n",
+					jobs[k].take, jobs[j].take, path);
+				return 1;
+			}
+		}
+	}
+	qsort(jobs, n_jobs, sizeof(Job), compare_jobs);
+
+	if (n_threads < 1) {
+		n_threads = 1;
+	}
+	if (n_threads > (long)n_jobs) {
+		n_threads = n_jobs;
+	}
+	pthread_t* const threads = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+	const double start = now_ns();
+	for (long t = 0; t < n_threads; t++) {
+		if (pthread_create(&threads[t], NULL, render_thread, NULL)) {
+			fprintf(stderr, "Can't start a render thread\n");
+			return 1;
+		}
+	}
+	double seconds = 0.0;
+	int failed = 0;
+	for (long t = 0; t < n_threads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	const double wall_ms = (now_ns() - start) / 1e6;
+	for (uint32_t j = 0; j < n_jobs; j++) {
+		seconds += jobs[j].seconds;
+		failed += jobs[j].failed;
+	}
+	printf("{\"case\":\"render\",\"files\":%u,\"failed\":%d,\"threads\":%ld,"
+	       "\"seconds\":%.2f,\"wall_ms\":%.1f,\"speed\":%.1f}\n", n_jobs, failed,
+	       n_threads, seconds, wall_ms, seconds * 1e3 / wall_ms);
+	free(threads);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,788 @@
+/*
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THIS SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/**
+   alo-rtcheck checks that run() stays real time safe: that it never
+   allocates or frees memory, touches files, asks the clock, sleeps or takes
+   a lock, whatever it is sent.  Like alo-bench it is linked against alo.c and
+   goes in through lv2_descriptor(), as the host in host.h, whose worker
+   runs jobs between calls to run().
+
+   The functions that aren't safe are defined here, ahead of the C library's,
+   and pass straight through to it, except while run() is being called: then
+   each call is reported with a backtrace (the addresses go to addr2line -f
+   -C -e alo-rtcheck, which is built with symbols).  The plugin is driven with
+   a random stream of cycle lengths, input, loop switches, MIDI notes,
+   controllers and program changes, transport changes and control port
+   moves, and the worker is sometimes left a few cycles behind.  The same
+   seed plays the same stream.
+
+   It prints one JSON object: how many cycles and events were sent, how many
+   calls were caught, and the longest run() took.  It exits with status 1 if
+   anything was caught.
+
+   Usage: alo-rtcheck [-s seconds] [-r seed] [-b block_size] [-n loops] [-c channels]
+
+   With -b every cycle is that long, and the plugin is told so, as hosts do;
+   otherwise cycles are anything up to 4096 frames, and now and then 0.  -n
+   and -c pick the variant, as for alo-bench.
+*/
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lv2/lv2plug.in/ns/ext/atom/forge.h"
+#include "lv2/lv2plug.in/ns/ext/buf-size/buf-size.h"
+#include "lv2/lv2plug.in/ns/ext/log/log.h"
+#include "lv2/lv2plug.in/ns/ext/midi/midi.h"
+#include "lv2/lv2plug.in/ns/ext/options/options.h"
+#include "lv2/lv2plug.in/ns/ext/time/time.h"
+#include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
+#include "lv2/lv2plug.in/ns/lv2core/lv2.h"
+
+#include "host.h"
+
+#define CHECK_RATE 48000.0
+#define MAX_BLOCK 4096
+#define SEQ_SIZE 8192
+#define MAX_REPORTS 8		// calls reported in full, the rest are only counted
+#define MAX_FRAMES 32		// deepest backtrace reported
+#define MIDI_BASE 60
+
+/**
+   A control port the fuzzer moves, and the range it moves it in.  Integer
+   ports get whole numbers.
+*/
+typedef struct {
+	Port  port;
+	float min;
+	float max;
+	bool  integer;
+} Control;
+
+static const Control controls_moved[] = {
+	{ PORT_THRESHOLD,     -60.0f, 0.0f,   false },
+	{ PORT_MIDI_BASE,     0.0f,   127.0f, true },
+	{ PORT_INSTANT_LOOPS, 0.0f,   6.0f,   true },	// up to n_loops, see move_control()
+	{ PORT_CLICK,         0.0f,   10.0f,  true },
+	{ PORT_BARS,          1.0f,   8.0f,   true },
+	{ PORT_MIX,           0.0f,   100.0f, false },
+	{ PORT_RESET_MODE,    0.0f,   3.0f,   true },
+	{ PORT_ENABLED,       0.0f,   1.0f,   true },
+	{ PORT_MAX_LOOP,      1.0f,   20.0f,  true },
+	{ PORT_ONSET_MODE,    0.0f,   1.0f,   true },
+	{ PORT_STORAGE,       0.0f,   2.0f,   true },
+	{ PORT_LOAD_METER,    0.0f,   1.0f,   true },
+	{ PORT_TRACE,         0.0f,   1.0f,   true },
+	{ PORT_CLICK_ROUTE,   0.0f,   1.0f,   true },
+	{ PORT_FREEWHEEL,     0.0f,   1.0f,   true },
+	{ PORT_EXPORT,        0.0f,   7.0f,   true },	// up to n_loops + 1
+	{ PORT_MIDI_CHANNEL,  0.0f,   16.0f,  true },
+	{ PORT_METERS,        0.0f,   1.0f,   true },
+	{ PORT_CAPTURE,       0.0f,   1.0f,   true },
+};
+
+static uint32_t n_loops = 6;	// which variant of the plugin to run...
+static uint32_t n_channels = 2;	// ...with this many channels
+static uint32_t seed = 1;
+static WorkQueue queue;
+static uint64_t cycle = 0;	// the cycle being run, for reports
+
+static __thread bool checking = false; // inside run(), and not already reporting
+static uint32_t violations = 0;
+
+/**
+   Called first by every function below.  Inside run(), report the call and
+   stop checking, so neither the report nor the real function's own calls
+   are caught again, until untrap().
+*/
+static bool
+trap(const char* what)
+{
+	if (!checking) {
+		return false;
+	}
+	checking = false;
+	violations++;
+	if (violations <= MAX_REPORTS) {
+		void* frames[MAX_FRAMES];
+		const int n = backtrace(frames, MAX_FRAMES);
+		fprintf(stderr, "alo-rtcheck: %s() called in run(), cycle %llu (seed %u)\n",
+			what, (unsigned long long)cycle, seed);
+		backtrace_symbols_fd(frames, n, STDERR_FILENO);
+	}
+	return true;
+}
+
+static inline void
+untrap(bool trapped)
+{
+	if (trapped) {
+		checking = true;
+	}
+}
+
+/** Look up the C library's version of a function defined here, once */
+#define LOOKUP(name) \
+	do { \
+		if (!real_##name) { \
+			real_##name = (__typeof__(real_##name))dlsym(RTLD_NEXT, #name); \
+		} \
+	} while (0)
+
+/** Pass a call through to the C library, trapping it inside run() */
+#define THROUGH(name, ...) \
+	do { \
+		LOOKUP(name); \
+		const bool trapped = trap(#name); \
+		const auto ret = real_##name(__VA_ARGS__); \
+		untrap(trapped); \
+		return ret; \
+	} while (0)
+
+#define TRAPPED __attribute__((visibility("default")))
+
+// Memory.  The C library's allocator is reached through its own names, as
+// dlsym() itself allocates.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void  __libc_free(void* ptr);
+
+TRAPPED void*
+malloc(size_t size) __THROW
+{
+	const bool trapped = trap("malloc");
+	void* const ret = __libc_malloc(size);
+	untrap(trapped);
+	return ret;
+}
+
+TRAPPED void*
+calloc(size_t n, size_t size) __THROW
+{
+	const bool trapped = trap("calloc");
+	void* const ret = __libc_calloc(n, size);
+	untrap(trapped);
+	return ret;
+}
+
+TRAPPED void*
+realloc(void* ptr, size_t size) __THROW
+{
+	const bool trapped = trap("realloc");
+	void* const ret = __libc_realloc(ptr, size);
+	untrap(trapped);
+	return ret;
+}
+
+TRAPPED void
+free(void* ptr) __THROW
+{
+	const bool trapped = trap("free");
+	__libc_free(ptr);
+	untrap(trapped);
+}
+
+static int (*real_posix_memalign)(void**, size_t, size_t);
+TRAPPED int
+posix_memalign(void** ptr, size_t alignment, size_t size) __THROW
+{
+	THROUGH(posix_memalign, ptr, alignment, size);
+}
+
+static void* (*real_mmap)(void*, size_t, int, int, int, off_t);
+TRAPPED void*
+mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) __THROW
+{
+	THROUGH(mmap, addr, length, prot, flags, fd, offset);
+}
+
+static int (*real_munmap)(void*, size_t);
+TRAPPED int
+munmap(void* addr, size_t length) __THROW
+{
+	THROUGH(munmap, addr, length);
+}
+
+static int (*real_mlock)(const void*, size_t);
+TRAPPED int
+mlock(const void* addr, size_t length) __THROW
+{
+	THROUGH(mlock, addr, length);
+}
+
+// Files
+static int (*real_open)(const char*, int, ...);
+TRAPPED int
+open(const char* path, int flags, ...)
+{
+	va_list ap;
+	va_start(ap, flags);
+	const mode_t mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+	va_end(ap);
+	THROUGH(open, path, flags, mode);
+}
+
+static int (*real_openat)(int, const char*, int, ...);
+TRAPPED int
+openat(int dir, const char* path, int flags, ...)
+{
+	va_list ap;
+	va_start(ap, flags);
+	const mode_t mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(ap, mode_t) : 0;
+	va_end(ap);
+	THROUGH(openat, dir, path, flags, mode);
+}
+
+static int (*real_close)(int);
+TRAPPED int
+close(int fd)
+{
+	THROUGH(close, fd);
+}
+
+static ssize_t (*real_read)(int, void*, size_t);
+TRAPPED ssize_t
+read(int fd, void* buf, size_t count)
+{
+	THROUGH(read, fd, buf, count);
+}
+
+static ssize_t (*real_write)(int, const void*, size_t);
+TRAPPED ssize_t
+write(int fd, const void* buf, size_t count)
+{
+	THROUGH(write, fd, buf, count);
+}
+
+static ssize_t (*real_pread)(int, void*, size_t, off_t);
+TRAPPED ssize_t
+pread(int fd, void* buf, size_t count, off_t offset)
+{
+	THROUGH(pread, fd, buf, count, offset);
+}
+
+static ssize_t (*real_pwrite)(int, const void*, size_t, off_t);
+TRAPPED ssize_t
+pwrite(int fd, const void* buf, size_t count, off_t offset)
+{
+	THROUGH(pwrite, fd, buf, count, offset);
+}
+
+static FILE* (*real_fopen)(const char*, const char*);
+TRAPPED FILE*
+fopen(const char* path, const char* mode)
+{
+	THROUGH(fopen, path, mode);
+}
+
+static int (*real_fclose)(FILE*);
+TRAPPED int
+fclose(FILE* f)
+{
+	THROUGH(fclose, f);
+}
+
+static size_t (*real_fwrite)(const void*, size_t, size_t, FILE*);
+TRAPPED size_t
+fwrite(const void* buf, size_t size, size_t n, FILE* f)
+{
+	THROUGH(fwrite, buf, size, n, f);
+}
+
+static size_t (*real_fread)(void*, size_t, size_t, FILE*);
+TRAPPED size_t
+fread(void* buf, size_t size, size_t n, FILE* f)
+{
+	THROUGH(fread, buf, size, n, f);
+}
+
+static int (*real_fflush)(FILE*);
+TRAPPED int
+fflush(FILE* f)
+{
+	THROUGH(fflush, f);
+}
+
+static int (*real_vfprintf)(FILE*, const char*, va_list);
+TRAPPED int
+vfprintf(FILE* f, const char* format, va_list ap)
+{
+	THROUGH(vfprintf, f, format, ap);
+}
+
+TRAPPED int
+fprintf(FILE* f, const char* format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	const int ret = vfprintf(f, format, ap);
+	va_end(ap);
+	return ret;
+}
+
+// The clock.  Monotonic clock_gettime() is read from the vDSO without a
+// system call, and the load meter uses it where there is no cycle counter.
+static int (*real_gettimeofday)(struct timeval*, void*);
+TRAPPED int
+gettimeofday(struct timeval* __restrict tv, void* __restrict tz) __THROW
+{
+	THROUGH(gettimeofday, tv, tz);
+}
+
+static int (*real_clock_gettime)(clockid_t, struct timespec*);
+TRAPPED int
+clock_gettime(clockid_t clock, struct timespec* ts) __THROW
+{
+	LOOKUP(clock_gettime);
+	const bool trapped = clock != CLOCK_MONOTONIC && clock != CLOCK_MONOTONIC_RAW
+		&& trap("clock_gettime");
+	const int ret = real_clock_gettime(clock, ts);
+	untrap(trapped);
+	return ret;
+}
+
+static time_t (*real_time)(time_t*);
+TRAPPED time_t
+time(time_t* t) __THROW
+{
+	THROUGH(time, t);
+}
+
+static int (*real_nanosleep)(const struct timespec*, struct timespec*);
+TRAPPED int
+nanosleep(const struct timespec* req, struct timespec* rem)
+{
+	THROUGH(nanosleep, req, rem);
+}
+
+static int (*real_usleep)(useconds_t);
+TRAPPED int
+usleep(useconds_t usec)
+{
+	THROUGH(usleep, usec);
+}
+
+// Locks
+static int (*real_pthread_mutex_lock)(pthread_mutex_t*);
+TRAPPED int
+pthread_mutex_lock(pthread_mutex_t* mutex) __THROWNL
+{
+	THROUGH(pthread_mutex_lock, mutex);
+}
+
+static int (*real_pthread_cond_wait)(pthread_cond_t*, pthread_mutex_t*);
+TRAPPED int
+pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+	THROUGH(pthread_cond_wait, cond, mutex);
+}
+}
+
+static uint32_t random_state = 1;
+
+/** xorshift, so a seed plays the same on any machine */
+static uint32_t
+random_u32(void)
+{
+	uint32_t x = random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return random_state = x;
+}
+
+/** Uniform in [0, n) */
+static uint32_t
+random_below(uint32_t n)
+{
+	return n ? random_u32() % n : 0;
+}
+
+static float
+random_float(float min, float max)
+{
+	return min + (max - min) * (random_u32() >> 8) / 16777216.0f;
+}
+
+static bool
+chance(float p)
+{
+	return random_float(0.0f, 1.0f) < p;
+}
+
+/** The trace goes nowhere: it is written by the worker, not by run() */
+static int
+log_vprintf(LV2_Log_Handle handle, LV2_URID type, const char* fmt, va_list ap)
+{
+	return 0;
+}
+
+/**
+   The host's idea of the transport, which the fuzzer starts, stops,
+   relocates and retempos.
+*/
+typedef struct {
+	bool   rolling;
+	float  bpm;
+	float  bpb;
+	double beat;	// beats since the start of bar 1
+} Transport;
+
+/**
+   A random MIDI message: mostly what the plugin listens for (loop notes,
+   its controllers, program changes), on its channel or another, and now and
+   then something it doesn't, or something cut short.
+*/
+static uint32_t
+random_midi(uint8_t* msg)
+{
+	const uint8_t channel = chance(0.8f) ? 0 : (uint8_t)random_below(16);
+	const uint32_t kind = random_below(16);
+
+	if (kind < 6) {
+		msg[0] = (uint8_t)((chance(0.5f) ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF) | channel);
+		msg[1] = (uint8_t)((MIDI_BASE - 2 + random_below(n_loops + 4)) & 0x7f);
+		msg[2] = chance(0.1f) ? 0 : (uint8_t)(1 + random_below(127));
+		return 3;
+	} else if (kind < 11) {
+		static const uint8_t ccs[] = { 20, 21, 22, 23, 24 };
+		const uint32_t pick = random_below(8);
+		msg[0] = (uint8_t)(LV2_MIDI_MSG_CONTROLLER | channel);
+		msg[1] = pick < 5 ? (pick == 2 && chance(0.9f) ? 20 : ccs[pick])
+			: pick < 7 ? (uint8_t)(102 + random_below(n_loops + 1))
+			: (uint8_t)random_below(128);
+		msg[2] = (uint8_t)random_below(128);
+		return 3;
+	} else if (kind < 13) {
+		msg[0] = (uint8_t)(LV2_MIDI_MSG_PGM_CHANGE | channel);
+		msg[1] = (uint8_t)random_below(128);
+		return 2;
+	} else if (kind < 15) {
+		msg[0] = (uint8_t)(LV2_MIDI_MSG_BENDER | channel);
+		msg[1] = (uint8_t)random_below(128);
+		msg[2] = (uint8_t)random_below(128);
+		return 1 + random_below(3);	// sometimes short
+	}
+	msg[0] = (uint8_t)(0xf0 + random_below(16));	// system messages
+	msg[1] = (uint8_t)random_below(128);
+	return 1 + random_below(2);
+}
+
+static void
+forge_midi(LV2_Atom_Forge* forge, uint32_t time)
+{
+	uint8_t msg[3];
+	const uint32_t size = random_midi(msg);
+	lv2_atom_forge_frame_time(forge, time);
+	lv2_atom_forge_atom(forge, size, map_uri(NULL, LV2_MIDI__MidiEvent));
+	lv2_atom_forge_write(forge, msg, size);
+}
+
+/** n random frames in [0, frames), in order */
+static void
+random_frames(uint32_t* times, uint32_t n, uint32_t frames)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		uint32_t t = random_below(frames);
+		uint32_t j = i;
+		for (; j > 0 && times[j - 1] > t; j--) {
+			times[j] = times[j - 1];
+		}
+		times[j] = t;
+	}
+}
+
+static void
+move_control(float* controls, const Control* c)
+{
+	float max = c->max;
+	if (c->port == PORT_INSTANT_LOOPS) {
+		max = (float)n_loops;
+	} else if (c->port == PORT_EXPORT) {
+		max = (float)(n_loops + 1);
+	}
+	float value = random_float(c->min, max + (c->integer ? 1.0f : 0.0f));
+	if (c->integer) {
+		value = floorf(value) < max ? floorf(value) : max;
+	}
+	// switching off wipes every cycle it stays off, so mostly leave it on
+	if (c->port == PORT_ENABLED && value == 0.0f && chance(0.7f)) {
+		value = 1.0f;
+	}
+	controls[c->port] = value;
+}
+
+/** Input: a tone that comes and goes, over a little noise, now and then loud */
+static void
+fill_input(float input[][MAX_BLOCK], uint32_t n, float* amplitude, double* phase)
+{
+	if (chance(0.02f)) {
+		*amplitude = chance(0.4f) ? 0.0f : chance(0.05f) ? 2.0f : random_float(0.0f, 0.8f);
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		const float noise = random_float(-0.0005f, 0.0005f);
+		for (uint32_t ch = 0; ch < n_channels; ch++) {
+			input[ch][i] = noise + *amplitude * (float)sin(*phase * (ch + 2));
+		}
+		*phase += 2 * M_PI * 110 / CHECK_RATE;
+	}
+	*phase = fmod(*phase, 2 * M_PI);
+}
+
+int
+main(int argc, char** argv)
+{
+	static float    input[MAX_CHANNELS][MAX_BLOCK];
+	static float    output[MAX_CHANNELS][MAX_BLOCK];
+	static float    click_out[MAX_BLOCK];
+	static uint64_t control_buf[SEQ_SIZE / 8];
+	static uint64_t midi_buf[SEQ_SIZE / 8];
+	static uint64_t notify_buf[SEQ_SIZE / 8];
+	float           controls[NUM_PORTS];
+	float           switches[MAX_LOOPS] = { 0 };
+	float           levels[2 * MAX_LOOPS];
+	double          seconds = 60.0;
+	uint32_t        fixed_block = 0;
+	int             opt;
+
+	while ((opt = getopt(argc, argv, "s:r:b:n:c:")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atof(optarg);
+			break;
+		case 'r':
+			seed = (uint32_t)strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			fixed_block = (uint32_t)atoi(optarg);
+			break;
+		case 'n':
+			n_loops = (uint32_t)atoi(optarg);
+			break;
+		case 'c':
+			n_channels = (uint32_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds] [-r seed] [-b block_size] [-n loops] [-c channels]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (fixed_block > MAX_BLOCK || n_loops > MAX_LOOPS || n_channels > MAX_CHANNELS) {
+		fprintf(stderr, "At most %d frames, %d loops and %d channels\n",
+			MAX_BLOCK, MAX_LOOPS, MAX_CHANNELS);
+		return 1;
+	}
+	random_state = seed ? seed : 1;
+
+	const LV2_Descriptor* descriptor = find_variant(n_loops, n_channels);
+	if (!descriptor) {
+		fprintf(stderr, "No %u loop, %u channel variant of the plugin\n", n_loops, n_channels);
+		return 1;
+	}
+
+	// exports go somewhere of our own, and are cleared up at the end
+	char dir[] = "/tmp/alo-rtcheck-XXXXXX";
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Can't make an export directory\n");
+		return 1;
+	}
+	setenv("ALO_EXPORT_DIR", dir, 1);
+
+	// backtrace() loads its unwinder the first time, so not in run()
+	void* warm[1];
+	backtrace(warm, 1);
+
+	LV2_URID_Map        map      = { NULL, map_uri };
+	LV2_Worker_Schedule schedule = { &queue, schedule_work };
+	LV2_Log_Log         logger   = { NULL, log_printf, log_vprintf };
+	const LV2_Feature   map_feature      = { LV2_URID__map, &map };
+	const LV2_Feature   schedule_feature = { LV2_WORKER__schedule, &schedule };
+	const LV2_Feature   log_feature      = { LV2_LOG__log, &logger };
+	const int32_t       block = (int32_t)fixed_block;
+	const LV2_Options_Option options[] = {
+		{ LV2_OPTIONS_INSTANCE, 0, map_uri(NULL, LV2_BUF_SIZE__nominalBlockLength),
+		  sizeof(int32_t), map_uri(NULL, LV2_ATOM__Int), &block },
+		{ LV2_OPTIONS_INSTANCE, 0, 0, 0, 0, NULL }
+	};
+	const LV2_Feature   options_feature  = { LV2_OPTIONS__options, (void*)options };
+	const LV2_Feature   fixed_feature    = { LV2_BUF_SIZE__fixedBlockLength, NULL };
+	const LV2_Feature*  features[]       = {
+		&map_feature, &schedule_feature, &log_feature,
+		fixed_block ? &options_feature : NULL, fixed_block ? &fixed_feature : NULL, NULL
+	};
+
+	LV2_Handle handle = descriptor->instantiate(descriptor, CHECK_RATE, ".", features);
+	if (!handle) {
+		fprintf(stderr, "Failed to instantiate plugin\n");
+		return 1;
+	}
+	const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)
+		descriptor->extension_data(LV2_WORKER__interface);
+
+	memset(controls, 0, sizeof(controls));
+	controls[PORT_THRESHOLD] = -40;
+	controls[PORT_MIDI_BASE] = MIDI_BASE;
+	controls[PORT_CLICK] = 5;
+	controls[PORT_BARS] = 1;
+	controls[PORT_MIX] = 50;
+	controls[PORT_RESET_MODE] = 3;
+	controls[PORT_ENABLED] = 1;
+	controls[PORT_MAX_LOOP] = 10;
+
+	for (uint32_t ch = 0; ch < n_channels; ch++) {
+		descriptor->connect_port(handle, ch, input[ch]);
+		descriptor->connect_port(handle, n_channels + ch, output[ch]);
+	}
+	connect_controls(descriptor, handle, n_loops, n_channels, switches, controls,
+			 levels, midi_buf, control_buf, notify_buf, click_out);
+	descriptor->activate(handle);
+
+	LV2_Atom_Forge forge;
+	lv2_atom_forge_init(&forge, &map);
+
+	Transport transport = { true, 120.0f, 4.0f, 0.0 };
+	const uint64_t total = (uint64_t)(seconds * CHECK_RATE);
+	float amplitude = 0.3f;
+	double phase = 0.0;
+	uint64_t frames = 0, events = 0;
+	double elapsed = 0.0, worst = 0.0;
+	uint32_t worst_frames = 0;
+
+	for (cycle = 0; frames < total; cycle++) {
+		static const uint32_t usual[] = { 32, 64, 128, 256, 512, 1024 };
+		const uint32_t n = fixed_block ? fixed_block
+			: chance(0.01f) ? 0
+			: chance(0.7f) ? usual[random_below(6)]
+			: 1 + random_below(MAX_BLOCK);
+		fill_input(input, n, &amplitude, &phase);
+
+		if (chance(0.05f)) {
+			const uint32_t i = random_below(n_loops);
+			switches[i] = switches[i] > 0.0f ? 0.0f : 1.0f;
+			events++;
+		}
+		if (chance(0.03f)) {
+			move_control(controls, &controls_moved[random_below(
+				sizeof(controls_moved) / sizeof(controls_moved[0]))]);
+			events++;
+		}
+
+		// The transport: where it is at the start of the cycle, as hosts
+		// send, and sometimes a change part way through
+		LV2_Atom_Forge_Frame seq_frame;
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)control_buf, sizeof(control_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		if (transport.rolling || chance(0.1f)) {
+			forge_position(&forge, 0, transport.beat, transport.bpm, transport.bpb,
+				       transport.rolling ? 1.0f : 0.0f);
+			events++;
+		}
+		if (n && chance(0.02f)) {
+			const uint32_t what = random_below(4);
+			if (what == 0) {
+				transport.rolling = !transport.rolling;
+			} else if (what == 1) {
+				transport.bpm = random_float(40.0f, 240.0f);
+			} else if (what == 2) {
+				transport.bpb = (float)(2 + random_below(6));
+			} else {
+				transport.beat = random_float(0.0f, 64.0f);
+			}
+			forge_position(&forge, random_below(n), transport.beat, transport.bpm,
+				       transport.bpb, transport.rolling ? 1.0f : 0.0f);
+			events++;
+		}
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		lv2_atom_forge_set_buffer(&forge, (uint8_t*)midi_buf, sizeof(midi_buf));
+		lv2_atom_forge_sequence_head(&forge, &seq_frame, 0);
+		if (n) {
+			uint32_t times[64];
+			const uint32_t count = chance(0.01f) ? 64 : chance(0.1f) ? 1 + random_below(4) : 0;
+			random_frames(times, count, n);
+			for (uint32_t k = 0; k < count; k++) {
+				forge_midi(&forge, times[k]);
+			}
+			events += count;
+		}
+		lv2_atom_forge_pop(&forge, &seq_frame);
+
+		LV2_Atom* const notify = (LV2_Atom*)notify_buf;
+		notify->size = sizeof(notify_buf) - sizeof(LV2_Atom);
+		notify->type = 0;
+
+		const double start = now_ns();
+		checking = true;
+		descriptor->run(handle, n);
+		checking = false;
+		const double took = now_ns() - start;
+
+		elapsed += took;
+		if (took > worst) {
+			worst = took;
+			worst_frames = n;
+		}
+		if (worker && chance(0.9f)) {
+			run_worker(worker, handle, &queue);
+		}
+		if (transport.rolling) {
+			transport.beat += n / CHECK_RATE * transport.bpm / 60.0;
+		}
+		frames += n;
+	}
+
+	if (worker) {
+		run_worker(worker, handle, &queue);
+	}
+	descriptor->deactivate(handle);
+	descriptor->cleanup(handle);
+
+	printf("{\"case\":\"rtcheck\",\"variant\":%u,\"channels\":%u,\"seed\":%u,\"block\":%u,"
+	       "\"seconds\":%.1f,\"cycles\":%llu,\"events\":%llu,\"violations\":%u,"
+	       "\"worst_run_us\":%.2f,\"worst_run_frames\":%u,\"ns_per_sample\":%.3f}\n",
+	       n_loops, n_channels, seed, fixed_block, frames / CHECK_RATE,
+	       (unsigned long long)cycle, (unsigned long long)events, violations, worst / 1e3,
+	       worst_frames, frames ? elapsed / frames : 0.0);
+
+	DIR* d = opendir(dir);
+	for (struct dirent* e = d ? readdir(d) : NULL; e; e = readdir(d)) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if (e->d_name[0] != '.') {
+			unlink(path);
+		}
+	}
+	if (d) {
+		closedir(d);
+	}
+	rmdir(dir);
+	return violations ? 1 : 0;
+}